@@ -10,33 +10,88 @@
 
 using namespace std;
 
-bool myNullPtr = false;
-
-Node::Node(int maxKeys)
+Node::Node(int maxKeys, float *keys, Address *pointers)
 {
-  // Initialize empty array of keys and pointers.
-  keys = new float[maxKeys];
-  pointers = new Address[maxKeys + 1];
+  this->keys = keys;
+  this->pointers = pointers;
 
   for (int i = 0; i < maxKeys + 1; i++)
   {
-    Address nullAddress{(void *)myNullPtr, 0};
+    Address nullAddress{nullptr, 0};
     pointers[i] = nullAddress;
   }
   numKeys = 0;
+  isLeaf = false;
 }
 
 BPlusTree::BPlusTree(std::size_t blockSize, MemoryPool *disk, MemoryPool *index)
+{
+  // Every kind of node takes up a whole block, until setNodeSizes says otherwise.
+  maxKeys = keysThatFit(blockSize);
+  maxInternalKeys = maxKeys;
+  maxLLKeys = maxKeys;
+
+  // Initialize root to NULL
+  rootAddress = nullptr;
+  root = nullptr;
+
+  // Set node size to be equal to block size.
+  nodeSize = blockSize;
+  internalNodeSize = blockSize;
+  LLNodeSize = blockSize;
+
+  // Initialize initial variables
+  levels = 0;
+  numNodes = 0;
+  frozenBlocks = 0;
+  splitPolicy = EVEN_SPLIT;
+  fillFactor = 0.9;
+  useVotesSummary = false;
+  cascadeDeletes = false;
+  lazyDeletes = false;
+  numTombstones = 0;
+  compactionRunning = false;
+  stopCompaction = false;
+  foregroundOps = 0;
+  openCursors = 0;
+  bufferedInserts = false;
+  bufferCapacity = 0;
+  nextMessageSeq = 0;
+  deltaTier = false;
+  deltaMergeThreshold = 0;
+  deltaSize = 0;
+  learnedIndex = false;
+  learnedMaxError = 0;
+  keyDirectory = false;
+  directoryScale = 10;
+  directoryMaxSlots = 0;
+  directoryFirstSlot = 0;
+  orphanedRecords = false;
+  pinnedLevels = 0;
+  pinnedStale = true;
+  pinnedAccessed = 0;
+
+  // Initialize disk space for index and set reference to disk.
+  
+  this->disk = disk;
+  this->index = index;
+}
+
+int BPlusTree::keysThatFit(std::size_t nodeSize)
 {
   // Get size left for keys and pointers in a node after accounting for node's isLeaf and numKeys attributes.
-  size_t nodeBufferSize = blockSize - sizeof(bool) - sizeof(int);
+  if (nodeSize < sizeof(bool) + sizeof(int))
+  {
+    throw std::overflow_error("Error: Keys and pointers too large to fit into a node!");
+  }
+  size_t nodeBufferSize = nodeSize - sizeof(bool) - sizeof(int);
 
   // Set max keys available in a node. Each key is a float, each pointer is a struct of {void *blockAddress, short int offset}.
   // Therefore, each key is 4 bytes. Each pointer is around 16 bytes.
 
   // Initialize node buffer with a pointer. P | K | P , always one more pointer than keys.
   size_t sum = sizeof(Address);
-  maxKeys = 0;
+  int maxKeys = 0;
 
   // Try to fit as many pointer key pairs as possible into the node block.
   while (sum + sizeof(Address) + sizeof(float) <= nodeBufferSize)
@@ -50,19 +105,47 @@ BPlusTree::BPlusTree(std::size_t blockSize, MemoryPool *disk, MemoryPool *index)
     throw std::overflow_error("Error: Keys and pointers too large to fit into a node!");
   }
 
-  // Initialize root to NULL
-  rootAddress = nullptr;
-  root = nullptr;
+  return maxKeys;
+}
 
-  // Set node size to be equal to block size.
-  nodeSize = blockSize;
+void BPlusTree::setNodeSizes(std::size_t internalNodeSize, std::size_t leafNodeSize, std::size_t LLNodeSize)
+{
+  if (rootAddress != nullptr)
+  {
+    throw std::logic_error("Node sizes can only be set on an empty tree!");
+  }
 
-  // Initialize initial variables
-  levels = 0;
-  numNodes = 0;
+  // Each node takes a whole block of its own, so a size without a size class of its own is rounded up to the
+  // blocks it's given.
+  std::size_t sizes[] = {internalNodeSize, leafNodeSize, LLNodeSize};
+  for (std::size_t &size : sizes)
+  {
+    if (index->getBlockSizeFor(size) < size)
+    {
+      throw std::invalid_argument("Node size larger than any block in the index!");
+    }
+    size = index->getBlockSizeFor(size);
+  }
+  internalNodeSize = sizes[0];
+  leafNodeSize = sizes[1];
+  LLNodeSize = sizes[2];
 
-  // Initialize disk space for index and set reference to disk.
-  
-  this->disk = disk;
-  this->index = index;
+  // Splitting an internal node pushes a key up and keeps at least one on each side, so it needs room for 2.
+  int maxInternalKeys = keysThatFit(internalNodeSize);
+  if (maxInternalKeys < 2)
+  {
+    throw std::overflow_error("Error: Internal nodes too small to hold 2 keys!");
+  }
+
+  this->maxKeys = keysThatFit(leafNodeSize);
+  this->maxInternalKeys = maxInternalKeys;
+  this->maxLLKeys = keysThatFit(LLNodeSize);
+  this->nodeSize = leafNodeSize;
+  this->internalNodeSize = internalNodeSize;
+  this->LLNodeSize = LLNodeSize;
+}
+
+BPlusTree::~BPlusTree()
+{
+  stopBackgroundCompaction();
 }
\ No newline at end of file
@@ -3,9 +3,20 @@
 
 #include "types.h"
 #include "memory_pool.h"
+#include "node_arena.h"
 
 #include <cstddef>
 #include <array>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <map>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 
 // A node in the B+ Tree.
 class Node
@@ -17,52 +28,492 @@ private:
   int numKeys;            // Current number of keys in this node.
   bool isLeaf;            // Whether this node is a leaf node.
   friend class BPlusTree; // Let the BPlusTree class access this class' private variables.
+  friend class NodeArena; // Let the arena find the node a copy was made from.
 
 public:
   // Methods
 
-  // Constructor
-  Node(int maxKeys); // Takes in max keys in a node.
+  // Constructor, for a node whose arrays were allocated for it (by a NodeArena), with room for maxKeys keys.
+  // Nodes only ever come from an arena, which finds a node's block from its keys when the node is recycled.
+  Node(int maxKeys, float *keys, Address *pointers);
+};
+
+// An insert or delete waiting in the buffer of an internal node (buffered insert mode).
+struct BufferedMessage
+{
+  float key;       // Key the message applies to.
+  Address address; // Disk address of the record to insert (unused for deletes).
+  bool isDelete;   // Whether this message deletes the key instead of inserting a record.
+  long seq;        // Order in which the message was issued, newer messages have larger numbers.
+};
+
+// The net effect of the buffered messages of a key, in the order they were issued.
+struct PendingRecords
+{
+  bool deleted;                 // Whether a buffered delete hides the records already in the tree.
+  std::vector<Address> inserts; // Records inserted after the last buffered delete (if any).
+};
+
+// What the planner expects a range search to cost, in blocks accessed, under each plan.
+struct QueryPlan
+{
+  ScanPlan plan;            // Cheapest plan.
+  int estimatedRecords;     // Records expected in range.
+  int indexScanBlocks;      // Blocks expected for an index scan.
+  int bitmapScanBlocks;     // Blocks expected for a bitmap scan.
+  int sequentialScanBlocks; // Blocks expected for a sequential scan, or -1 if the data pool holds unindexed records.
+};
+
+// A run of consecutive leaves whose lower bound keys a single line predicts the positions of, within maxError.
+struct LeafSegment
+{
+  float anchorKey;                   // Key the line passes through exactly.
+  int anchorPos;                     // Position of anchorKey in the segment.
+  double slope;                      // Predicted positions per unit of key.
+  std::vector<float> lowerBoundKeys; // Lower bound key of each leaf in the segment, sorted.
+  std::vector<void *> leaves;        // Disk address of each leaf in the segment.
+};
+
+// What a range delete has stripped out of the tree so far, and what it must rebalance and relink afterwards.
+struct RangeRemoval
+{
+  float lowerBoundKey;                        // Lower bound of the range being removed.
+  float upperBoundKey;                        // Upper bound of the range being removed.
+  std::vector<Address> LLHeads;               // Linked lists of the removed keys, freed in bulk at the end.
+  std::vector<std::vector<void *>> keptNodes; // Nodes kept on the left and right boundary paths, by level (root first).
+  Address leftSubtree;                        // Deepest subtree just left of the left boundary path (null if none).
+  void *firstLeaf;                            // First leaf the range touched.
+  bool firstLeafKept;                         // Whether the first leaf still has keys.
+  void *lastLeaf;                             // Last leaf the range touched.
+  bool lastLeafKept;                          // Whether the last leaf still has keys.
+  Address lastLeafNext;                       // Leaf the last leaf linked to.
 };
 
 // The B+ Tree itself.
 class BPlusTree
 {
 private:
+  // Offset stored in a leaf's pointer to mark its key as deleted (linked list nodes always sit at offset 0).
+  static const short int TOMBSTONE_OFFSET = -1;
+
   // Variables
   MemoryPool *disk;     // Pointer to a memory pool for data blocks.
   MemoryPool *index;    // Pointer to a memory pool in disk for index.
   Node *root;           // Pointer to the main memory root (if it's loaded).
   void *rootAddress;    // Pointer to root's address on disk.
-  int maxKeys;          // Maximum keys in a node.
+  int maxKeys;          // Maximum keys in a leaf node.
   int levels;           // Number of levels in this B+ Tree.
   int numNodes;         // Number of nodes in this B+ Tree.
-  std::size_t nodeSize; // Size of a node = Size of block.
+  int frozenBlocks;     // Blocks of the index held by compressed snapshots, which are not nodes of the tree.
+  std::size_t nodeSize; // Size of a leaf node (the block size unless set by setNodeSizes).
+
+  NodeArena nodeArena;  // Allocates the nodes of this tree, recycles the freed ones, and holds the lists splits use.
+
+  int maxInternalKeys;          // Maximum keys in an internal node.
+  std::size_t internalNodeSize; // Size of an internal node.
+  int maxLLKeys;                // Maximum records in a linked list node (a posting page).
+  std::size_t LLNodeSize;       // Size of a linked list node.
+
+  SplitPolicy splitPolicy; // How full nodes are split on insert.
+  float fillFactor;        // Fraction of maxKeys kept in the left node on a right-biased split.
+
+  bool useVotesSummary;                     // Whether we maintain the max numVotes of each key's linked list.
+  std::unordered_map<float, int> maxVotes;  // Max numVotes among all records stored under each key.
+
+  bool cascadeDeletes;                // Whether removing keys also deallocates their records from the data pool.
+  std::vector<Address> recordsToFree; // Records of removed linked lists, waiting to be deallocated together.
+
+  std::map<float, int> keyCounts; // Number of records under each key, kept by inserts and removes, for the planner.
+  bool orphanedRecords;           // Whether records removed from the index were left in the data pool.
+
+  bool lazyDeletes;                // Whether remove only marks keys as tombstones, leaving rebalancing to compaction.
+  int numTombstones;               // Number of keys currently marked as tombstones in the leaves.
+  std::deque<float> tombstoneKeys; // Keys marked as tombstones since the last compaction, in order of deletion.
+
+  std::mutex treeMutex;                      // Guards the tree while the background compaction thread runs.
+  std::condition_variable compactionWanted;  // Wakes the compaction thread on new tombstones or when stopping.
+  std::thread compactionThread;              // Background thread compacting tombstones when the tree is idle.
+  bool compactionRunning;                    // Whether the background compaction thread is running.
+  bool stopCompaction;                       // Tells the background compaction thread to exit.
+  std::atomic<long> foregroundOps;           // Counts operations on the tree, so compaction can tell when it is idle.
+  std::atomic<int> openCursors;              // Range cursors in use. Compaction holds off until they are all closed.
+
+  bool bufferedInserts;  // Whether inserts and removes are buffered at internal nodes and flushed down in batches.
+  int bufferCapacity;    // Max messages an internal node's buffer holds before it is flushed to its children.
+  long nextMessageSeq;   // Sequence number of the next buffered message.
+  std::unordered_map<void *, std::vector<BufferedMessage>> buffers; // Message buffer of each internal node, by disk address.
+
+  bool deltaTier;                        // Whether inserts and removes go into an in-memory delta merged into the tree later.
+  int deltaMergeThreshold;               // Number of changes the delta absorbs before it is merged into the tree.
+  int deltaSize;                         // Number of changes currently in the delta.
+  std::map<float, PendingRecords> delta; // Sorted delta of changes not in the tree yet. Deletes shadow the tree's records.
+
+  bool learnedIndex;                               // Whether the learned leaf directory is kept up to date.
+  int learnedMaxError;                             // Max distance between a predicted and an actual leaf position.
+  std::vector<LeafSegment> segments;               // Learned leaf directory, segments sorted by key.
+  std::unordered_map<void *, float> leafLowerBounds; // Lower bound key of each leaf in the directory, by disk address.
+
+  bool keyDirectory;               // Whether equality lookups go through the direct key directory.
+  float directoryScale;            // Keys in the directory are whole multiples of 1 / directoryScale.
+  int directoryMaxSlots;           // Widest range of keys (in multiples) the directory may cover.
+  int directoryFirstSlot;          // Multiple of 1 / directoryScale held by the first slot.
+  std::vector<Address> directory;  // Linked list head of the key in each slot, or nullptr if not known yet.
+
+  int pinnedLevels;                                // Number of levels from the root kept pinned in main memory.
+  bool pinnedStale;                                // Whether the pinned nodes must be reloaded before use.
+  std::unordered_map<void *, Node *> pinnedNodes;  // Pinned internal nodes, by disk address.
+  std::atomic<int> pinnedAccessed;                 // Counts pinned node accesses, which cost no block I/O.
 
   // Methods
 
   // Updates the parent node to point at both child nodes, and adds a parent node if needed.
   void insertInternal(float key, Node *cursorDiskAddress, Node *childDiskAddress);
 
+  // Adds many children to a parent node at once, each to the right of its key (keys in ascending order). A parent
+  // that overflows is cut into as many nodes as needed, which are added to its own parent in one go in turn.
+  void insertInternalBatch(Node *cursorDiskAddress, const std::vector<float> &keys, const std::vector<Address> &children);
+
+  // Inserts a record right away, splitting nodes as needed.
+  void insertKey(Address address, float key);
+
+  // Removes a key right away, merging or borrowing from siblings on underflow. Returns number of nodes deleted.
+  int removeKey(float key);
+
+  // Finds a key's leaf and marks the key as a tombstone. Returns whether the key was found.
+  bool markTombstone(float key);
+
+  // Marks the key at pos of a leaf in main memory as a tombstone, without saving the leaf.
+  void markTombstone(Node *leaf, int pos);
+
   // Helper function for deleting records.
   void removeInternal(float key, Node *cursorDiskAddress, Node *childDiskAddress);
 
+  // Strips the keys of a range delete out of the subtree of a node, at a level of the tree (0 for the root).
+  // Returns whether the node was left with nothing and freed.
+  bool stripRange(Address nodeAddress, int level, RangeRemoval &removal);
+
+  // Frees a whole subtree lying inside a range delete, gathering the linked lists of its keys.
+  void freeSubtree(Address nodeAddress, RangeRemoval &removal);
+
+  // Gathers the linked list of the key at pos of a leaf for a range delete. The leaf itself isn't changed.
+  void takeRangeKey(Node *leaf, int pos, RangeRemoval &removal);
+
+  // Fixes an underfull child of an internal node after a range delete: merges it with a sibling while the two fit
+  // in one node, or else evens their keys out. The parent is only changed in main memory. Returns whether it changed.
+  bool rebalanceChild(Node *parent, int pos);
+
+  // Returns the position of a child's pointer in an internal node, or -1 if it isn't one of its children.
+  int findChildPosition(Node *parent, void *childDiskAddress);
+
   // Finds the direct parent of a node in the B+ Tree.
   // Takes in root and a node to find parent for, returns parent's disk address.
   Node *findParent(Node *, Node *, float lowerBoundKey);
 
+  // Returns how many keys stay in the left node when a full node of maxNodeKeys keys splits. The even split keeps
+  // ⌊(n+1)/2⌋, the right-biased policy keeps up to maxLeftKeys when the new key is appended at the end.
+  int leftSplitSize(int maxNodeKeys, int maxLeftKeys, bool appendingAtEnd);
+
+  // Returns the most keys a node of nodeSize bytes holds, counting a pointer per key and one more pointer.
+  static int keysThatFit(std::size_t nodeSize);
+
+  // Saves a new node in a block of size bytes in the index. Returns its disk address.
+  Address saveNewNode(Node *node, std::size_t size);
+
+  // Deallocates a node of size bytes from the index, and hands it (or the copy loaded of it) back to the arena.
+  void freeNode(Address address, Node *node, std::size_t size);
+
+  // Returns the index of the pointer to follow in an internal node to reach a key.
+  int findChildIndex(Node *node, float key);
+
+  // Loads a node, from the pinned levels if it is pinned and from disk otherwise.
+  Node *loadNode(Address address);
+
+  // Reloads the top pinnedLevels levels of internal nodes into the pinned cache if they went stale.
+  void pinUpperLevels();
+
+  // Drops the pinned nodes, after a split, merge or borrow may have changed them.
+  void unpinLevels();
+
+  // Drops the pinned nodes if a node about to change is one of them. Changes below the pinned levels keep them.
+  void unpinLevels(void *nodeDiskAddress);
+
+  // Rebuilds the learned leaf directory from the separator keys of the tree.
+  void buildLearnedIndex();
+
+  // Collects the lower bound key and disk address of each leaf in the subtree of a node, left to right.
+  void collectLeaves(Address nodeAddress, float lowerBoundKey, std::vector<float> &lowerBoundKeys, std::vector<void *> &leaves);
+
+  // Cuts sorted leaves into as few segments as possible whose lines predict each leaf within learnedMaxError.
+  void fitSegments(const std::vector<float> &lowerBoundKeys, const std::vector<void *> &leaves, std::vector<LeafSegment> &fitted);
+
+  // Returns the segment of the learned directory a key falls in.
+  int findSegment(float key);
+
+  // Refits a segment of the learned directory after its leaves changed, dropping it once it has no leaves.
+  void refitSegment(int segment);
+
+  // Keep the learned directory in step with the leaf level: a leaf was added after a split, a leaf was merged
+  // away or emptied, or a leaf's lower bound key changed after borrowing. They do nothing if it's turned off.
+  void learnedLeafAdded(float lowerBoundKey, void *leafDiskAddress);
+  void learnedLeafRemoved(void *leafDiskAddress);
+  void learnedLeafMoved(void *leafDiskAddress, float lowerBoundKey);
+
+  // Predicts the leaf that would contain a key from the learned directory, and checks it with a last-mile search.
+  void *findLeafLearned(float key);
+
+  // Estimates what a search of [lowerBoundKey, upperBoundKey] would cost under each plan, and picks the cheapest.
+  QueryPlan estimatePlan(float lowerBoundKey, float upperBoundKey);
+
+  // Works out the slot of a key in the direct key directory. Returns false if the key is not a whole multiple.
+  bool directorySlot(float key, int &slot);
+
+  // Makes room in the direct key directory for a key about to be inserted. Turns the directory off (so lookups
+  // go to the tree) if the key is not a whole multiple, or the keys would span too many slots.
+  void directoryAdmit(float key);
+
+  // Records a key's new linked list head, or forgets it so the next lookup finds it in the tree.
+  void directoryRemember(float key, Address LLHeadAddress);
+  void directoryForget(float key);
+
+  // Looks up a key in the direct key directory. Returns false if the directory doesn't know its linked list.
+  bool directoryLookup(float key, std::vector<Record> &records);
+
+  // Traverses from the root to the leaf node that would contain a key. Returns the leaf in main memory.
+  Node *findLeaf(float key);
+
+  // Walks the leaf level from lowerBoundKey to upperBoundKey, calling visit with each key and its linked list head.
+  void scanRange(float lowerBoundKey, float upperBoundKey, const std::function<void(float, Address)> &visit);
+
+  // Calls visit with the disk address of every record in a linked list.
+  void forEachInLL(Address LLHeadAddress, const std::function<void(Address)> &visit);
+
+  // Walks the leaf level from a leaf (nullptr for an empty tree) like scanRange, merging in the buffered messages and
+  // delta entries in range the way RangeCursor does. visit gets each key left with records, its linked list head
+  // (null if the tree has none for it, or a pending delete hides them) and its pending changes (null if none).
+  void scanMerged(Node *leaf, float lowerBoundKey, float upperBoundKey, const std::function<void(float, Address, const PendingRecords *)> &visit);
+
+  // Same, starting from the leaf that would contain lowerBoundKey.
+  void scanMerged(float lowerBoundKey, float upperBoundKey, const std::function<void(float, Address, const PendingRecords *)> &visit);
+
+  // Calls visit with the disk address of every record of a key visited by scanMerged: its linked list, then its
+  // pending inserts.
+  void forEachRecord(Address LLHeadAddress, const PendingRecords *changes, const std::function<void(Address)> &visit);
+
+  // Applies the pending changes of each key to the records a lookup found for it in the tree.
+  void mergePendingLookups(const std::vector<float> &keys, std::vector<std::vector<Record>> &results);
+
+  // Looks up the sorted probe keys in [begin, end) within the subtree of a node, loading each child at most once.
+  void lookupBatchNode(Node *cursor, const std::vector<float> &probes, int begin, int end, std::vector<std::vector<Record>> &matches);
+
+  // Locks the tree if the background compaction thread is running, and counts an operation on the tree.
+  std::unique_lock<std::mutex> lockTree();
+
+  // Returns the number of blocks of the index used by the nodes of the tree.
+  int countNodes() const
+  {
+    return index->getAllocated() - frozenBlocks;
+  }
+
+  // Gives the compressed leaves of a snapshot back to the index.
+  void releaseFrozenLeaves(const std::vector<Address> &blocks);
+
+  // Returns whether a leaf pointer to a linked list is marked as a tombstone.
+  static bool isTombstone(Address address)
+  {
+    return address.offset == TOMBSTONE_OFFSET;
+  }
+
+  // Frees the linked list of a tombstone and starts a new one for a key inserted again. Returns the new head.
+  Address reviveTombstone(Address tombstoneAddress, Address address, float key);
+
+  // Physically removes the oldest key still marked as a tombstone (must hold treeMutex if compaction is running).
+  // Returns the number of nodes deleted.
+  int compactOne();
+
+  // Body of the background compaction thread.
+  void compactionLoop(int idleMilliseconds);
+
+  // Appends an insert or delete to the root's buffer, flushing it if full.
+  void bufferMessage(float key, Address address, bool isDelete);
+
+  // Moves all messages in an internal node's buffer down a level: into the buffers of internal children,
+  // or applied to leaf children. Recursively flushes children whose buffers overflow.
+  void flushNode(void *nodeDiskAddress);
+
+  // Applies messages (sorted by key, then issue order) to one leaf, loading and saving it once.
+  void applyToLeaf(Address leafAddress, const std::vector<BufferedMessage> &messages);
+
+  // Applies one message directly to the tree.
+  void applyMessage(const BufferedMessage &message);
+
+  // Flushes every buffer until none is left.
+  void flushAllBuffers();
+
+  // Moves the buffered messages with key >= separatorKey from a split internal node to its new right sibling.
+  void splitBuffer(void *nodeDiskAddress, void *newNodeDiskAddress, float separatorKey);
+
+  // Records an insert or delete in the delta, merging the delta into the tree once it's over the threshold.
+  void addToDelta(float key, Address address, bool isDelete);
+
+  // Merges the whole delta into the tree in key order, appending keys past the end of the tree to the rightmost leaf.
+  void applyDelta();
+
+  // Merges the delta and flushes all buffers, so the tree alone holds every change.
+  void applyPending();
+
+  // Returns the net effect of all buffered messages and delta entries with keys in [lowerBoundKey, upperBoundKey].
+  std::map<float, PendingRecords> collectPending(float lowerBoundKey, float upperBoundKey);
+
+  // Deallocates all records gathered in recordsToFree from the data pool, block by block.
+  void freeRemovedRecords();
+
+  // Loads a record from the disk into main memory and returns a copy of it.
+  Record loadRecord(Address address);
+
+  // Updates the max numVotes summary of a key with a newly inserted record.
+  void updateVotesSummary(float key, Address address);
+
 public:
+  // Walks the records of a range in key order, merging the tree with buffered messages and the delta tier on the fly.
+  // Get one with openRange(). The caller must not change the tree while a cursor is in use. The background compaction
+  // thread holds off until every cursor is destroyed, so cursors should not be kept open for longer than needed.
+  class RangeCursor
+  {
+  private:
+    BPlusTree *tree;                                       // Tree being walked.
+    float upperBoundKey;                                   // Last key of the range.
+    Node *leaf;                                            // Current leaf in main memory (nullptr past the last leaf).
+    int leafPos;                                           // Position of the next key in the current leaf.
+    std::vector<std::pair<float, PendingRecords>> pending; // Changes in range not in the tree yet, sorted by key.
+    int pendingPos;                                        // Position of the next key in pending.
+    std::vector<Address> records;                          // Records of the current key.
+    int recordPos;                                         // Position of the next record in records.
+    float key;                                             // Current key.
+
+    // Moves on to the next key with records. Returns false at the end of the range.
+    bool nextKey();
+
+  public:
+    RangeCursor(BPlusTree *tree, float lowerBoundKey, float upperBoundKey);
+
+    // Takes over another cursor, which is left closed. Cursors can't be copied, as each one counts as open once.
+    RangeCursor(RangeCursor &&other);
+
+    ~RangeCursor();
+
+    // Loads the next record into record. Returns false at the end of the range.
+    bool next(Record &record);
+
+    // Returns the key of the record last returned by next().
+    float getKey()
+    {
+      return key;
+    }
+  };
+
+  // Read-only snapshot of the tree for read-mostly workloads. The separator keys are packed into one array in
+  // Eytzinger (breadth-first) order, so a lookup walks down an implicit tree with no pointers and no internal node
+  // blocks to load. The leaves and linked lists are shared with the tree, so the snapshot is only valid until the
+  // tree is next changed. Get one with freeze().
+  // A snapshot can instead copy the leaf level into its own compressed leaves. Each is one block holding a header,
+  // every key as a small integer delta from the leaf's first key, and the linked list heads without padding, so a
+  // block holds more entries than a leaf of the tree. Keys are turned into integers in an order-preserving way: as
+  // a whole number of tenths (or hundredths, ...) when they all are, else from the bits of the float. A search
+  // compares against the deltas as they are, without decoding the keys.
+  // A snapshot reads and frees its blocks through the tree, under the tree's lock, so every snapshot (and copy of
+  // one) must be destroyed before the tree and its memory pools are.
+  class FrozenIndex
+  {
+  private:
+    BPlusTree *tree;             // Tree the snapshot was taken from.
+    MemoryPool *disk;            // Memory pool holding the records.
+    MemoryPool *index;           // Memory pool holding the leaves and linked lists.
+    std::size_t nodeSize;        // Size of a node = Size of block.
+    std::vector<Address> leaves; // Disk address of every leaf, left to right.
+    std::vector<float> layout;   // Lower bound key of every leaf but the first, in Eytzinger order starting at 1.
+    std::vector<int> leafOf;     // Leaf whose lower bound key sits at the same position of layout.
+
+    bool compressedLeaves;                        // Whether leaves are the snapshot's own compressed leaves.
+    std::shared_ptr<std::vector<Address>> owned; // Compressed leaves, given back to the tree once no copy is left.
+
+    // Places the sorted lower bound keys from position next onwards in the subtree of layout rooted at k.
+    // Returns the position of the next key to place.
+    int buildLayout(const std::vector<float> &lowerBoundKeys, int next, int k);
+
+    // Returns the position in leaves of the leaf that would contain a key.
+    int findLeafIndex(float key) const;
+
+    // Adds the records of a linked list to results.
+    void collectLL(Address LLHeadAddress, std::vector<Record> &results) const;
+
+    // Packs the entries of the leaf level into compressed leaves of nodeSize bytes, saved in the index, and sets
+    // leaves and lowerBoundKeys to them.
+    void packLeaves(const std::vector<float> &keys, const std::vector<Address> &LLHeads, std::vector<float> &lowerBoundKeys);
+
+    // Adds the records of a compressed leaf with keys in [lowerBoundKey, upperBoundKey] to results. Returns false
+    // once a key past upperBoundKey is found.
+    bool searchCompressedLeaf(const unsigned char *leaf, float lowerBoundKey, float upperBoundKey, std::vector<Record> &results) const;
+
+  public:
+    FrozenIndex(BPlusTree *tree, const std::vector<Address> &leaves, const std::vector<float> &lowerBoundKeys);
+
+    // Takes the snapshot with compressed leaves, from every key of the leaf level and its linked list head.
+    FrozenIndex(BPlusTree *tree, const std::vector<float> &keys, const std::vector<Address> &LLHeads);
+
+    // Returns the records with a key.
+    std::vector<Record> lookup(float key) const;
+
+    // Returns the records with keys in [lowerBoundKey, upperBoundKey], in key order.
+    std::vector<Record> search(float lowerBoundKey, float upperBoundKey) const;
+
+    int getNumLeaves() const
+    {
+      return leaves.size();
+    }
+
+    bool hasCompressedLeaves() const
+    {
+      return compressedLeaves;
+    }
+  };
+
   // Methods
 
   // Constructor, takes in block size to determine max keys/pointers in a node.
   BPlusTree(std::size_t blockSize, MemoryPool *disk, MemoryPool *index);
 
+  // Destructor, stops the background compaction thread if it's running.
+  ~BPlusTree();
+
   // Search for keys corresponding to a range in the B+ Tree given a lower and upper bound. Returns a list of matching Records.
   void search(float lowerBoundKey, float upperBoundKey);
 
+  // Returns the k records with the largest value of field among keys within a range, largest first.
+  std::vector<Record> topK(float lowerBoundKey, float upperBoundKey, int k, RecordField field);
+
+  // Looks up many keys at once, sharing the traversal of internal nodes and visiting each leaf at most once.
+  // Returns the matching records of each key, in the same order as the keys given.
+  std::vector<std::vector<Record>> lookupBatch(const std::vector<float> &keys);
+
+  // Looks up many keys by running groupSize traversals interleaved, prefetching each traversal's next node
+  // while the others make progress. Returns the matching records of each key, in the same order as the keys given.
+  std::vector<std::vector<Record>> lookupInterleaved(const std::vector<float> &keys, int groupSize = 8);
+
+  // Searches a range on numThreads threads, splitting it at separator keys from the upper levels of the tree.
+  // Returns the matching records in key order.
+  std::vector<Record> parallelSearch(float lowerBoundKey, float upperBoundKey, int numThreads);
+
+  // Builds and starts maintaining the max numVotes summary of every key, so topK can skip whole linked lists.
+  void enableVotesSummary();
+
   // Inserts a record into the B+ Tree.
   void insert(Address address, float key);
 
+  // Inserts a batch of (key, record address) pairs. The batch is sorted, and the keys going into the same leaf are
+  // merged into it in one pass, with a single descent per leaf. A leaf that overflows is cut into as many leaves as
+  // needed, which are then added to the parent together, once per level.
+  void insertBatch(const std::vector<std::pair<float, Address>> &batch);
+
   // Inserts a record into a linked list. Returns the address of the new linked list head (if any).
   Address insertLL(Address LLHead, Address address, float key);
 
@@ -78,13 +529,139 @@ public:
   // Prints out an entire linked list's records.
   void displayLL(Address LLHeadAddress);
 
+  // Prints out the records still waiting in buffers for a key.
+  void displayPending(float key, const PendingRecords &pending);
+
   // Remove a range of records from the disk (and B+ Tree).
-  // Accepts a key to delete.
+  // Accepts a key to delete. With lazy deletes on, the key is only marked as a tombstone and 0 is returned.
   int remove(float key);
 
+  // Remove every key within a range from the B+ Tree. Subtrees wholly inside the range are detached in one pass per
+  // level, and only the nodes on the two boundary paths are rebalanced, once, at the end. Returns the number of nodes deleted.
+  int removeRange(float lowerBoundKey, float upperBoundKey);
+
   // Remove an entire linked list from the start to the end for a given linked list head
   void removeLL(Address LLHeadAddress);
 
+  // Sets whether remove only marks keys as tombstones (off by default). Tombstones are skipped by all searches,
+  // and physically removed by compact() or the background compaction thread.
+  void setLazyDeletes(bool lazy)
+  {
+    lazyDeletes = lazy;
+  }
+
+  // Physically removes every tombstone now, rebalancing the tree. Returns the number of nodes deleted.
+  int compact();
+
+  // Starts a background thread that compacts tombstones once the tree has been idle for idleMilliseconds.
+  // While it runs, every public operation on the tree takes a lock.
+  void startBackgroundCompaction(int idleMilliseconds);
+
+  // Stops the background compaction thread (if running), leaving any remaining tombstones in place.
+  void stopBackgroundCompaction();
+
+  // Returns the number of keys currently marked as tombstones.
+  int getNumTombstones()
+  {
+    return numTombstones;
+  }
+
+  // Sets whether inserts and removes are buffered at internal nodes (off by default). Each internal node gets a buffer
+  // of bufferFraction of a block, flushed down a level in one batch when full. Turning it off flushes all buffers.
+  void setBufferedInserts(bool buffered, float bufferFraction = 0.5);
+
+  // Applies all buffered messages to the tree.
+  void flushBuffers();
+
+  // Returns the number of messages waiting in buffers.
+  int getNumBufferedMessages();
+
+  // Sets whether inserts and removes are absorbed by a sorted in-memory delta (off by default). The delta is merged
+  // into the tree once it holds mergeThreshold changes. Turning it off merges the delta right away.
+  void setDeltaTier(bool enabled, int mergeThreshold = 1000);
+
+  // Merges the delta tier into the tree now.
+  void mergeDelta();
+
+  // Returns a cursor over the records with keys in [lowerBoundKey, upperBoundKey].
+  RangeCursor openRange(float lowerBoundKey, float upperBoundKey);
+
+  // Sets whether a learned directory over the leaf level is kept (off by default). It predicts the leaf of a key
+  // with piecewise linear models, each within maxError leaves, and is refitted locally as leaves split and merge.
+  void setLearnedIndex(bool enabled, int maxError = 4);
+
+  // Returns the records with keys in [lowerBoundKey, upperBoundKey] in key order, going to the first leaf through
+  // the learned directory instead of the internal nodes.
+  std::vector<Record> learnedSearch(float lowerBoundKey, float upperBoundKey);
+
+  // Returns the number of segments in the learned directory.
+  int getNumSegments()
+  {
+    return segments.size();
+  }
+
+  // Sets whether equality lookups go through a direct key directory (off by default). When every key is a whole
+  // multiple of 1 / scale (e.g. ratings with one decimal and scale 10) and the keys span at most maxSlots multiples,
+  // each key's slot holds its linked list head, and lookupBatch() reads it without a descent. Returns whether the
+  // keys fit; inserting a key that doesn't turns the directory off again. Ordered scans always use the tree.
+  bool setKeyDirectory(bool enabled, float scale = 10, int maxSlots = 4096);
+
+  // Returns whether the direct key directory is on.
+  bool hasKeyDirectory()
+  {
+    return keyDirectory;
+  }
+
+  // Estimates the blocks a search of [lowerBoundKey, upperBoundKey] would access under each plan, from the number
+  // of records under each key, and picks the cheapest.
+  QueryPlan planSearch(float lowerBoundKey, float upperBoundKey);
+
+  // Returns the records with keys in [lowerBoundKey, upperBoundKey] in key order, read with the plan planSearch()
+  // picks. Reports the plan, and the estimated against the actual number of blocks accessed.
+  std::vector<Record> plannedSearch(float lowerBoundKey, float upperBoundKey);
+
+  // Applies all pending changes and takes a read-only snapshot of the tree, with compressed leaves if asked for.
+  FrozenIndex freeze(bool compressLeaves = false);
+
+  // Sets how full nodes are split (EVEN_SPLIT by default). With RIGHT_BIASED_SPLIT, a node split by a key appended
+  // past the end of the tree keeps fillFactor of its keys (at least half), so ascending inserts leave nodes fuller.
+  void setSplitPolicy(SplitPolicy policy, float fillFactor = 0.9)
+  {
+    splitPolicy = policy;
+    this->fillFactor = fillFactor;
+  }
+
+  // Sets whether removing keys also deallocates their records from the data pool (off by default).
+  void setCascadeDeletes(bool cascade)
+  {
+    cascadeDeletes = cascade;
+  }
+
+  // Sets the size of internal nodes, leaves and linked list nodes (posting pages), which all default to the block
+  // size, and so the most keys each holds. Give the index pool a size class for each size (e.g. small internal nodes
+  // and larger leaves), as a node takes a whole block and a size is rounded up to the blocks it gets. Only an empty
+  // tree can change its node sizes.
+  void setNodeSizes(std::size_t internalNodeSize, std::size_t leafNodeSize, std::size_t LLNodeSize);
+
+  // Keeps the top levels of internal nodes (root included) pinned in main memory, so that traversals only pay block
+  // I/O below them. 0 turns pinning off (the default).
+  void setPinnedLevels(int levels)
+  {
+    pinnedLevels = levels;
+    unpinLevels();
+  }
+
+  // Returns the number of pinned node accesses, which are not counted in the index's blocksAccessed.
+  int getPinnedAccessed() const
+  {
+    return pinnedAccessed;
+  }
+
+  int resetPinnedAccessed()
+  {
+    return pinnedAccessed.exchange(0);
+  }
+
   // Getters and setters
 
   // Returns a pointer to the root of the B+ Tree.
@@ -105,6 +682,16 @@ public:
   {
     return maxKeys;
   }
+
+  int getMaxInternalKeys()
+  {
+    return maxInternalKeys;
+  }
+
+  int getMaxLLKeys()
+  {
+    return maxLLKeys;
+  }
 };
 
 #endif
\ No newline at end of file
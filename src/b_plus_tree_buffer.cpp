@@ -0,0 +1,362 @@
+#include "b_plus_tree.h"
+#include "types.h"
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+
+// Buffered insert mode: internal nodes keep a buffer of pending inserts and deletes. New messages are appended at the
+// root and move down a level, in one batch, whenever a buffer fills up. Each leaf is then written once per batch
+// instead of once per insert. Buffered deletes only mark keys as tombstones, so flushing never merges nodes.
+
+void BPlusTree::setBufferedInserts(bool buffered, float bufferFraction)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  if (buffered)
+  {
+    // The buffer takes up a fraction of a block, so work out how many messages fit in that space.
+    bufferCapacity = std::max(1, (int)(internalNodeSize * bufferFraction / sizeof(BufferedMessage)));
+    bufferedInserts = true;
+  }
+  else
+  {
+    flushAllBuffers();
+    bufferedInserts = false;
+  }
+}
+
+void BPlusTree::flushBuffers()
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+  flushAllBuffers();
+}
+
+int BPlusTree::getNumBufferedMessages()
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  int numMessages = 0;
+  for (auto &buffer : buffers)
+  {
+    numMessages += buffer.second.size();
+  }
+  return numMessages;
+}
+
+void BPlusTree::bufferMessage(float key, Address address, bool isDelete)
+{
+  BufferedMessage message{key, address, isDelete, nextMessageSeq++};
+
+  // A tree that is a single leaf has no internal node to buffer at.
+  if (rootAddress == nullptr || root->isLeaf)
+  {
+    applyMessage(message);
+    return;
+  }
+
+  std::vector<BufferedMessage> &rootBuffer = buffers[rootAddress];
+  rootBuffer.push_back(message);
+
+  if ((int)rootBuffer.size() > bufferCapacity)
+  {
+    flushNode(rootAddress);
+  }
+}
+
+void BPlusTree::flushNode(void *nodeDiskAddress)
+{
+  auto buffer = buffers.find(nodeDiskAddress);
+  if (buffer == buffers.end())
+  {
+    return;
+  }
+
+  std::vector<BufferedMessage> messages = buffer->second;
+  buffers.erase(buffer);
+
+  if (messages.empty())
+  {
+    return;
+  }
+
+  // Sort by key, then by issue order, so that the messages going to each child sit together and stay in order.
+  std::sort(messages.begin(), messages.end(), [](const BufferedMessage &a, const BufferedMessage &b)
+  {
+    return a.key < b.key || (a.key == b.key && a.seq < b.seq);
+  });
+
+  Address nodeAddress{nodeDiskAddress, 0};
+  Node *node = (Node *)index->loadFromDisk(nodeAddress, sizeof(Node));
+
+  // Work out which child each run of messages goes to before touching the children. Applying messages to a
+  // leaf can split it and add a key to this node, which would leave our copy of the node out of date.
+  std::vector<Address> childAddresses;
+  std::vector<int> runEnds;
+  int i = 0;
+  while (i < (int)messages.size())
+  {
+    int childIndex = findChildIndex(node, messages[i].key);
+    int end = i;
+    while (end < (int)messages.size() && findChildIndex(node, messages[end].key) == childIndex)
+    {
+      end++;
+    }
+
+    childAddresses.push_back(node->pointers[childIndex]);
+    runEnds.push_back(end);
+    i = end;
+  }
+
+  // All children are on the same level, so they are either all leaves or all internal nodes.
+  Node *firstChild = (Node *)index->loadFromDisk(childAddresses[0], sizeof(Node));
+  bool childrenAreLeaves = firstChild->isLeaf;
+
+  // Hand each child its messages in one go.
+  std::vector<void *> internalChildren;
+  int begin = 0;
+  for (int run = 0; run < (int)childAddresses.size(); run++)
+  {
+    if (childrenAreLeaves)
+    {
+      // A leaf split never changes which leaf the keys of the other runs belong to.
+      std::vector<BufferedMessage> leafMessages(messages.begin() + begin, messages.begin() + runEnds[run]);
+      applyToLeaf(childAddresses[run], leafMessages);
+    }
+    else
+    {
+      // Messages from a parent are always newer than the ones already in the child, so they go at the back.
+      std::vector<BufferedMessage> &childBuffer = buffers[childAddresses[run].blockAddress];
+      childBuffer.insert(childBuffer.end(), messages.begin() + begin, messages.begin() + runEnds[run]);
+      internalChildren.push_back(childAddresses[run].blockAddress);
+    }
+
+    begin = runEnds[run];
+  }
+
+  // Cascade down into children that are now over capacity.
+  for (void *childDiskAddress : internalChildren)
+  {
+    auto childBuffer = buffers.find(childDiskAddress);
+    if (childBuffer != buffers.end() && (int)childBuffer->second.size() > bufferCapacity)
+    {
+      flushNode(childDiskAddress);
+    }
+  }
+}
+
+void BPlusTree::applyToLeaf(Address leafAddress, const std::vector<BufferedMessage> &messages)
+{
+  Node *leaf = (Node *)index->loadFromDisk(leafAddress, sizeof(Node));
+  bool modified = false;
+
+  for (int m = 0; m < (int)messages.size(); m++)
+  {
+    const BufferedMessage &message = messages[m];
+
+    // Find where the key is (or would go) in the leaf.
+    int pos = 0;
+    while (pos < leaf->numKeys && leaf->keys[pos] < message.key)
+    {
+      pos++;
+    }
+    bool found = pos < leaf->numKeys && leaf->keys[pos] == message.key;
+
+    if (message.isDelete)
+    {
+      if (found && !isTombstone(leaf->pointers[pos]))
+      {
+        markTombstone(leaf, pos);
+        modified = true;
+      }
+      continue;
+    }
+
+    if (found)
+    {
+      // A tombstoned key starts over with a new linked list, otherwise it's a duplicate.
+      if (isTombstone(leaf->pointers[pos]))
+      {
+        leaf->pointers[pos] = reviveTombstone(leaf->pointers[pos], message.address, message.key);
+      }
+      else
+      {
+        leaf->pointers[pos] = insertLL(leaf->pointers[pos], message.address, message.key);
+      }
+    }
+    else if (leaf->numKeys < maxKeys)
+    {
+      // Shift the keys and pointers (including the pointer to the next leaf) back to make room.
+      for (int j = leaf->numKeys; j > pos; j--)
+      {
+        leaf->keys[j] = leaf->keys[j - 1];
+      }
+      for (int j = leaf->numKeys + 1; j > pos; j--)
+      {
+        leaf->pointers[j] = leaf->pointers[j - 1];
+      }
+
+      // Create a new linked list (for duplicates) at the key.
+      Node *LLNode = nodeArena.allocate(maxLLKeys);
+      LLNode->keys[0] = message.key;
+      LLNode->isLeaf = false; // So we will never search it
+      LLNode->numKeys = 1;
+      LLNode->pointers[0] = message.address; // The disk address of the key just inserted
+
+      leaf->keys[pos] = message.key;
+      leaf->pointers[pos] = saveNewNode(LLNode, LLNodeSize);
+      leaf->numKeys++;
+    }
+    else
+    {
+      // The leaf is full. Save it and let the regular insert split it. The remaining messages may now
+      // belong to the new leaf, so they are applied one at a time from the root.
+      if (modified)
+      {
+        index->saveToDisk(leaf, sizeof(Node), leafAddress);
+      }
+      for (int rest = m; rest < (int)messages.size(); rest++)
+      {
+        applyMessage(messages[rest]);
+      }
+      return;
+    }
+
+    if (useVotesSummary)
+    {
+      updateVotesSummary(message.key, message.address);
+    }
+    modified = true;
+  }
+
+  if (modified)
+  {
+    index->saveToDisk(leaf, sizeof(Node), leafAddress);
+  }
+}
+
+void BPlusTree::applyMessage(const BufferedMessage &message)
+{
+  if (message.isDelete)
+  {
+    if (rootAddress != nullptr)
+    {
+      markTombstone(message.key);
+    }
+  }
+  else
+  {
+    insertKey(message.address, message.key);
+  }
+}
+
+void BPlusTree::flushAllBuffers()
+{
+  if (buffers.empty())
+  {
+    return;
+  }
+
+  // Messages only ever move down, so this ends once they have all reached the leaves.
+  while (!buffers.empty())
+  {
+    flushNode(buffers.begin()->first);
+  }
+
+  // Buffered deletes only left tombstones behind. Unless the tree is in lazy delete mode, remove them for real now
+  // that no buffer is left to be lost in a merge.
+  if (lazyDeletes == false)
+  {
+    while (!tombstoneKeys.empty())
+    {
+      compactOne();
+    }
+  }
+}
+
+void BPlusTree::splitBuffer(void *nodeDiskAddress, void *newNodeDiskAddress, float separatorKey)
+{
+  auto buffer = buffers.find(nodeDiskAddress);
+  if (buffer == buffers.end())
+  {
+    return;
+  }
+
+  std::vector<BufferedMessage> kept;
+  std::vector<BufferedMessage> moved;
+  for (const BufferedMessage &message : buffer->second)
+  {
+    if (message.key >= separatorKey)
+    {
+      moved.push_back(message);
+    }
+    else
+    {
+      kept.push_back(message);
+    }
+  }
+
+  buffer->second = kept;
+  if (!moved.empty())
+  {
+    std::vector<BufferedMessage> &newBuffer = buffers[newNodeDiskAddress];
+    newBuffer.insert(newBuffer.end(), moved.begin(), moved.end());
+  }
+}
+
+std::map<float, PendingRecords> BPlusTree::collectPending(float lowerBoundKey, float upperBoundKey)
+{
+  std::map<float, PendingRecords> pending;
+
+  // Gather the messages in range from every buffer, and replay them in the order they were issued.
+  std::vector<BufferedMessage> messages;
+  for (auto &buffer : buffers)
+  {
+    for (const BufferedMessage &message : buffer.second)
+    {
+      if (message.key >= lowerBoundKey && message.key <= upperBoundKey)
+      {
+        messages.push_back(message);
+      }
+    }
+  }
+
+  std::sort(messages.begin(), messages.end(), [](const BufferedMessage &a, const BufferedMessage &b)
+  {
+    return a.seq < b.seq;
+  });
+
+  for (const BufferedMessage &message : messages)
+  {
+    PendingRecords &records = pending[message.key];
+    if (message.isDelete)
+    {
+      // A delete hides everything before it, in the tree or buffered.
+      records.deleted = true;
+      records.inserts.clear();
+    }
+    else
+    {
+      records.inserts.push_back(message.address);
+    }
+  }
+
+  // The delta tier sits in front of the buffers, so its changes are the newest.
+  for (auto entry = delta.lower_bound(lowerBoundKey); entry != delta.end() && entry->first <= upperBoundKey; entry++)
+  {
+    PendingRecords &records = pending[entry->first];
+    if (entry->second.deleted)
+    {
+      records.deleted = true;
+      records.inserts = entry->second.inserts;
+    }
+    else
+    {
+      records.inserts.insert(records.inserts.end(), entry->second.inserts.begin(), entry->second.inserts.end());
+    }
+  }
+
+  return pending;
+}
@@ -0,0 +1,474 @@
+#include "b_plus_tree.h"
+#include "types.h"
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+using namespace std;
+
+// Delta tier: a sorted in-memory map absorbs inserts and removes, and is merged into the tree in key order once it
+// holds enough changes. Readers see the delta through collectPending(), so a delete in the delta hides the key's
+// records in the tree until the merge removes them for real.
+
+void BPlusTree::setDeltaTier(bool enabled, int mergeThreshold)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  if (enabled)
+  {
+    deltaMergeThreshold = std::max(1, mergeThreshold);
+    deltaTier = true;
+  }
+  else
+  {
+    applyDelta();
+    deltaTier = false;
+  }
+}
+
+void BPlusTree::mergeDelta()
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+  applyDelta();
+}
+
+BPlusTree::RangeCursor BPlusTree::openRange(float lowerBoundKey, float upperBoundKey)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+  return RangeCursor(this, lowerBoundKey, upperBoundKey);
+}
+
+void BPlusTree::addToDelta(float key, Address address, bool isDelete)
+{
+  PendingRecords &entry = delta[key];
+
+  if (isDelete)
+  {
+    // Everything inserted before the delete goes away with it. Its records never made it into the tree, so they
+    // are freed (or left in the data pool) right away.
+    if (cascadeDeletes)
+    {
+      recordsToFree.insert(recordsToFree.end(), entry.inserts.begin(), entry.inserts.end());
+      freeRemovedRecords();
+    }
+    else if (!entry.inserts.empty())
+    {
+      orphanedRecords = true;
+    }
+    entry.deleted = true;
+    entry.inserts.clear();
+  }
+  else
+  {
+    entry.inserts.push_back(address);
+  }
+
+  deltaSize++;
+  if (deltaSize >= deltaMergeThreshold)
+  {
+    applyDelta();
+  }
+}
+
+void BPlusTree::applyDelta()
+{
+  if (delta.empty())
+  {
+    return;
+  }
+
+  // Take the delta out first, so changes made while merging go to the tree.
+  std::map<float, PendingRecords> batch;
+  batch.swap(delta);
+  deltaSize = 0;
+
+  // The rightmost leaf stays loaded while keys past the end of the tree are appended to it.
+  Node *lastLeaf = nullptr;
+  void *lastLeafDiskAddress = nullptr;
+  bool lastLeafModified = false;
+
+  auto releaseLastLeaf = [&]()
+  {
+    if (lastLeaf != nullptr && lastLeafModified)
+    {
+      Address lastLeafAddress{lastLeafDiskAddress, 0};
+      index->saveToDisk(lastLeaf, sizeof(Node), lastLeafAddress);
+
+      // Keep the main memory root in step if the rightmost leaf is the root.
+      if (lastLeafDiskAddress == rootAddress)
+      {
+        root = lastLeaf;
+      }
+    }
+    lastLeaf = nullptr;
+    lastLeafModified = false;
+  };
+
+  for (auto &entry : batch)
+  {
+    float key = entry.first;
+    PendingRecords &records = entry.second;
+
+    if (records.deleted)
+    {
+      releaseLastLeaf();
+
+      if (bufferedInserts)
+      {
+        bufferMessage(key, Address{nullptr, 0}, true);
+      }
+      else if (rootAddress != nullptr)
+      {
+        if (lazyDeletes)
+        {
+          markTombstone(key);
+        }
+        else
+        {
+          removeKey(key);
+        }
+      }
+    }
+
+    if (records.inserts.empty())
+    {
+      continue;
+    }
+
+    // Keys past the end of the tree go straight into the rightmost leaf while it has room.
+    if (!bufferedInserts && rootAddress != nullptr)
+    {
+      if (lastLeaf == nullptr)
+      {
+        // Follow the last pointer of each node down to the rightmost leaf.
+        lastLeafDiskAddress = rootAddress;
+        Address rootDiskAddress{rootAddress, 0};
+        lastLeaf = (Node *)index->loadFromDisk(rootDiskAddress, sizeof(Node));
+
+        while (lastLeaf->isLeaf == false)
+        {
+          Address childAddress = lastLeaf->pointers[lastLeaf->numKeys];
+          lastLeafDiskAddress = childAddress.blockAddress;
+          lastLeaf = (Node *)index->loadFromDisk(childAddress, sizeof(Node));
+        }
+      }
+
+      if (lastLeaf->numKeys < maxKeys && (lastLeaf->numKeys == 0 || key > lastLeaf->keys[lastLeaf->numKeys - 1]))
+      {
+        // Create a new linked list (for duplicates) at the key, holding all of its records.
+        Node *LLNode = nodeArena.allocate(maxLLKeys);
+        LLNode->keys[0] = key;
+        LLNode->isLeaf = false; // So we will never search it
+        LLNode->numKeys = 1;
+        LLNode->pointers[0] = records.inserts[0];
+
+        Address LLHeadAddress = saveNewNode(LLNode, LLNodeSize);
+        for (int i = 1; i < (int)records.inserts.size(); i++)
+        {
+          LLHeadAddress = insertLL(LLHeadAddress, records.inserts[i], key);
+        }
+
+        // Append the key, moving the (null) pointer to the next leaf back by one.
+        lastLeaf->pointers[lastLeaf->numKeys + 1] = lastLeaf->pointers[lastLeaf->numKeys];
+        lastLeaf->keys[lastLeaf->numKeys] = key;
+        lastLeaf->pointers[lastLeaf->numKeys] = LLHeadAddress;
+        lastLeaf->numKeys++;
+        lastLeafModified = true;
+
+        if (useVotesSummary)
+        {
+          for (Address address : records.inserts)
+          {
+            updateVotesSummary(key, address);
+          }
+        }
+        continue;
+      }
+    }
+
+    // Otherwise insert the records one by one, splitting nodes as usual.
+    releaseLastLeaf();
+    for (Address address : records.inserts)
+    {
+      if (bufferedInserts)
+      {
+        bufferMessage(key, address, false);
+      }
+      else
+      {
+        insertKey(address, key);
+      }
+    }
+  }
+
+  releaseLastLeaf();
+  numNodes = countNodes();
+}
+
+void BPlusTree::applyPending()
+{
+  applyDelta();
+  flushAllBuffers();
+}
+
+void BPlusTree::scanMerged(float lowerBoundKey, float upperBoundKey, const std::function<void(float, Address, const PendingRecords *)> &visit)
+{
+  scanMerged(rootAddress != nullptr ? findLeaf(lowerBoundKey) : nullptr, lowerBoundKey, upperBoundKey, visit);
+}
+
+void BPlusTree::scanMerged(Node *leaf, float lowerBoundKey, float upperBoundKey, const std::function<void(float, Address, const PendingRecords *)> &visit)
+{
+  Address nullAddress{nullptr, 0};
+
+  // Changes in range that haven't reached the leaves yet, merged in as we go.
+  std::map<float, PendingRecords> pending = collectPending(lowerBoundKey, upperBoundKey);
+  std::map<float, PendingRecords>::iterator nextPending = pending.begin();
+
+  // Visits the pending keys smaller than a key that aren't in the tree.
+  auto visitPendingBelow = [&](float key)
+  {
+    while (nextPending != pending.end() && nextPending->first < key)
+    {
+      if (!nextPending->second.inserts.empty())
+      {
+        visit(nextPending->first, nullAddress, &nextPending->second);
+      }
+      nextPending++;
+    }
+  };
+
+  while (leaf != nullptr)
+  {
+    for (int i = 0; i < leaf->numKeys; i++)
+    {
+      // Keys are sorted, so the first key past the upper bound ends the scan.
+      if (leaf->keys[i] > upperBoundKey)
+      {
+        visitPendingBelow(std::numeric_limits<float>::infinity());
+        return;
+      }
+      if (leaf->keys[i] < lowerBoundKey)
+      {
+        continue;
+      }
+
+      visitPendingBelow(leaf->keys[i]);
+
+      PendingRecords *changes = nullptr;
+      if (nextPending != pending.end() && nextPending->first == leaf->keys[i])
+      {
+        changes = &nextPending->second;
+        nextPending++;
+      }
+
+      // The tree's records count unless a tombstone or a pending delete hides them.
+      Address LLHeadAddress = leaf->pointers[i];
+      if (isTombstone(LLHeadAddress) || (changes != nullptr && changes->deleted))
+      {
+        LLHeadAddress = nullAddress;
+      }
+
+      if (LLHeadAddress.blockAddress != nullptr || (changes != nullptr && !changes->inserts.empty()))
+      {
+        visit(leaf->keys[i], LLHeadAddress, changes);
+      }
+    }
+
+    // Move on to the next leaf node (if any).
+    if (leaf->pointers[leaf->numKeys].blockAddress == nullptr)
+    {
+      break;
+    }
+    leaf = (Node *)index->loadFromDisk(leaf->pointers[leaf->numKeys], sizeof(Node));
+  }
+
+  // Pending keys past the last key in the tree.
+  visitPendingBelow(std::numeric_limits<float>::infinity());
+}
+
+void BPlusTree::forEachRecord(Address LLHeadAddress, const PendingRecords *changes, const std::function<void(Address)> &visit)
+{
+  forEachInLL(LLHeadAddress, visit);
+
+  if (changes != nullptr)
+  {
+    for (Address address : changes->inserts)
+    {
+      visit(address);
+    }
+  }
+}
+
+void BPlusTree::mergePendingLookups(const std::vector<float> &keys, std::vector<std::vector<Record>> &results)
+{
+  if (keys.empty())
+  {
+    return;
+  }
+
+  float lowerBoundKey = *std::min_element(keys.begin(), keys.end());
+  float upperBoundKey = *std::max_element(keys.begin(), keys.end());
+  std::map<float, PendingRecords> pending = collectPending(lowerBoundKey, upperBoundKey);
+
+  for (int i = 0; i < (int)keys.size() && !pending.empty(); i++)
+  {
+    std::map<float, PendingRecords>::iterator changes = pending.find(keys[i]);
+    if (changes == pending.end())
+    {
+      continue;
+    }
+
+    // A pending delete hides what the tree holds, and pending inserts come after it.
+    if (changes->second.deleted)
+    {
+      results[i].clear();
+    }
+    for (Address address : changes->second.inserts)
+    {
+      results[i].push_back(loadRecord(address));
+    }
+  }
+}
+
+BPlusTree::RangeCursor::RangeCursor(BPlusTree *tree, float lowerBoundKey, float upperBoundKey)
+{
+  this->tree = tree;
+  this->upperBoundKey = upperBoundKey;
+  leaf = nullptr;
+  leafPos = 0;
+  pendingPos = 0;
+  recordPos = 0;
+  key = lowerBoundKey;
+
+  // The cursor reads leaves without the tree lock, so keep compaction from changing them until it is closed.
+  tree->openCursors++;
+
+  // Take a copy of the changes in range that aren't in the tree yet.
+  std::map<float, PendingRecords> changes = tree->collectPending(lowerBoundKey, upperBoundKey);
+  pending.assign(changes.begin(), changes.end());
+
+  // Start at the first key in range of the tree (if any).
+  if (tree->rootAddress != nullptr)
+  {
+    leaf = tree->findLeaf(lowerBoundKey);
+    while (leafPos < leaf->numKeys && leaf->keys[leafPos] < lowerBoundKey)
+    {
+      leafPos++;
+    }
+  }
+}
+
+BPlusTree::RangeCursor::RangeCursor(RangeCursor &&other)
+{
+  tree = other.tree;
+  upperBoundKey = other.upperBoundKey;
+  leaf = other.leaf;
+  leafPos = other.leafPos;
+  pending = std::move(other.pending);
+  pendingPos = other.pendingPos;
+  records = std::move(other.records);
+  recordPos = other.recordPos;
+  key = other.key;
+
+  other.tree = nullptr;
+}
+
+BPlusTree::RangeCursor::~RangeCursor()
+{
+  if (tree != nullptr)
+  {
+    tree->openCursors--;
+  }
+}
+
+bool BPlusTree::RangeCursor::nextKey()
+{
+  while (true)
+  {
+    // Move on to the next leaf once we're done with this one.
+    while (leaf != nullptr && leafPos >= leaf->numKeys)
+    {
+      Address nextLeafAddress = leaf->pointers[leaf->numKeys];
+      if (nextLeafAddress.blockAddress == nullptr)
+      {
+        leaf = nullptr;
+      }
+      else
+      {
+        leaf = (Node *)tree->index->loadFromDisk(nextLeafAddress, sizeof(Node));
+        leafPos = 0;
+      }
+    }
+
+    bool hasTreeKey = leaf != nullptr && leaf->keys[leafPos] <= upperBoundKey;
+    bool hasPendingKey = pendingPos < (int)pending.size();
+    if (!hasTreeKey && !hasPendingKey)
+    {
+      return false;
+    }
+
+    // Take the smaller of the next keys in the tree and in the pending changes.
+    if (hasTreeKey && hasPendingKey)
+    {
+      key = std::min(leaf->keys[leafPos], pending[pendingPos].first);
+    }
+    else
+    {
+      key = hasTreeKey ? leaf->keys[leafPos] : pending[pendingPos].first;
+    }
+
+    records.clear();
+    recordPos = 0;
+
+    PendingRecords *changes = nullptr;
+    if (hasPendingKey && pending[pendingPos].first == key)
+    {
+      changes = &pending[pendingPos].second;
+      pendingPos++;
+    }
+
+    // The tree's records come first, unless a tombstone or a pending delete hides them.
+    if (hasTreeKey && leaf->keys[leafPos] == key)
+    {
+      Address LLHeadAddress = leaf->pointers[leafPos];
+      leafPos++;
+
+      if (!isTombstone(LLHeadAddress) && !(changes != nullptr && changes->deleted))
+      {
+        tree->forEachInLL(LLHeadAddress, [&](Address recordAddress)
+        {
+          records.push_back(recordAddress);
+        });
+      }
+    }
+
+    if (changes != nullptr)
+    {
+      records.insert(records.end(), changes->inserts.begin(), changes->inserts.end());
+    }
+
+    // Skip keys left without records.
+    if (!records.empty())
+    {
+      return true;
+    }
+  }
+}
+
+bool BPlusTree::RangeCursor::next(Record &record)
+{
+  while (recordPos >= (int)records.size())
+  {
+    if (!nextKey())
+    {
+      return false;
+    }
+  }
+
+  record = tree->loadRecord(records[recordPos]);
+  recordPos++;
+  return true;
+}
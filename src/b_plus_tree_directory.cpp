@@ -0,0 +1,158 @@
+#include "b_plus_tree.h"
+#include "types.h"
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+using namespace std;
+
+// Direct key directory: when the keys come from a small discrete domain, such as ratings with one decimal, an array
+// indexed by the key (as a whole multiple of 1 / directoryScale) holds each key's linked list head. An equality
+// lookup is then one array read instead of a descent. Slots only go stale when a linked list gets a new head or
+// goes away, and those places update or clear the slot. A slot that isn't known yet is filled by the next descent.
+
+bool BPlusTree::setKeyDirectory(bool enabled, float scale, int maxSlots)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  keyDirectory = false;
+  directory.clear();
+
+  if (enabled == false)
+  {
+    return false;
+  }
+
+  applyPending();
+  directoryScale = scale;
+  directoryMaxSlots = std::max(1, maxSlots);
+
+  // Check that every key is a whole multiple, noting its linked list head as we go.
+  std::vector<int> slots;
+  std::vector<Address> LLHeads;
+  bool fits = true;
+  scanRange(std::numeric_limits<float>::lowest(), std::numeric_limits<float>::max(), [&](float key, Address LLHeadAddress)
+  {
+    int slot;
+    if (directorySlot(key, slot))
+    {
+      slots.push_back(slot);
+      LLHeads.push_back(LLHeadAddress);
+    }
+    else
+    {
+      fits = false;
+    }
+  });
+
+  if (fits == false || (!slots.empty() && slots.back() - slots.front() + 1 > directoryMaxSlots))
+  {
+    return false;
+  }
+
+  keyDirectory = true;
+  if (!slots.empty())
+  {
+    Address nullAddress{nullptr, 0};
+    directoryFirstSlot = slots.front();
+    directory.assign(slots.back() - slots.front() + 1, nullAddress);
+    for (int i = 0; i < (int)slots.size(); i++)
+    {
+      directory[slots[i] - directoryFirstSlot] = LLHeads[i];
+    }
+  }
+
+  return true;
+}
+
+bool BPlusTree::directorySlot(float key, int &slot)
+{
+  double scaled = (double)key * directoryScale;
+  if (!(std::fabs(scaled) < std::numeric_limits<int>::max() / 2))
+  {
+    return false;
+  }
+
+  // Only the float closest to the multiple gets the slot, so two different keys never share one.
+  slot = (int)std::lround(scaled);
+  return (float)(slot / (double)directoryScale) == key;
+}
+
+void BPlusTree::directoryAdmit(float key)
+{
+  if (keyDirectory == false)
+  {
+    return;
+  }
+
+  int slot;
+  bool fits = directorySlot(key, slot);
+
+  int firstSlot = directory.empty() ? slot : std::min(directoryFirstSlot, slot);
+  int endSlot = directory.empty() ? slot + 1 : std::max(directoryFirstSlot + (int)directory.size(), slot + 1);
+  if (fits == false || endSlot - firstSlot > directoryMaxSlots)
+  {
+    // The domain is no longer small, so lookups go back to the tree.
+    keyDirectory = false;
+    directory.clear();
+    return;
+  }
+
+  // Grow the directory at either end with slots for keys not in the tree yet.
+  Address nullAddress{nullptr, 0};
+  if (directory.empty())
+  {
+    directoryFirstSlot = slot;
+  }
+  directory.insert(directory.begin(), directoryFirstSlot - firstSlot, nullAddress);
+  directoryFirstSlot = firstSlot;
+  directory.resize(endSlot - firstSlot, nullAddress);
+}
+
+void BPlusTree::directoryRemember(float key, Address LLHeadAddress)
+{
+  int slot;
+  if (keyDirectory && directorySlot(key, slot) && slot >= directoryFirstSlot && slot - directoryFirstSlot < (int)directory.size())
+  {
+    directory[slot - directoryFirstSlot] = LLHeadAddress;
+  }
+}
+
+void BPlusTree::directoryForget(float key)
+{
+  Address nullAddress{nullptr, 0};
+  directoryRemember(key, nullAddress);
+}
+
+bool BPlusTree::directoryLookup(float key, std::vector<Record> &records)
+{
+  if (keyDirectory == false)
+  {
+    return false;
+  }
+
+  // Every key in the tree has a slot, so a key without one isn't in the tree.
+  int slot;
+  if (!directorySlot(key, slot) || slot < directoryFirstSlot || slot - directoryFirstSlot >= (int)directory.size())
+  {
+    return true;
+  }
+
+  Address LLHeadAddress = directory[slot - directoryFirstSlot];
+  if (LLHeadAddress.blockAddress == nullptr)
+  {
+    return false;
+  }
+
+  if (!isTombstone(LLHeadAddress))
+  {
+    forEachInLL(LLHeadAddress, [&](Address recordAddress)
+    {
+      records.push_back(loadRecord(recordAddress));
+    });
+  }
+  return true;
+}
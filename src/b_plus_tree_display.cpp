@@ -1,8 +1,10 @@
 #include "b_plus_tree.h"
+#include "record_codec.h"
 #include "types.h"
 
 #include <iostream>
 #include <cstring>
+#include <vector>
 
 using namespace std;
 
@@ -26,7 +28,7 @@ void BPlusTree::displayNode(Node *node)
     std::cout << node->pointers[node->numKeys].blockAddress << "|";
   }
 
-  for (int i = node->numKeys; i < maxKeys; i++)
+  for (int i = node->numKeys; i < (node->isLeaf ? maxKeys : maxInternalKeys); i++)
   {
     std::cout << " x |";      // Remaining empty keys
     std::cout << "  Null  |"; // Remaining empty pointers
@@ -38,24 +40,37 @@ void BPlusTree::displayNode(Node *node)
 // Display a block and its contents in the disk. Assume it's already loaded in main memory.
 void BPlusTree::displayBlock(void *blockAddress)
 {
-  // Load block into memory
-  void *block = operator new(nodeSize);
-  std::memcpy(block, blockAddress, nodeSize);
+  // Load block into memory. It's a data block, so it has the data pool's block size, and may sit compressed.
+  std::size_t blockSize = disk->getBlockSize();
+  void *block = operator new(blockSize);
+  disk->readBlock(blockAddress, block);
 
-  unsigned char testBlock[nodeSize];
-  memset(testBlock, '\0', nodeSize);
+  unsigned char testBlock[blockSize];
+  memset(testBlock, '\0', blockSize);
 
   // Block is empty.
-  if (memcmp(testBlock, block, nodeSize) == 0)
+  if (memcmp(testBlock, block, blockSize) == 0)
   {
     std::cout << "Empty block!" << '\n';
     return;
   }
 
+  // Encoded records don't sit in fixed slots, so decode them all at once.
+  if (disk->getCodec() != nullptr)
+  {
+    std::vector<Record> records;
+    disk->getCodec()->decodeBlock(block, blockSize, records);
+    for (const Record &record : records)
+    {
+      std::cout << "[" << record.tconst << "|" << record.averageRating << "|" << record.numVotes << "]  ";
+    }
+    return;
+  }
+
   unsigned char *blockChar = (unsigned char *)block;
 
   int i = 0;
-  while (i < nodeSize)
+  while (i < blockSize)
   {
     // Load each record
     void *recordAddress = operator new(sizeof(Record));
@@ -75,7 +90,7 @@ void BPlusTree::display(Node *cursorDiskAddress, int level)
 {
   // Load in cursor from disk.
   Address cursorMainMemoryAddress{cursorDiskAddress, 0};
-  Node *cursor = (Node *)index->loadFromDisk(cursorMainMemoryAddress, nodeSize);
+  Node *cursor = (Node *)index->loadFromDisk(cursorMainMemoryAddress, sizeof(Node));
 
   // If tree exists, display all nodes.
   if (cursor != nullptr)
@@ -93,7 +108,7 @@ void BPlusTree::display(Node *cursorDiskAddress, int level)
       for (int i = 0; i < cursor->numKeys + 1; i++)
       {
         // Load node in from disk to main memory.
-        Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i], nodeSize);
+        Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i], sizeof(Node));
 
         display((Node *)mainMemoryNode, level + 1);
       }
@@ -104,7 +119,7 @@ void BPlusTree::display(Node *cursorDiskAddress, int level)
 void BPlusTree::displayLL(Address LLHeadAddress)
 {
   // Load linked list head into main memory.
-  Node *head = (Node *)index->loadFromDisk(LLHeadAddress, nodeSize);
+  Node *head = (Node *)index->loadFromDisk(LLHeadAddress, sizeof(Node));
 
   // Print all records in the linked list.
   for (int i = 0; i < head->numKeys; i++)
@@ -124,7 +139,7 @@ void BPlusTree::displayLL(Address LLHeadAddress)
   }
 
   // Print empty slots
-  for (int i = head->numKeys; i < maxKeys; i++)
+  for (int i = head->numKeys; i < maxLLKeys; i++)
   {
     std::cout << "x | ";
   }
@@ -142,3 +157,22 @@ void BPlusTree::displayLL(Address LLHeadAddress)
     displayLL(head->pointers[head->numKeys]);
   }
 }
+
+// Display the records still waiting in buffers for a key.
+void BPlusTree::displayPending(float key, const PendingRecords &pending)
+{
+  if (pending.inserts.empty())
+  {
+    return;
+  }
+
+  std::cout << endl;
+  std::cout << "Buffered records for average rating: " << key << " > ";
+
+  for (Address recordAddress : pending.inserts)
+  {
+    Record result = *(Record *)(disk->loadFromDisk(recordAddress, sizeof(Record)));
+    std::cout << result.tconst << " | ";
+  }
+  std::cout << endl;
+}
@@ -0,0 +1,460 @@
+#include "b_plus_tree.h"
+#include "types.h"
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+using namespace std;
+
+// Hints the CPU to start fetching a cache line we are about to read.
+static inline void prefetch(const void *address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(address);
+#endif
+}
+
+// Layout of a compressed leaf: the number of entries, how its keys were turned into integers, the bits each delta
+// takes, and the integer of its first key. Then the deltas, bit packed, then each linked list head's block address
+// and offset, back to back.
+static const std::size_t compressedHeaderSize = sizeof(std::uint16_t) + 2 * sizeof(std::uint8_t) + sizeof(std::int64_t);
+static const std::size_t packedAddressSize = sizeof(void *) + sizeof(short int);
+
+// Keys are scaled by up to 10^maxDigits to make them whole, or taken from their bits (rawBits) if that doesn't work.
+static const int maxDigits = 3;
+static const int rawBits = 255;
+static const double powersOfTen[maxDigits + 1] = {1, 10, 100, 1000};
+
+// Returns the fewest decimal digits that make a key whole, or rawBits if more than maxDigits are needed.
+static int keyDigits(float key)
+{
+  for (int digits = 0; digits <= maxDigits; digits++)
+  {
+    double scaled = (double)key * powersOfTen[digits];
+    if (std::fabs(scaled) < 1e15 && (float)(std::llround(scaled) / powersOfTen[digits]) == key)
+    {
+      return digits;
+    }
+  }
+  return rawBits;
+}
+
+// Turns a key into an integer, keeping the order of keys. Keys scaled by a power of ten are rounded to the nearest
+// integer, which only that key comes back from. Otherwise the sign bit is flipped, and the other bits too for
+// negative keys, so the bits sort like the floats do (with both zeroes as one).
+static long long keyToInt(float key, int digits)
+{
+  if (digits != rawBits)
+  {
+    return std::llround((double)key * powersOfTen[digits]);
+  }
+
+  if (key == 0)
+  {
+    key = 0;
+  }
+  std::uint32_t bits;
+  std::memcpy(&bits, &key, sizeof(bits));
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+// Turns an integer from keyToInt back into a key.
+static float intToKey(long long value, int digits)
+{
+  if (digits != rawBits)
+  {
+    return (float)(value / powersOfTen[digits]);
+  }
+
+  std::uint32_t bits = (value & 0x80000000u) ? (std::uint32_t)value & 0x7fffffffu : ~(std::uint32_t)value;
+  float key;
+  std::memcpy(&key, &bits, sizeof(key));
+  return key;
+}
+
+// Returns the number of bits a delta up to span takes.
+static int bitsFor(unsigned long long span)
+{
+  int width = 0;
+  while (width < 64 && (span >> width) != 0)
+  {
+    width++;
+  }
+  return width;
+}
+
+// Reads the width bits starting at bit position of a bit packed array.
+static unsigned long long readBits(const unsigned char *bits, std::size_t position, int width)
+{
+  unsigned long long value = 0;
+  for (int done = 0; done < width;)
+  {
+    std::size_t bit = position + done;
+    int take = std::min(8 - (int)(bit % 8), width - done);
+    value |= (unsigned long long)((bits[bit / 8] >> (bit % 8)) & ((1 << take) - 1)) << done;
+    done += take;
+  }
+  return value;
+}
+
+// Writes value into the width bits starting at bit position of a bit packed array (which starts zeroed).
+static void writeBits(unsigned char *bits, std::size_t position, int width, unsigned long long value)
+{
+  for (int done = 0; done < width;)
+  {
+    std::size_t bit = position + done;
+    int take = std::min(8 - (int)(bit % 8), width - done);
+    bits[bit / 8] |= (unsigned char)(((value >> done) & ((1u << take) - 1)) << (bit % 8));
+    done += take;
+  }
+}
+
+BPlusTree::FrozenIndex BPlusTree::freeze(bool compressLeaves)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+  applyPending();
+
+  std::vector<Address> leaves;
+  std::vector<float> lowerBoundKeys;
+  std::vector<float> keys;
+  std::vector<Address> LLHeads;
+
+  if (rootAddress != nullptr)
+  {
+    // Follow the first pointer of each node down to the leftmost leaf.
+    Address leafAddress{rootAddress, 0};
+    Node *leaf = (Node *)index->loadFromDisk(leafAddress, sizeof(Node));
+    while (leaf->isLeaf == false)
+    {
+      leafAddress = leaf->pointers[0];
+      leaf = (Node *)index->loadFromDisk(leafAddress, sizeof(Node));
+    }
+
+    // Walk the leaf level, noting where each leaf is and its lower bound key (or all its entries, to compress).
+    while (true)
+    {
+      leaves.push_back(leafAddress);
+      if (leaves.size() > 1)
+      {
+        lowerBoundKeys.push_back(leaf->keys[0]);
+      }
+      if (compressLeaves)
+      {
+        keys.insert(keys.end(), leaf->keys, leaf->keys + leaf->numKeys);
+        LLHeads.insert(LLHeads.end(), leaf->pointers, leaf->pointers + leaf->numKeys);
+      }
+
+      leafAddress = leaf->pointers[leaf->numKeys];
+      if (leafAddress.blockAddress == nullptr)
+      {
+        break;
+      }
+      leaf = (Node *)index->loadFromDisk(leafAddress, sizeof(Node));
+    }
+  }
+
+  if (compressLeaves)
+  {
+    return FrozenIndex(this, keys, LLHeads);
+  }
+  return FrozenIndex(this, leaves, lowerBoundKeys);
+}
+
+void BPlusTree::releaseFrozenLeaves(const std::vector<Address> &blocks)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  for (Address block : blocks)
+  {
+    index->deallocate(block, nodeSize);
+  }
+  frozenBlocks -= blocks.size();
+}
+
+BPlusTree::FrozenIndex::FrozenIndex(BPlusTree *tree, const std::vector<Address> &leaves, const std::vector<float> &lowerBoundKeys)
+{
+  this->tree = tree;
+  this->disk = tree->disk;
+  this->index = tree->index;
+  this->nodeSize = tree->nodeSize;
+  this->leaves = leaves;
+  this->compressedLeaves = false;
+
+  // Position 0 is unused, so the children of position k are at 2k and 2k + 1.
+  layout.resize(lowerBoundKeys.size() + 1);
+  leafOf.resize(lowerBoundKeys.size() + 1);
+  buildLayout(lowerBoundKeys, 0, 1);
+}
+
+BPlusTree::FrozenIndex::FrozenIndex(BPlusTree *tree, const std::vector<float> &keys, const std::vector<Address> &LLHeads)
+{
+  this->tree = tree;
+  this->disk = tree->disk;
+  this->index = tree->index;
+  this->nodeSize = tree->nodeSize;
+  this->compressedLeaves = true;
+
+  // The compressed leaves belong to the snapshot, and all its copies share them.
+  owned = std::shared_ptr<std::vector<Address>>(new std::vector<Address>(), [tree](std::vector<Address> *blocks)
+  {
+    tree->releaseFrozenLeaves(*blocks);
+    delete blocks;
+  });
+
+  std::vector<float> lowerBoundKeys;
+  packLeaves(keys, LLHeads, lowerBoundKeys);
+  leaves = *owned;
+
+  layout.resize(lowerBoundKeys.size() + 1);
+  leafOf.resize(lowerBoundKeys.size() + 1);
+  buildLayout(lowerBoundKeys, 0, 1);
+}
+
+void BPlusTree::FrozenIndex::packLeaves(const std::vector<float> &keys, const std::vector<Address> &LLHeads, std::vector<float> &lowerBoundKeys)
+{
+  std::vector<unsigned char> block(nodeSize);
+  std::size_t start = 0;
+
+  while (start < keys.size())
+  {
+    // Take entries while they still fit in a block. Keys are sorted, so the largest delta is that of the last one.
+    int digits = keyDigits(keys[start]);
+    int width = 0;
+    std::size_t end = start + 1;
+    while (end < keys.size() && end - start < UINT16_MAX)
+    {
+      int newDigits = std::max(digits, keyDigits(keys[end]));
+      int newWidth = bitsFor(keyToInt(keys[end], newDigits) - keyToInt(keys[start], newDigits));
+      std::size_t numEntries = end + 1 - start;
+      if (compressedHeaderSize + (numEntries * newWidth + 7) / 8 + numEntries * packedAddressSize > nodeSize)
+      {
+        break;
+      }
+
+      digits = newDigits;
+      width = newWidth;
+      end++;
+    }
+
+    std::uint16_t numEntries = end - start;
+    std::uint8_t packedDigits = digits;
+    std::uint8_t packedWidth = width;
+    std::int64_t base = keyToInt(keys[start], digits);
+
+    std::fill(block.begin(), block.end(), 0);
+    unsigned char *cursor = block.data();
+    std::memcpy(cursor, &numEntries, sizeof(numEntries));
+    cursor += sizeof(numEntries);
+    *cursor++ = packedDigits;
+    *cursor++ = packedWidth;
+    std::memcpy(cursor, &base, sizeof(base));
+    cursor += sizeof(base);
+
+    for (std::size_t i = 0; i < numEntries; i++)
+    {
+      writeBits(cursor, i * width, width, keyToInt(keys[start + i], digits) - base);
+    }
+    cursor += (numEntries * width + 7) / 8;
+
+    for (std::size_t i = 0; i < numEntries; i++)
+    {
+      std::memcpy(cursor, &LLHeads[start + i].blockAddress, sizeof(void *));
+      std::memcpy(cursor + sizeof(void *), &LLHeads[start + i].offset, sizeof(short int));
+      cursor += packedAddressSize;
+    }
+
+    owned->push_back(index->saveToDisk(block.data(), nodeSize));
+    tree->frozenBlocks++;
+    if (start > 0)
+    {
+      lowerBoundKeys.push_back(keys[start]);
+    }
+    start = end;
+  }
+}
+
+bool BPlusTree::FrozenIndex::searchCompressedLeaf(const unsigned char *leaf, float lowerBoundKey, float upperBoundKey, std::vector<Record> &results) const
+{
+  std::uint16_t numEntries;
+  std::int64_t base;
+  std::memcpy(&numEntries, leaf, sizeof(numEntries));
+  int digits = leaf[sizeof(numEntries)];
+  int width = leaf[sizeof(numEntries) + 1];
+  std::memcpy(&base, leaf + sizeof(numEntries) + 2, sizeof(base));
+  const unsigned char *deltas = leaf + compressedHeaderSize;
+  const unsigned char *LLHeads = deltas + (numEntries * width + 7) / 8;
+
+  // Turn the bounds into the leaf's integers: the lowest that is at least lowerBoundKey, and the highest that is at
+  // most upperBoundKey. Only integers from one below the first key to one above the last matter.
+  long long last = base + (long long)readBits(deltas, (std::size_t)(numEntries - 1) * width, width);
+  long long low, high;
+  if (digits == rawBits)
+  {
+    low = keyToInt(lowerBoundKey, rawBits);
+    high = keyToInt(upperBoundKey, rawBits);
+  }
+  else
+  {
+    low = (long long)std::max((double)base - 1, std::min((double)last + 1, std::floor((double)lowerBoundKey * powersOfTen[digits])));
+    while (low <= last && intToKey(low, digits) < lowerBoundKey)
+    {
+      low++;
+    }
+    while (low > base && intToKey(low - 1, digits) >= lowerBoundKey)
+    {
+      low--;
+    }
+
+    high = (long long)std::max((double)base - 1, std::min((double)last + 1, std::ceil((double)upperBoundKey * powersOfTen[digits])));
+    while (high >= base && intToKey(high, digits) > upperBoundKey)
+    {
+      high--;
+    }
+    while (high < last && intToKey(high + 1, digits) <= upperBoundKey)
+    {
+      high++;
+    }
+  }
+
+  // Binary search the deltas as they are packed for the first entry in range, then walk on from there.
+  int first = 0;
+  int end = numEntries;
+  while (first < end)
+  {
+    int mid = (first + end) / 2;
+    if (base + (long long)readBits(deltas, (std::size_t)mid * width, width) < low)
+    {
+      first = mid + 1;
+    }
+    else
+    {
+      end = mid;
+    }
+  }
+
+  for (int i = first; i < numEntries; i++)
+  {
+    if (base + (long long)readBits(deltas, (std::size_t)i * width, width) > high)
+    {
+      return false;
+    }
+
+    Address LLHeadAddress;
+    std::memcpy(&LLHeadAddress.blockAddress, LLHeads + i * packedAddressSize, sizeof(void *));
+    std::memcpy(&LLHeadAddress.offset, LLHeads + i * packedAddressSize + sizeof(void *), sizeof(short int));
+    if (!isTombstone(LLHeadAddress))
+    {
+      collectLL(LLHeadAddress, results);
+    }
+  }
+
+  return true;
+}
+
+int BPlusTree::FrozenIndex::buildLayout(const std::vector<float> &lowerBoundKeys, int next, int k)
+{
+  // An in-order walk of the implicit tree visits its positions in sorted order.
+  if (k < (int)layout.size())
+  {
+    next = buildLayout(lowerBoundKeys, next, 2 * k);
+    layout[k] = lowerBoundKeys[next];
+    leafOf[k] = next + 1; // The first leaf has no lower bound key.
+    next++;
+    next = buildLayout(lowerBoundKeys, next, 2 * k + 1);
+  }
+  return next;
+}
+
+int BPlusTree::FrozenIndex::findLeafIndex(float key) const
+{
+  // Go right at every lower bound key not above our key. The last one we went right at belongs to our leaf.
+  int size = layout.size();
+  int leafIndex = 0;
+  int k = 1;
+  while (k < size)
+  {
+    // The descendants 4 levels down sit next to each other, so fetch them while we work through the levels above.
+    if (16 * k < size)
+    {
+      prefetch(&layout[16 * k]);
+    }
+
+    bool goRight = layout[k] <= key;
+    leafIndex = goRight ? leafOf[k] : leafIndex;
+    k = 2 * k + goRight;
+  }
+  return leafIndex;
+}
+
+void BPlusTree::FrozenIndex::collectLL(Address LLHeadAddress, std::vector<Record> &results) const
+{
+  Address LLNodeAddress = LLHeadAddress;
+
+  while (LLNodeAddress.blockAddress != nullptr)
+  {
+    Node *LLNode = (Node *)index->loadFromDisk(LLNodeAddress, sizeof(Node));
+
+    for (int i = 0; i < LLNode->numKeys; i++)
+    {
+      void *mainMemoryAddress = disk->loadFromDisk(LLNode->pointers[i], sizeof(Record));
+      results.push_back(*(Record *)mainMemoryAddress);
+      operator delete(mainMemoryAddress);
+    }
+
+    // Move to next node in linked list.
+    LLNodeAddress = LLNode->pointers[LLNode->numKeys];
+  }
+}
+
+std::vector<Record> BPlusTree::FrozenIndex::lookup(float key) const
+{
+  return search(key, key);
+}
+
+std::vector<Record> BPlusTree::FrozenIndex::search(float lowerBoundKey, float upperBoundKey) const
+{
+  std::unique_lock<std::mutex> lock = tree->lockTree();
+  std::vector<Record> results;
+
+  if (leaves.empty())
+  {
+    return results;
+  }
+
+  // Jump straight to the first leaf, then read the leaves in order from the snapshot's list.
+  for (int leafIndex = findLeafIndex(lowerBoundKey); leafIndex < (int)leaves.size(); leafIndex++)
+  {
+    if (compressedLeaves)
+    {
+      unsigned char *leaf = (unsigned char *)index->loadFromDisk(leaves[leafIndex], nodeSize);
+      bool inRange = searchCompressedLeaf(leaf, lowerBoundKey, upperBoundKey, results);
+      operator delete(leaf);
+      if (!inRange)
+      {
+        return results;
+      }
+      continue;
+    }
+
+    Node *leaf = (Node *)index->loadFromDisk(leaves[leafIndex], sizeof(Node));
+
+    for (int i = 0; i < leaf->numKeys; i++)
+    {
+      if (leaf->keys[i] > upperBoundKey)
+      {
+        return results;
+      }
+
+      if (leaf->keys[i] >= lowerBoundKey && !isTombstone(leaf->pointers[i]))
+      {
+        collectLL(leaf->pointers[i], results);
+      }
+    }
+  }
+
+  return results;
+}
@@ -4,34 +4,66 @@
 #include <vector>
 #include <cstring>
 #include <iostream>
+#include <algorithm>
+#include <limits>
 
 using namespace std;
 
 // Insert a record into the B+ Tree index. Key: Record's avgRating, Value: {blockAddress, offset}.
 void BPlusTree::insert(Address address, float key)
 {
+  std::unique_lock<std::mutex> lock = lockTree();
+  directoryAdmit(key);
+  keyCounts[key]++;
+
+  // With the delta tier on, the insert only goes into the in-memory delta for now.
+  if (deltaTier)
+  {
+    addToDelta(key, address, false);
+    return;
+  }
+
+  // In buffered mode, append the insert at the root and let flushes carry it down.
+  if (bufferedInserts)
+  {
+    bufferMessage(key, address, false);
+    return;
+  }
+
+  insertKey(address, key);
+}
+
+// Insert a record right away, descending from the root and splitting nodes as needed.
+void BPlusTree::insertKey(Address address, float key)
+{
+  // Keep the max numVotes summary of this key up to date if topK relies on it.
+  if (useVotesSummary)
+  {
+    updateVotesSummary(key, address);
+  }
+
   // If no root exists, create a new B+ Tree root.
   if (rootAddress == nullptr)
   {
     // Create a new linked list (for duplicates) at the key.
-    Node *LLNode = new Node(maxKeys);
+    Node *LLNode = nodeArena.allocate(maxLLKeys);
     LLNode->keys[0] = key;
     LLNode->isLeaf = false; // So we will never search it
     LLNode->numKeys = 1;
     LLNode->pointers[0] = address; // The disk address of the key just inserted
 
     // Allocate LLNode and root address
-    Address LLNodeAddress = index->saveToDisk((void *)LLNode, nodeSize);
+    Address LLNodeAddress = saveNewNode(LLNode, LLNodeSize);
 
     // Create new node in main memory, set it to root, and add the key and values to it.
-    root = new Node(maxKeys);
+    root = nodeArena.allocate(maxKeys);
     root->keys[0] = key;
     root->isLeaf = true; // It is both the root and a leaf.
     root->numKeys = 1;
     root->pointers[0] = LLNodeAddress; // Add record's disk address to pointer.
 
     // Write the root node into disk and track of root node's disk address.
-    rootAddress = index->saveToDisk(root, nodeSize).blockAddress;
+    rootAddress = saveNewNode(root, nodeSize).blockAddress;
   }
   // Else if root exists already, traverse the nodes to find the proper place to insert the key.
   else
@@ -56,7 +88,7 @@ void BPlusTree::insert(Address address, float key)
         if (key < cursor->keys[i])
         {
           // Load node in from disk to main memory.
-          Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i], nodeSize);
+          Node *mainMemoryNode = loadNode(cursor->pointers[i]);
 
           // Update cursorDiskAddress to maintain address in disk if we need to update nodes.
           cursorDiskAddress = cursor->pointers[i].blockAddress;
@@ -69,7 +101,7 @@ void BPlusTree::insert(Address address, float key)
         if (i == cursor->numKeys - 1)
         {
           // Load node in from disk to main memory.
-          Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i + 1], nodeSize);
+          Node *mainMemoryNode = loadNode(cursor->pointers[i + 1]);
 
           // Update diskAddress to maintain address in disk if we need to update nodes.
           cursorDiskAddress = cursor->pointers[i + 1].blockAddress;
@@ -92,9 +124,18 @@ void BPlusTree::insert(Address address, float key)
         i++;
       }
 
-      // i is where our key goes in. Check if it's already there (duplicate).
-      if (cursor->keys[i] == key)
+      // i is where our key goes in. Check if it's already there (duplicate). Slots past numKeys may hold stale keys.
+      if (i < cursor->numKeys && cursor->keys[i] == key)
       {
+        // If the key was deleted lazily, its old records are gone, so start over with a new linked list.
+        if (isTombstone(cursor->pointers[i]))
+        {
+          cursor->pointers[i] = reviveTombstone(cursor->pointers[i], address, key);
+          Address cursorOriginalAddress{cursorDiskAddress, 0};
+          index->saveToDisk(cursor, sizeof(Node), cursorOriginalAddress);
+          return;
+        }
+
         // If it's a duplicate, linked list already exists. Insert into linked list.
         // Insert and update the linked list head.
         cursor->pointers[i] = insertLL(cursor->pointers[i], address, key);
@@ -118,14 +159,14 @@ void BPlusTree::insert(Address address, float key)
 
         // We need to make a new linked list to store our record.
         // Create a new linked list (for duplicates) at the key.
-        Node *LLNode = new Node(maxKeys);
+        Node *LLNode = nodeArena.allocate(maxLLKeys);
         LLNode->keys[0] = key;
         LLNode->isLeaf = false; // So we will never search it
         LLNode->numKeys = 1;
         LLNode->pointers[0] = address; // The disk address of the key just inserted
 
         // Allocate LLNode into disk.
-        Address LLNodeAddress = index->saveToDisk((void *)LLNode, nodeSize);
+        Address LLNodeAddress = saveNewNode(LLNode, LLNodeSize);
 
         // Update variables
         cursor->pointers[i] = LLNodeAddress;
@@ -138,21 +179,19 @@ void BPlusTree::insert(Address address, float key)
         // cursorDiskAddress is the address of node in disk, cursor is the address of node in main memory.
         // In this case, we count read/writes as 1/O only (Assume block remains in main memory).
         Address cursorOriginalAddress{cursorDiskAddress, 0};
-        index->saveToDisk(cursor, nodeSize, cursorOriginalAddress);
+        index->saveToDisk(cursor, sizeof(Node), cursorOriginalAddress);
       }
     }
     // Overflow: If there's no space to insert new key, we have to split this node into two and update the parent if required.
     else
     {
-      // Create a new leaf node to put half the keys and pointers in.
-      Node *newLeaf = new Node(maxKeys);
-
       // Copy all current keys and pointers (including new key to insert) to a temporary list.
-      float tempKeyList[maxKeys + 1];
+      // The lists are the arena's scratch space, which is big enough for the biggest split so far.
+      float *tempKeyList = nodeArena.scratchKeys(maxKeys + 1);
 
       // We only need to store pointers corresponding to records (ignore those that points to other nodes).
       // Those that point to other nodes can be manipulated by themselves without this array later.
-      Address tempPointerList[maxKeys + 1];
+      Address *tempPointerList = nodeArena.scratchPointers(maxKeys + 1);
       Address next = cursor->pointers[cursor->numKeys];
 
       // Copy all keys and pointers to the temporary lists.
@@ -177,6 +216,15 @@ void BPlusTree::insert(Address address, float key)
       if (i < cursor->numKeys) {
         if (cursor->keys[i] == key)
         {
+          // If the key was deleted lazily, its old records are gone, so start over with a new linked list.
+          if (isTombstone(cursor->pointers[i]))
+          {
+            cursor->pointers[i] = reviveTombstone(cursor->pointers[i], address, key);
+            Address cursorOriginalAddress{cursorDiskAddress, 0};
+            index->saveToDisk(cursor, sizeof(Node), cursorOriginalAddress);
+            return;
+          }
+
           // If it's a duplicate, linked list already exists. Insert into linked list.
           // Insert and update the linked list head.
           cursor->pointers[i] = insertLL(cursor->pointers[i], address, key);
@@ -198,21 +246,25 @@ void BPlusTree::insert(Address address, float key)
 
       // The address to insert will be a new linked list node.
       // Create a new linked list (for duplicates) at the key.
-      Node *LLNode = new Node(maxKeys);
+      Node *LLNode = nodeArena.allocate(maxLLKeys);
       LLNode->keys[0] = key;
       LLNode->isLeaf = false; // So we will never search it
       LLNode->numKeys = 1;
       LLNode->pointers[0] = address; // The disk address of the key just inserted
 
       // Allocate LLNode into disk.
-      Address LLNodeAddress = index->saveToDisk((void *)LLNode, nodeSize);
+      Address LLNodeAddress = saveNewNode(LLNode, LLNodeSize);
       tempPointerList[i] = LLNodeAddress;
       
+      // Create a new leaf node to put half the keys and pointers in. It's only needed now we know the key is new.
+      Node *newLeaf = nodeArena.allocate(maxKeys);
       newLeaf->isLeaf = true; // New node is a leaf node.
 
       // Split the two new nodes into two. ⌊(n+1)/2⌋ keys for left, n+1 - ⌊(n+1)/2⌋ (aka remaining) keys for right.
-      cursor->numKeys = (maxKeys + 1) / 2;
-      newLeaf->numKeys = (maxKeys + 1) - ((maxKeys + 1) / 2);
+      // When appending to the rightmost leaf, the split policy may keep the left leaf fuller, since it won't get more keys.
+      bool appendingAtEnd = i == maxKeys && next.blockAddress == nullptr;
+      cursor->numKeys = leftSplitSize(maxKeys, maxKeys, appendingAtEnd);
+      newLeaf->numKeys = (maxKeys + 1) - cursor->numKeys;
 
       // Set the last pointer of the new leaf node to point to the previous last pointer of the existing node (cursor).
       // Essentially newLeaf -> Y, where Y is some other leaf node pointer wherein cursor -> Y previously.
@@ -238,7 +290,7 @@ void BPlusTree::insert(Address address, float key)
       }
 
       // Now that we have finished updating the two new leaf nodes, we need to write them to disk.
-      Address newLeafAddress = index->saveToDisk(newLeaf, nodeSize);
+      Address newLeafAddress = saveNewNode(newLeaf, nodeSize);
 
       // Now to set the cursors' pointer to the disk address of the leaf and save it in place
       cursor->pointers[cursor->numKeys] = newLeafAddress;
@@ -253,12 +305,12 @@ void BPlusTree::insert(Address address, float key)
       }
 
       Address cursorOriginalAddress{cursorDiskAddress, 0};
-      index->saveToDisk(cursor, nodeSize, cursorOriginalAddress);
+      index->saveToDisk(cursor, sizeof(Node), cursorOriginalAddress);
 
       // If we are at root (aka root == leaf), then we need to make a new parent root.
       if (cursor == root)
       {
-        Node *newRoot = new Node(maxKeys);
+        Node *newRoot = nodeArena.allocate(maxInternalKeys);
 
         // We need to set the new root's key to be the left bound of the right child.
         newRoot->keys[0] = newLeaf->keys[0];
@@ -274,22 +326,25 @@ void BPlusTree::insert(Address address, float key)
         newRoot->numKeys = 1;
 
         // Write the new root node to disk and update the root disk address stored in B+ Tree.
-        Address newRootAddress = index->saveToDisk(newRoot, nodeSize);
+        Address newRootAddress = saveNewNode(newRoot, internalNodeSize);
 
         // Update the root address
         rootAddress = newRootAddress.blockAddress;
         root = newRoot;
+        unpinLevels();
       }
       // If we are not at the root, we need to insert a new parent in the middle levels of the tree.
       else
       {
         insertInternal(newLeaf->keys[0], (Node *)parentDiskAddress, (Node *)newLeafAddress.blockAddress);
       }
+
+      learnedLeafAdded(newLeaf->keys[0], newLeafAddress.blockAddress);
     }
   }
 
   // update numnodes 
-  numNodes = index->getAllocated();
+  numNodes = countNodes();
 }
 
 // Updates the parent node to point at both child nodes, and adds a parent node if needed.
@@ -297,9 +352,12 @@ void BPlusTree::insert(Address address, float key)
 // as well as disk address of parent and new child.
 void BPlusTree::insertInternal(float key, Node *cursorDiskAddress, Node *childDiskAddress)
 {
+  // The parent is about to change (and may split), so it can't stay pinned.
+  unpinLevels(cursorDiskAddress);
+
   // Load in cursor (parent) and child from disk to get latest copy.
   Address cursorAddress{cursorDiskAddress, 0};
-  Node *cursor = (Node *)index->loadFromDisk(cursorAddress, nodeSize);
+  Node *cursor = (Node *)index->loadFromDisk(cursorAddress, sizeof(Node));
 
   if (cursorDiskAddress == rootAddress)
   {
@@ -307,11 +365,11 @@ void BPlusTree::insertInternal(float key, Node *cursorDiskAddress, Node *childDi
   }
 
   Address childAddress{childDiskAddress, 0};
-  Node *child = (Node *)index->loadFromDisk(childAddress, nodeSize);
+  Node *child = (Node *)index->loadFromDisk(childAddress, sizeof(Node));
 
   // If parent (cursor) still has space, we can simply add the child node as a pointer.
   // We don't have to load parent from the disk again since we still have a main memory pointer to it.
-  if (cursor->numKeys < maxKeys)
+  if (cursor->numKeys < maxInternalKeys)
   {
     // Iterate through the parent to see where to put in the lower bound key for the new child.
     int i = 0;
@@ -343,44 +401,45 @@ void BPlusTree::insertInternal(float key, Node *cursorDiskAddress, Node *childDi
 
     // Write the updated parent (cursor) to the disk.
     Address cursorAddress{cursorDiskAddress, 0};
-    index->saveToDisk(cursor, nodeSize, cursorAddress);
+    index->saveToDisk(cursor, sizeof(Node), cursorAddress);
   }
   // If parent node doesn't have space, we need to recursively split parent node and insert more parent nodes.
   else
   {
     // Make new internal node (split this parent node into two).
     // Note: We DO NOT add a new key, just a new pointer!
-    Node *newInternal = new Node(maxKeys);
+    Node *newInternal = nodeArena.allocate(maxInternalKeys);
 
     // Same logic as above, keep a temp list of keys and pointers to insert into the split nodes.
     // Now, we have one extra pointer to keep track of (new child's pointer).
-    float tempKeyList[maxKeys + 1];
-    Address tempPointerList[maxKeys + 2];
+    // Splits further up reuse the same scratch lists, but only once we are done with them here.
+    float *tempKeyList = nodeArena.scratchKeys(maxInternalKeys + 1);
+    Address *tempPointerList = nodeArena.scratchPointers(maxInternalKeys + 2);
 
     // Copy all keys into a temp key list.
-    // Note all keys are filled so we just copy till maxKeys.
-    for (int i = 0; i < maxKeys; i++)
+    // Note all keys are filled so we just copy till maxInternalKeys.
+    for (int i = 0; i < maxInternalKeys; i++)
     {
       tempKeyList[i] = cursor->keys[i];
     }
 
     // Copy all pointers into a temp pointer list.
-    // There is one more pointer than keys in the node so maxKeys + 1.
-    for (int i = 0; i < maxKeys + 1; i++)
+    // There is one more pointer than keys in the node so maxInternalKeys + 1.
+    for (int i = 0; i < maxInternalKeys + 1; i++)
     {
       tempPointerList[i] = cursor->pointers[i];
     }
 
     // Find index to insert key in temp key list.
     int i = 0;
-    while (key > tempKeyList[i] && i < maxKeys)
+    while (key > tempKeyList[i] && i < maxInternalKeys)
     {
       i++;
     }
 
     // Swap all elements higher than index backwards to fit new key.
     int j;
-    for (int j = maxKeys; j > i; j--)
+    for (int j = maxInternalKeys; j > i; j--)
     {
       tempKeyList[j] = tempKeyList[j - 1];
     }
@@ -389,7 +448,7 @@ void BPlusTree::insertInternal(float key, Node *cursorDiskAddress, Node *childDi
     tempKeyList[i] = key;
 
     // Move all pointers back to fit new child's pointer as well.
-    for (int j = maxKeys + 1; j > i + 1; j--)
+    for (int j = maxInternalKeys + 1; j > i + 1; j--)
     {
       tempPointerList[j] = tempPointerList[j - 1];
     }
@@ -399,16 +458,21 @@ void BPlusTree::insertInternal(float key, Node *cursorDiskAddress, Node *childDi
     tempPointerList[i + 1] = childAddress;
     newInternal->isLeaf = false; // Can't be leaf as it's a parent.
 
-    // Split the two new nodes into two. ⌊(n)/2⌋ keys for left.
-    // For right, we drop the rightmost key since we only need to represent the pointer.
-    cursor->numKeys = (maxKeys + 1) / 2;
-    newInternal->numKeys = maxKeys - (maxKeys + 1) / 2;
+    // Split the two new nodes into two. ⌊(n)/2⌋ keys for left (or more when appending, depending on the split policy).
+    // For right, we drop the rightmost key since we only need to represent the pointer. Right keeps at least one key.
+    cursor->numKeys = leftSplitSize(maxInternalKeys, maxInternalKeys - 1, i == maxInternalKeys);
+    newInternal->numKeys = maxInternalKeys - cursor->numKeys;
 
-    // Reassign keys into cursor from tempkeyslist to account for new child node
+    // Reassign keys and pointers into cursor from the temp lists to account for new child node
     for (int i = 0; i < cursor->numKeys; i++)
     {
       cursor->keys[i] = tempKeyList[i];
     }
+
+    for (int i = 0; i < cursor->numKeys + 1; i++)
+    {
+      cursor->pointers[i] = tempPointerList[i];
+    }
     
     // Insert new keys into the new internal parent node.
     for (i = 0, j = cursor->numKeys + 1; i < newInternal->numKeys; i++, j++)
@@ -428,35 +492,35 @@ void BPlusTree::insertInternal(float key, Node *cursorDiskAddress, Node *childDi
     // KIVVVVVVV
 
     // Get rid of unecessary cursor keys and pointers
-    for (int i = cursor->numKeys; i < maxKeys; i++) 
+    for (int i = cursor->numKeys; i < maxInternalKeys; i++) 
     {
       cursor->keys[i] = float();
     }
 
-    for (int i = cursor->numKeys + 1; i < maxKeys + 1; i++)
+    for (int i = cursor->numKeys + 1; i < maxInternalKeys + 1; i++)
     {
       Address nullAddress{nullptr, 0};
       cursor->pointers[i] = nullAddress;
     }
 
-    // assign the new child to the original parent
-    cursor->pointers[cursor->numKeys] = childAddress;
-
     // Save the old parent and new internal node to disk.
     Address cursorAddress{cursorDiskAddress, 0};
-    index->saveToDisk(cursor, nodeSize, cursorAddress);
+    index->saveToDisk(cursor, sizeof(Node), cursorAddress);
 
     // Address newInternalAddress{newInternal, 0};
-    Address newInternalDiskAddress = index->saveToDisk(newInternal, nodeSize);
+    Address newInternalDiskAddress = saveNewNode(newInternal, internalNodeSize);
+
+    // Buffered messages for keys that moved to the new internal node go with them.
+    splitBuffer(cursorDiskAddress, newInternalDiskAddress.blockAddress, tempKeyList[cursor->numKeys]);
 
     // If current cursor is the root of the tree, we need to create a new root.
     if (cursor == root)
     {
-      Node *newRoot = new Node(nodeSize);
+      Node *newRoot = nodeArena.allocate(maxInternalKeys);
       // Update newRoot to hold the children.
       // Take the rightmost key of the old parent to be the root.
       // Although we threw it away, we are still using it to denote the leftbound of the old child.
-      newRoot->keys[0] = cursor->keys[cursor->numKeys];
+      newRoot->keys[0] = tempKeyList[cursor->numKeys];
 
       // Update newRoot's children to be the previous two nodes
       Address cursorAddress = {cursorDiskAddress, 0};
@@ -470,7 +534,7 @@ void BPlusTree::insertInternal(float key, Node *cursorDiskAddress, Node *childDi
       root = newRoot;
 
       // Save newRoot into disk.
-      Address newRootAddress = index->saveToDisk(root, nodeSize);
+      Address newRootAddress = saveNewNode(root, internalNodeSize);
 
       // Update rootAddress
       rootAddress = newRootAddress.blockAddress;
@@ -488,14 +552,143 @@ void BPlusTree::insertInternal(float key, Node *cursorDiskAddress, Node *childDi
   }
 }
 
+void BPlusTree::insertInternalBatch(Node *cursorDiskAddress, const std::vector<float> &keys, const std::vector<Address> &children)
+{
+  // The parent is about to change (and may split), so it can't stay pinned.
+  unpinLevels(cursorDiskAddress);
+
+  Address cursorAddress{cursorDiskAddress, 0};
+  Node *cursor = (Node *)index->loadFromDisk(cursorAddress, sizeof(Node));
+
+  if (cursorDiskAddress == rootAddress)
+  {
+    root = cursor;
+  }
+
+  // Merge the new keys into the parent's, each new child going right of its key.
+  std::vector<float> mergedKeys;
+  std::vector<Address> mergedPointers(1, cursor->pointers[0]);
+  int pos = 0;
+  for (int i = 0; i < (int)keys.size(); i++)
+  {
+    while (pos < cursor->numKeys && cursor->keys[pos] < keys[i])
+    {
+      mergedKeys.push_back(cursor->keys[pos]);
+      mergedPointers.push_back(cursor->pointers[pos + 1]);
+      pos++;
+    }
+    mergedKeys.push_back(keys[i]);
+    mergedPointers.push_back(children[i]);
+  }
+  bool appendingAtEnd = pos == cursor->numKeys;
+  while (pos < cursor->numKeys)
+  {
+    mergedKeys.push_back(cursor->keys[pos]);
+    mergedPointers.push_back(cursor->pointers[pos + 1]);
+    pos++;
+  }
+
+  // Cut the pointers into as few nodes as possible, with their sizes evened out. The key between two nodes goes up.
+  int numMerged = mergedPointers.size();
+  int numChunks = (numMerged + maxInternalKeys) / (maxInternalKeys + 1);
+  std::vector<int> chunkStart(numChunks + 1, 0);
+  for (int c = 0; c < numChunks; c++)
+  {
+    chunkStart[c + 1] = chunkStart[c] + numMerged / numChunks + (c < numMerged % numChunks ? 1 : 0);
+  }
+
+  // Appending to the end of the node, fill nodes up to what the split policy keeps instead (if the last one still
+  // gets a key).
+  if (numChunks > 1 && appendingAtEnd)
+  {
+    int chunkSize = leftSplitSize(maxInternalKeys, maxInternalKeys - 1, true) + 1;
+    int numFilled = (numMerged + chunkSize - 1) / chunkSize;
+    if (numMerged - (numFilled - 1) * chunkSize >= 2)
+    {
+      numChunks = numFilled;
+      chunkStart.assign(numChunks + 1, 0);
+      for (int c = 0; c < numChunks; c++)
+      {
+        chunkStart[c + 1] = std::min(numMerged, chunkStart[c] + chunkSize);
+      }
+    }
+  }
+
+  // Write the new nodes, then what the parent keeps.
+  std::vector<float> separatorKeys;
+  std::vector<Address> newNodeAddresses;
+  for (int c = 1; c < numChunks; c++)
+  {
+    Node *newInternal = nodeArena.allocate(maxInternalKeys);
+    newInternal->isLeaf = false;
+    newInternal->numKeys = chunkStart[c + 1] - chunkStart[c] - 1;
+    for (int j = 0; j < newInternal->numKeys; j++)
+    {
+      newInternal->keys[j] = mergedKeys[chunkStart[c] + j];
+    }
+    for (int j = 0; j < newInternal->numKeys + 1; j++)
+    {
+      newInternal->pointers[j] = mergedPointers[chunkStart[c] + j];
+    }
+
+    separatorKeys.push_back(mergedKeys[chunkStart[c] - 1]);
+    newNodeAddresses.push_back(saveNewNode(newInternal, internalNodeSize));
+  }
+
+  cursor->numKeys = chunkStart[1] - 1;
+  for (int j = 0; j < maxInternalKeys; j++)
+  {
+    cursor->keys[j] = j < cursor->numKeys ? mergedKeys[j] : float();
+  }
+  for (int j = 0; j < maxInternalKeys + 1; j++)
+  {
+    Address nullAddress{nullptr, 0};
+    cursor->pointers[j] = j < cursor->numKeys + 1 ? mergedPointers[j] : nullAddress;
+  }
+  index->saveToDisk(cursor, sizeof(Node), cursorAddress);
+
+  if (numChunks == 1)
+  {
+    return;
+  }
+
+  // Buffered messages for keys that moved to a new node go with them, taking the rightmost node's first.
+  for (int c = (int)newNodeAddresses.size() - 1; c >= 0; c--)
+  {
+    splitBuffer(cursorDiskAddress, newNodeAddresses[c].blockAddress, separatorKeys[c]);
+  }
+
+  // If the cursor was the root, the new nodes go under a new root above it (which may split in turn).
+  Node *parentDiskAddress;
+  if (cursorDiskAddress == rootAddress)
+  {
+    Node *newRoot = nodeArena.allocate(maxInternalKeys);
+    newRoot->isLeaf = false;
+    newRoot->numKeys = 0;
+    newRoot->pointers[0] = cursorAddress;
+
+    Address newRootAddress = saveNewNode(newRoot, internalNodeSize);
+    rootAddress = newRootAddress.blockAddress;
+    root = newRoot;
+    unpinLevels();
+    parentDiskAddress = (Node *)rootAddress;
+  }
+  else
+  {
+    parentDiskAddress = findParent((Node *)rootAddress, cursorDiskAddress, cursor->keys[0]);
+  }
+
+  insertInternalBatch(parentDiskAddress, separatorKeys, newNodeAddresses);
+}
+
 // Inserts a record into an existing linked list.
 Address BPlusTree::insertLL(Address LLHead, Address address, float key)
 {
   // Load the linked list head node into main memory.
-  Node *head = (Node *)index->loadFromDisk(LLHead, nodeSize);
+  Node *head = (Node *)index->loadFromDisk(LLHead, sizeof(Node));
 
   // Check if the head node has space to put record.
-  if (head->numKeys < maxKeys)
+  if (head->numKeys < maxLLKeys)
   {
 
     // Move all keys back to insert at the head.
@@ -517,7 +710,8 @@ Address BPlusTree::insertLL(Address LLHead, Address address, float key)
     head->numKeys++;
     
     // Write head back to disk.
-    LLHead = index->saveToDisk((void *)head, nodeSize, LLHead);
+    LLHead = index->saveToDisk((void *)head, sizeof(Node), LLHead);
+    directoryRemember(key, LLHead);
 
     // Return head address
     return LLHead;
@@ -526,7 +720,7 @@ Address BPlusTree::insertLL(Address LLHead, Address address, float key)
   else
   {
     // Make a new node and add variables
-    Node *LLNode = new Node(maxKeys);
+    Node *LLNode = nodeArena.allocate(maxLLKeys);
     LLNode->isLeaf = false;
     LLNode->keys[0] = key;
     LLNode->numKeys = 1;
@@ -538,9 +732,271 @@ Address BPlusTree::insertLL(Address LLHead, Address address, float key)
     LLNode->pointers[1] = LLHead;
 
     // Write new linked list node to disk.
-    Address LLNodeAddress = index->saveToDisk((void *)LLNode, nodeSize);
+    Address LLNodeAddress = saveNewNode(LLNode, LLNodeSize);
+    directoryRemember(key, LLNodeAddress);
 
     // Return disk address of new linked list head
     return LLNodeAddress;
   }
-}
\ No newline at end of file
+}
+
+// A key deleted lazily is inserted again: free the records of its old linked list and start a new one.
+Address BPlusTree::reviveTombstone(Address tombstoneAddress, Address address, float key)
+{
+  Address LLHeadAddress{tombstoneAddress.blockAddress, 0};
+  removeLL(LLHeadAddress);
+  freeRemovedRecords();
+  numTombstones--;
+
+  // Create a new linked list (for duplicates) at the key.
+  Node *LLNode = nodeArena.allocate(maxLLKeys);
+  LLNode->keys[0] = key;
+  LLNode->isLeaf = false; // So we will never search it
+  LLNode->numKeys = 1;
+  LLNode->pointers[0] = address; // The disk address of the key just inserted
+
+  // Allocate LLNode into disk.
+  Address LLNodeAddress = saveNewNode(LLNode, LLNodeSize);
+  directoryRemember(key, LLNodeAddress);
+  return LLNodeAddress;
+}
+
+// Insert a batch of records, visiting each target leaf once.
+void BPlusTree::insertBatch(const std::vector<std::pair<float, Address>> &batch)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  for (const std::pair<float, Address> &entry : batch)
+  {
+    directoryAdmit(entry.first);
+    keyCounts[entry.first]++;
+  }
+
+  // The delta tier and buffered mode already batch changes their own way.
+  if (deltaTier || bufferedInserts)
+  {
+    for (const std::pair<float, Address> &entry : batch)
+    {
+      if (deltaTier)
+      {
+        addToDelta(entry.first, entry.second, false);
+      }
+      else
+      {
+        bufferMessage(entry.first, entry.second, false);
+      }
+    }
+    return;
+  }
+
+  // Sort by key. Stable, so that duplicates keep their order.
+  std::vector<std::pair<float, Address>> sorted(batch);
+  std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<float, Address> &a, const std::pair<float, Address> &b)
+  {
+    return a.first < b.first;
+  });
+
+  int next = 0;
+
+  // An empty tree gets its first leaf from the regular insert.
+  if (rootAddress == nullptr && next < (int)sorted.size())
+  {
+    insertKey(sorted[next].second, sorted[next].first);
+    next++;
+  }
+
+  while (next < (int)sorted.size())
+  {
+    // Descend to the leaf of the next key, keeping track of the smallest separator key above it on the way.
+    // Every batch key below that bound goes into the same leaf.
+    float upperBoundKey = std::numeric_limits<float>::infinity();
+    void *parentDiskAddress = nullptr;
+    void *leafDiskAddress = rootAddress;
+    Address rootDiskAddress{rootAddress, 0};
+    Node *leaf = loadNode(rootDiskAddress);
+
+    while (leaf->isLeaf == false)
+    {
+      int childIndex = findChildIndex(leaf, sorted[next].first);
+      if (childIndex < leaf->numKeys)
+      {
+        upperBoundKey = std::min(upperBoundKey, leaf->keys[childIndex]);
+      }
+
+      parentDiskAddress = leafDiskAddress;
+      leafDiskAddress = leaf->pointers[childIndex].blockAddress;
+      leaf = loadNode(leaf->pointers[childIndex]);
+    }
+
+    int end = next;
+    while (end < (int)sorted.size() && sorted[end].first < upperBoundKey)
+    {
+      end++;
+    }
+
+    // Merge the leaf's keys with the batch keys, adding records to the linked lists as we go.
+    std::vector<float> mergedKeys;
+    std::vector<Address> mergedPointers;
+    int pos = 0;
+    int i = next;
+    while (i < end)
+    {
+      float key = sorted[i].first;
+
+      while (pos < leaf->numKeys && leaf->keys[pos] < key)
+      {
+        mergedKeys.push_back(leaf->keys[pos]);
+        mergedPointers.push_back(leaf->pointers[pos]);
+        pos++;
+      }
+
+      Address LLHeadAddress;
+      if (pos < leaf->numKeys && leaf->keys[pos] == key)
+      {
+        // Duplicate of a key in the leaf. A tombstoned key starts over with a new linked list.
+        LLHeadAddress = leaf->pointers[pos];
+        if (isTombstone(LLHeadAddress))
+        {
+          LLHeadAddress = reviveTombstone(LLHeadAddress, sorted[i].second, key);
+        }
+        else
+        {
+          LLHeadAddress = insertLL(LLHeadAddress, sorted[i].second, key);
+        }
+        pos++;
+      }
+      else
+      {
+        // Create a new linked list (for duplicates) at the key.
+        Node *LLNode = nodeArena.allocate(maxLLKeys);
+        LLNode->keys[0] = key;
+        LLNode->isLeaf = false; // So we will never search it
+        LLNode->numKeys = 1;
+        LLNode->pointers[0] = sorted[i].second; // The disk address of the key just inserted
+
+        LLHeadAddress = saveNewNode(LLNode, LLNodeSize);
+      }
+
+      if (useVotesSummary)
+      {
+        updateVotesSummary(key, sorted[i].second);
+      }
+      i++;
+
+      // The rest of the batch's records with this key go into the same linked list.
+      while (i < end && sorted[i].first == key)
+      {
+        LLHeadAddress = insertLL(LLHeadAddress, sorted[i].second, key);
+        if (useVotesSummary)
+        {
+          updateVotesSummary(key, sorted[i].second);
+        }
+        i++;
+      }
+
+      mergedKeys.push_back(key);
+      mergedPointers.push_back(LLHeadAddress);
+    }
+
+    while (pos < leaf->numKeys)
+    {
+      mergedKeys.push_back(leaf->keys[pos]);
+      mergedPointers.push_back(leaf->pointers[pos]);
+      pos++;
+    }
+
+    Address nextLeafAddress = leaf->pointers[leaf->numKeys];
+
+    // Cut the merged keys into as few leaves as possible, with their sizes evened out.
+    int numMerged = mergedKeys.size();
+    int numLeaves = (numMerged + maxKeys - 1) / maxKeys;
+    std::vector<int> chunkStart(numLeaves + 1, 0);
+    for (int c = 0; c < numLeaves; c++)
+    {
+      chunkStart[c + 1] = chunkStart[c] + numMerged / numLeaves + (c < numMerged % numLeaves ? 1 : 0);
+    }
+
+    // Past the end of the tree, fill leaves up to what the split policy keeps on an append instead.
+    if (numLeaves > 1 && nextLeafAddress.blockAddress == nullptr && mergedKeys.back() > leaf->keys[leaf->numKeys - 1])
+    {
+      int leafSize = leftSplitSize(maxKeys, maxKeys, true);
+      numLeaves = (numMerged + leafSize - 1) / leafSize;
+      chunkStart.assign(numLeaves + 1, 0);
+      for (int c = 0; c < numLeaves; c++)
+      {
+        chunkStart[c + 1] = std::min(numMerged, chunkStart[c] + leafSize);
+      }
+    }
+
+    // Write the new leaves from right to left, so each one knows the address of the next.
+    std::vector<Address> newLeafAddresses(numLeaves);
+    for (int c = numLeaves - 1; c >= 1; c--)
+    {
+      Node *newLeaf = nodeArena.allocate(maxKeys);
+      newLeaf->isLeaf = true;
+      newLeaf->numKeys = chunkStart[c + 1] - chunkStart[c];
+      for (int j = 0; j < newLeaf->numKeys; j++)
+      {
+        newLeaf->keys[j] = mergedKeys[chunkStart[c] + j];
+        newLeaf->pointers[j] = mergedPointers[chunkStart[c] + j];
+      }
+      newLeaf->pointers[newLeaf->numKeys] = nextLeafAddress;
+
+      nextLeafAddress = saveNewNode(newLeaf, nodeSize);
+      newLeafAddresses[c] = nextLeafAddress;
+    }
+
+    // The existing leaf keeps the first chunk.
+    leaf->numKeys = chunkStart[1];
+    for (int j = 0; j < leaf->numKeys; j++)
+    {
+      leaf->keys[j] = mergedKeys[j];
+      leaf->pointers[j] = mergedPointers[j];
+    }
+    leaf->pointers[leaf->numKeys] = nextLeafAddress;
+    for (int j = leaf->numKeys + 1; j < maxKeys + 1; j++)
+    {
+      Address nullAddress{nullptr, 0};
+      leaf->pointers[j] = nullAddress;
+    }
+
+    Address leafAddress{leafDiskAddress, 0};
+    index->saveToDisk(leaf, sizeof(Node), leafAddress);
+    if (leafDiskAddress == rootAddress)
+    {
+      root = leaf;
+    }
+
+    // Add the new leaves to the parent together. Parents that overflow split on the way up, once per level.
+    std::vector<float> lowerBoundKeys;
+    for (int c = 1; c < numLeaves; c++)
+    {
+      lowerBoundKeys.push_back(mergedKeys[chunkStart[c]]);
+      learnedLeafAdded(lowerBoundKeys.back(), newLeafAddresses[c].blockAddress);
+    }
+
+    if (numLeaves > 1)
+    {
+      // If the leaf was the root, we need to make a new root above it first.
+      if (parentDiskAddress == nullptr)
+      {
+        Node *newRoot = nodeArena.allocate(maxInternalKeys);
+        newRoot->pointers[0] = leafAddress;
+        newRoot->isLeaf = false;
+        newRoot->numKeys = 0;
+
+        Address newRootAddress = saveNewNode(newRoot, internalNodeSize);
+        rootAddress = newRootAddress.blockAddress;
+        root = newRoot;
+        parentDiskAddress = rootAddress;
+        unpinLevels();
+      }
+
+      insertInternalBatch((Node *)parentDiskAddress, lowerBoundKeys, std::vector<Address>(newLeafAddresses.begin() + 1, newLeafAddresses.end()));
+    }
+
+    next = end;
+  }
+
+  numNodes = countNodes();
+}
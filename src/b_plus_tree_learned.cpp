@@ -0,0 +1,285 @@
+#include "b_plus_tree.h"
+#include "types.h"
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+
+// Learned leaf directory: the lower bound keys of the leaves, in order, are cut into segments and each segment gets
+// a line that predicts the position of a leaf from a key to within learnedMaxError. A lookup binary searches the
+// (few) segment start keys, evaluates the line, and searches a small window around the prediction, so it goes to the
+// leaf without touching an internal node. Lower bound keys are the separator keys of the tree, so they only change
+// when leaves split, merge or borrow, and each of those refits just the segment it falls in.
+
+void BPlusTree::setLearnedIndex(bool enabled, int maxError)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  segments.clear();
+  leafLowerBounds.clear();
+  learnedIndex = enabled;
+  learnedMaxError = std::max(0, maxError);
+
+  if (learnedIndex && rootAddress != nullptr)
+  {
+    buildLearnedIndex();
+  }
+}
+
+void BPlusTree::buildLearnedIndex()
+{
+  segments.clear();
+  leafLowerBounds.clear();
+
+  if (rootAddress == nullptr)
+  {
+    return;
+  }
+
+  // Nothing is below the first leaf, so its lower bound is minus infinity.
+  std::vector<float> lowerBoundKeys;
+  std::vector<void *> leaves;
+  Address rootDiskAddress{rootAddress, 0};
+  collectLeaves(rootDiskAddress, -std::numeric_limits<float>::infinity(), lowerBoundKeys, leaves);
+
+  fitSegments(lowerBoundKeys, leaves, segments);
+  for (int i = 0; i < (int)leaves.size(); i++)
+  {
+    leafLowerBounds[leaves[i]] = lowerBoundKeys[i];
+  }
+}
+
+void BPlusTree::collectLeaves(Address nodeAddress, float lowerBoundKey, std::vector<float> &lowerBoundKeys, std::vector<void *> &leaves)
+{
+  Node *node = loadNode(nodeAddress);
+
+  if (node->isLeaf)
+  {
+    lowerBoundKeys.push_back(lowerBoundKey);
+    leaves.push_back(nodeAddress.blockAddress);
+    return;
+  }
+
+  // The first child shares our lower bound, every other child starts at the key on its left.
+  int numKeys = node->numKeys;
+  std::vector<Address> children(node->pointers, node->pointers + numKeys + 1);
+  std::vector<float> keys(node->keys, node->keys + numKeys);
+  for (int i = 0; i < numKeys + 1; i++)
+  {
+    collectLeaves(children[i], i == 0 ? lowerBoundKey : keys[i - 1], lowerBoundKeys, leaves);
+  }
+}
+
+void BPlusTree::fitSegments(const std::vector<float> &lowerBoundKeys, const std::vector<void *> &leaves, std::vector<LeafSegment> &fitted)
+{
+  int numLeaves = lowerBoundKeys.size();
+  int start = 0;
+
+  while (start < numLeaves)
+  {
+    // The line goes through the first leaf of the segment. The first leaf of the tree has no finite lower bound, so
+    // it goes through the next one instead; keys below that predict a position of at most 1 and are in the window.
+    int anchor = start;
+    if (lowerBoundKeys[start] == -std::numeric_limits<float>::infinity() && start + 1 < numLeaves)
+    {
+      anchor = start + 1;
+    }
+
+    // Shrink the range of slopes that keep every leaf so far within the error, until a leaf leaves none.
+    double lowSlope = 0;
+    double highSlope = std::numeric_limits<double>::infinity();
+    int end = anchor + 1;
+    while (end < numLeaves)
+    {
+      double dx = (double)lowerBoundKeys[end] - lowerBoundKeys[anchor];
+      double newLowSlope = std::max(lowSlope, (end - anchor - learnedMaxError) / dx);
+      double newHighSlope = std::min(highSlope, (end - anchor + learnedMaxError) / dx);
+      if (newLowSlope > newHighSlope)
+      {
+        break;
+      }
+
+      lowSlope = newLowSlope;
+      highSlope = newHighSlope;
+      end++;
+    }
+
+    LeafSegment segment;
+    segment.anchorKey = lowerBoundKeys[anchor];
+    segment.anchorPos = anchor - start;
+    segment.slope = end - anchor > 1 ? (lowSlope + highSlope) / 2 : 0;
+    segment.lowerBoundKeys.assign(lowerBoundKeys.begin() + start, lowerBoundKeys.begin() + end);
+    segment.leaves.assign(leaves.begin() + start, leaves.begin() + end);
+    fitted.push_back(segment);
+
+    start = end;
+  }
+}
+
+int BPlusTree::findSegment(float key)
+{
+  // The last segment starting at or below the key.
+  int low = 0;
+  int high = segments.size();
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    if (segments[mid].lowerBoundKeys[0] <= key)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+  return std::max(0, low - 1);
+}
+
+void BPlusTree::refitSegment(int segment)
+{
+  // Fit it together with the next segment, so segments that fit on one line again are joined back up.
+  int last = std::min(segment + 2, (int)segments.size());
+  std::vector<float> lowerBoundKeys;
+  std::vector<void *> leaves;
+  for (int s = segment; s < last; s++)
+  {
+    lowerBoundKeys.insert(lowerBoundKeys.end(), segments[s].lowerBoundKeys.begin(), segments[s].lowerBoundKeys.end());
+    leaves.insert(leaves.end(), segments[s].leaves.begin(), segments[s].leaves.end());
+  }
+
+  std::vector<LeafSegment> fitted;
+  fitSegments(lowerBoundKeys, leaves, fitted);
+
+  segments.erase(segments.begin() + segment, segments.begin() + last);
+  segments.insert(segments.begin() + segment, fitted.begin(), fitted.end());
+}
+
+void BPlusTree::learnedLeafAdded(float lowerBoundKey, void *leafDiskAddress)
+{
+  // An empty directory is built in full by the next learned search.
+  if (learnedIndex == false || segments.empty())
+  {
+    return;
+  }
+
+  int s = findSegment(lowerBoundKey);
+  LeafSegment &segment = segments[s];
+  int pos = std::upper_bound(segment.lowerBoundKeys.begin(), segment.lowerBoundKeys.end(), lowerBoundKey) - segment.lowerBoundKeys.begin();
+  segment.lowerBoundKeys.insert(segment.lowerBoundKeys.begin() + pos, lowerBoundKey);
+  segment.leaves.insert(segment.leaves.begin() + pos, leafDiskAddress);
+  leafLowerBounds[leafDiskAddress] = lowerBoundKey;
+
+  refitSegment(s);
+}
+
+void BPlusTree::learnedLeafRemoved(void *leafDiskAddress)
+{
+  auto bound = leafLowerBounds.find(leafDiskAddress);
+  if (learnedIndex == false || bound == leafLowerBounds.end())
+  {
+    return;
+  }
+
+  // Its keys went to the leaf before it, which now also covers its range.
+  int s = findSegment(bound->second);
+  LeafSegment &segment = segments[s];
+  int pos = std::lower_bound(segment.lowerBoundKeys.begin(), segment.lowerBoundKeys.end(), bound->second) - segment.lowerBoundKeys.begin();
+  segment.lowerBoundKeys.erase(segment.lowerBoundKeys.begin() + pos);
+  segment.leaves.erase(segment.leaves.begin() + pos);
+  leafLowerBounds.erase(bound);
+
+  if (segment.leaves.empty())
+  {
+    segments.erase(segments.begin() + s);
+  }
+  else
+  {
+    refitSegment(s);
+  }
+}
+
+void BPlusTree::learnedLeafMoved(void *leafDiskAddress, float lowerBoundKey)
+{
+  auto bound = leafLowerBounds.find(leafDiskAddress);
+  if (learnedIndex == false || bound == leafLowerBounds.end())
+  {
+    return;
+  }
+
+  // Borrowing moves a lower bound key between those of the neighbouring leaves, so the order stays the same.
+  int s = findSegment(bound->second);
+  LeafSegment &segment = segments[s];
+  int pos = std::lower_bound(segment.lowerBoundKeys.begin(), segment.lowerBoundKeys.end(), bound->second) - segment.lowerBoundKeys.begin();
+  segment.lowerBoundKeys[pos] = lowerBoundKey;
+  bound->second = lowerBoundKey;
+
+  refitSegment(s);
+}
+
+void *BPlusTree::findLeafLearned(float key)
+{
+  LeafSegment &segment = segments[findSegment(key)];
+  int numLeaves = segment.leaves.size();
+
+  // Predict the position, keeping it inside the segment.
+  double predicted = segment.anchorPos;
+  if (segment.slope != 0)
+  {
+    predicted += segment.slope * ((double)key - segment.anchorKey);
+  }
+  int pos = (int)std::max(0.0, std::min((double)(numLeaves - 1), predicted));
+
+  // Last-mile search: the leaf is within the error of the prediction, give or take the one the key falls past.
+  int low = std::max(0, pos - learnedMaxError - 1);
+  int high = std::min(numLeaves, pos + learnedMaxError + 2);
+  auto begin = segment.lowerBoundKeys.begin();
+  auto found = std::upper_bound(begin + low, begin + high, key);
+
+  // Should the key land on the edge of the window, search the whole segment instead.
+  if ((found == begin + low && low > 0) || (found == begin + high && high < numLeaves))
+  {
+    found = std::upper_bound(begin, segment.lowerBoundKeys.end(), key);
+  }
+
+  return segment.leaves[std::max(0, (int)(found - begin) - 1)];
+}
+
+std::vector<Record> BPlusTree::learnedSearch(float lowerBoundKey, float upperBoundKey)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  if (learnedIndex == false)
+  {
+    throw std::logic_error("Learned index is off!");
+  }
+
+  // Go straight to the first leaf (if any).
+  Node *leaf = nullptr;
+  if (rootAddress != nullptr)
+  {
+    if (segments.empty())
+    {
+      buildLearnedIndex();
+    }
+
+    Address leafAddress{findLeafLearned(lowerBoundKey), 0};
+    leaf = (Node *)index->loadFromDisk(leafAddress, sizeof(Node));
+  }
+
+  // Then walk the leaf level as usual, with the buffered inserts and deletes that haven't reached it merged in.
+  std::vector<Record> results;
+  scanMerged(leaf, lowerBoundKey, upperBoundKey, [&](float, Address LLHeadAddress, const PendingRecords *changes)
+  {
+    forEachRecord(LLHeadAddress, changes, [&](Address recordAddress)
+    {
+      results.push_back(loadRecord(recordAddress));
+    });
+  });
+
+  return results;
+}
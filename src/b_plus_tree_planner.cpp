@@ -0,0 +1,186 @@
+#include "b_plus_tree.h"
+#include "record_codec.h"
+#include "types.h"
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Query planner: the number of records under each key gives the records a range holds, and from that the blocks
+// each plan would access. An index scan loads one data block per record, which is fine for a handful of records.
+// A bitmap scan loads each data block holding a match once. A sequential scan reads every data block, which wins once
+// a range matches most of them. Keys are assumed to be the records' averageRating, as everywhere else.
+
+QueryPlan BPlusTree::planSearch(float lowerBoundKey, float upperBoundKey)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+  return estimatePlan(lowerBoundKey, upperBoundKey);
+}
+
+QueryPlan BPlusTree::estimatePlan(float lowerBoundKey, float upperBoundKey)
+{
+  // Add up the records in range, and the linked list nodes they take.
+  int numRecords = 0;
+  int numKeys = 0;
+  int LLBlocks = 0;
+  if (lowerBoundKey <= upperBoundKey)
+  {
+    for (auto count = keyCounts.lower_bound(lowerBoundKey); count != keyCounts.end() && count->first <= upperBoundKey; count++)
+    {
+      numRecords += count->second;
+      numKeys++;
+      LLBlocks += (count->second + maxLLKeys - 1) / maxLLKeys;
+    }
+  }
+
+  // Go down to the first leaf, then through the leaves in range. Nodes are about ln 2 full on average.
+  int indexBlocks = 0;
+  if (rootAddress != nullptr && numRecords > 0)
+  {
+    Address rootDiskAddress{rootAddress, 0};
+    Node *cursor = loadNode(rootDiskAddress);
+    while (cursor->isLeaf == false)
+    {
+      cursor = loadNode(cursor->pointers[0]);
+      indexBlocks++;
+    }
+
+    indexBlocks += (int)std::ceil(numKeys / (maxKeys * std::log(2.0))) + LLBlocks;
+  }
+
+  // Records spread over the data blocks at random touch this many distinct blocks (Cardenas' formula).
+  double dataBlocks = disk->getAllocated();
+  double bitmapDataBlocks = dataBlocks > 0 ? dataBlocks * (1 - std::pow(1 - 1 / dataBlocks, numRecords)) : 0;
+
+  QueryPlan plan;
+  plan.estimatedRecords = numRecords;
+  plan.indexScanBlocks = indexBlocks + numRecords;
+  plan.bitmapScanBlocks = indexBlocks + (int)std::ceil(bitmapDataBlocks);
+
+  // A sequential scan would return every record in the data pool, so it needs the pool to hold indexed records only.
+  // Records of buffered deletes are still in the pool too.
+  bool pendingChanges = !buffers.empty() || !delta.empty();
+  plan.sequentialScanBlocks = (orphanedRecords || numTombstones > 0 || pendingChanges) ? -1 : disk->getAllocated();
+
+  // Ties go to the index scan, which needs no sorting.
+  plan.plan = INDEX_SCAN;
+  int cheapest = plan.indexScanBlocks;
+  if (plan.bitmapScanBlocks < cheapest)
+  {
+    plan.plan = BITMAP_SCAN;
+    cheapest = plan.bitmapScanBlocks;
+  }
+  if (plan.sequentialScanBlocks >= 0 && plan.sequentialScanBlocks < cheapest)
+  {
+    plan.plan = SEQUENTIAL_SCAN;
+  }
+
+  return plan;
+}
+
+std::vector<Record> BPlusTree::plannedSearch(float lowerBoundKey, float upperBoundKey)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  QueryPlan plan = estimatePlan(lowerBoundKey, upperBoundKey);
+  int blocksBefore = index->getBlocksAccessed() + disk->getBlocksAccessed();
+
+  std::vector<Record> results;
+
+  if (plan.plan == INDEX_SCAN)
+  {
+    // Load each record through its own pointer, already in key order.
+    scanMerged(lowerBoundKey, upperBoundKey, [&](float, Address LLHeadAddress, const PendingRecords *changes)
+    {
+      forEachRecord(LLHeadAddress, changes, [&](Address recordAddress)
+      {
+        results.push_back(loadRecord(recordAddress));
+      });
+    });
+  }
+  else if (plan.plan == BITMAP_SCAN)
+  {
+    // Collect the record pointers, and sort them by block so each block is loaded once.
+    std::vector<Address> recordAddresses;
+    scanMerged(lowerBoundKey, upperBoundKey, [&](float, Address LLHeadAddress, const PendingRecords *changes)
+    {
+      forEachRecord(LLHeadAddress, changes, [&](Address recordAddress)
+      {
+        recordAddresses.push_back(recordAddress);
+      });
+    });
+
+    std::sort(recordAddresses.begin(), recordAddresses.end(), [](const Address &a, const Address &b)
+    {
+      return a.blockAddress < b.blockAddress || (a.blockAddress == b.blockAddress && a.offset < b.offset);
+    });
+
+    void *block = nullptr;
+    void *blockAddress = nullptr;
+    for (Address recordAddress : recordAddresses)
+    {
+      if (recordAddress.blockAddress != blockAddress)
+      {
+        operator delete(block);
+        blockAddress = recordAddress.blockAddress;
+        Address blockStart{blockAddress, 0};
+        block = disk->loadFromDisk(blockStart, disk->getBlockSize());
+      }
+      if (disk->getCodec() != nullptr)
+      {
+        Record record;
+        disk->getCodec()->decode((unsigned char *)block + recordAddress.offset, record);
+        results.push_back(record);
+      }
+      else
+      {
+        results.push_back(*(Record *)((char *)block + recordAddress.offset));
+      }
+    }
+    operator delete(block);
+  }
+  else
+  {
+    // Read every data block, keeping the live records in range.
+    MemoryPool::RecordIterator records = disk->scanRecords(sizeof(Record), [&](const void *data)
+    {
+      const Record *record = (const Record *)data;
+      return record->averageRating >= lowerBoundKey && record->averageRating <= upperBoundKey;
+    });
+    while (records.next())
+    {
+      results.push_back(*(const Record *)records.getRecord());
+    }
+  }
+
+  // Bitmap and sequential scans read records in block order, so put them back in key order.
+  if (plan.plan != INDEX_SCAN)
+  {
+    std::stable_sort(results.begin(), results.end(), [](const Record &a, const Record &b)
+    {
+      return a.averageRating < b.averageRating;
+    });
+  }
+
+  int blocksAccessed = index->getBlocksAccessed() + disk->getBlocksAccessed() - blocksBefore;
+  const char *planNames[] = {"index scan", "bitmap scan", "sequential scan"};
+  int estimatedBlocks[] = {plan.indexScanBlocks, plan.bitmapScanBlocks, plan.sequentialScanBlocks};
+
+  std::cout << "Plan: " << planNames[plan.plan] << " (estimated blocks: index scan " << plan.indexScanBlocks
+            << ", bitmap scan " << plan.bitmapScanBlocks << ", sequential scan ";
+  if (plan.sequentialScanBlocks >= 0)
+  {
+    std::cout << plan.sequentialScanBlocks << ")" << endl;
+  }
+  else
+  {
+    std::cout << "not possible)" << endl;
+  }
+  std::cout << "Estimated records: " << plan.estimatedRecords << ", actual records: " << results.size() << endl;
+  std::cout << "Estimated blocks accessed: " << estimatedBlocks[plan.plan] << ", actual blocks accessed: " << blocksAccessed << endl;
+
+  return results;
+}
@@ -4,13 +4,100 @@
 #include <vector>
 #include <cstring>
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 
 int BPlusTree::remove(float key)
 {
+  std::unique_lock<std::mutex> lock = lockTree();
+  keyCounts.erase(key);
+
+  // With the delta tier on, record the delete there. It hides the key's records until the delta is merged.
+  if (deltaTier)
+  {
+    addToDelta(key, Address{nullptr, 0}, true);
+    return 0;
+  }
+
+  // In buffered mode, append the delete at the root and let flushes carry it down.
+  if (bufferedInserts)
+  {
+    bufferMessage(key, Address{nullptr, 0}, true);
+    return 0;
+  }
+
+  if (lazyDeletes == false)
+  {
+    return removeKey(key);
+  }
+
+  // Lazy delete: only mark the key as a tombstone.
+  if (rootAddress == nullptr)
+  {
+    throw std::logic_error("Tree is empty!");
+  }
+
+  if (markTombstone(key))
+  {
+    std::cout << "Marked " << key << " as deleted" << endl;
+  }
+  else
+  {
+    std::cout << "Can't find specified key " << key << " to delete!" << endl;
+  }
+  return 0;
+}
+
+// Find the key in its leaf and mark it as a tombstone. Returns whether the key was found.
+bool BPlusTree::markTombstone(float key)
+{
+  void *cursorDiskAddress = rootAddress;
+  Address rootDiskAddress{rootAddress, 0};
+  Node *cursor = (Node *)index->loadFromDisk(rootDiskAddress, sizeof(Node));
+
+  while (cursor->isLeaf == false)
+  {
+    Address childAddress = cursor->pointers[findChildIndex(cursor, key)];
+    cursorDiskAddress = childAddress.blockAddress;
+    cursor = (Node *)index->loadFromDisk(childAddress, sizeof(Node));
+  }
+
+  for (int pos = 0; pos < cursor->numKeys; pos++)
+  {
+    if (cursor->keys[pos] == key && !isTombstone(cursor->pointers[pos]))
+    {
+      // Mark the key and save the leaf. Its linked list stays in place until compaction.
+      markTombstone(cursor, pos);
+      Address cursorAddress{cursorDiskAddress, 0};
+      index->saveToDisk(cursor, sizeof(Node), cursorAddress);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Mark a key of a leaf in main memory as a tombstone. The caller saves the leaf.
+void BPlusTree::markTombstone(Node *leaf, int pos)
+{
+  leaf->pointers[pos].offset = TOMBSTONE_OFFSET;
+
+  numTombstones++;
+  tombstoneKeys.push_back(leaf->keys[pos]);
+  maxVotes.erase(leaf->keys[pos]);
+  directoryForget(leaf->keys[pos]);
+
+  compactionWanted.notify_one();
+}
+
+int BPlusTree::removeKey(float key)
+{
+  // Rebalancing may delete nodes holding buffered messages, so deliver them all first.
+  flushAllBuffers();
+
   // set numNodes before deletion
-  numNodes = index->getAllocated();
+  numNodes = countNodes();
 
   // Tree is empty.
   if (rootAddress == nullptr)
@@ -19,9 +106,9 @@ int BPlusTree::remove(float key)
   }
   else
   {
-    // Load in root from the disk.
+    // Load in root (from the pinned levels, if any).
     Address rootDiskAddress{rootAddress, 0};
-    root = (Node *)index->loadFromDisk(rootDiskAddress, nodeSize);
+    root = loadNode(rootDiskAddress);
 
     Node *cursor = root;
     Node *parent;                          // Keep track of the parent as we go deeper into the tree in case we need to update it.
@@ -47,7 +134,7 @@ int BPlusTree::remove(float key)
         if (key < cursor->keys[i])
         {
           // Load node in from disk to main memory.
-          Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i], nodeSize);
+          Node *mainMemoryNode = loadNode(cursor->pointers[i]);
 
           // Update cursorDiskAddress to maintain address in disk if we need to update nodes.
           cursorDiskAddress = cursor->pointers[i].blockAddress;
@@ -63,7 +150,7 @@ int BPlusTree::remove(float key)
           rightSibling = i + 2;
 
           // Load node in from disk to main memory.
-          Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i + 1], nodeSize);
+          Node *mainMemoryNode = loadNode(cursor->pointers[i + 1]);
 
           // Update cursorDiskAddress to maintain address in disk if we need to update nodes.
           cursorDiskAddress = cursor->pointers[i + 1].blockAddress;
@@ -95,20 +182,33 @@ int BPlusTree::remove(float key)
       std::cout << "Can't find specified key " << key << " to delete!" << endl;
       
       // update numNodes and numNodesDeleted after deletion
-      int numNodesDeleted = numNodes - index->getAllocated();
-      numNodes = index->getAllocated();
+      int numNodesDeleted = numNodes - countNodes();
+      numNodes = countNodes();
       return numNodesDeleted;
     }
 
+    // If the key was marked as a tombstone, unmark it since we are removing it for real now.
+    if (isTombstone(cursor->pointers[pos]))
+    {
+      cursor->pointers[pos].offset = 0;
+      numTombstones--;
+    }
+
     // pos is the position where we found the key.
     // We must delete the entire linked-list before we delete the key, otherwise we lose access to the linked list head.
     // Delete the linked list stored under the key.
     removeLL(cursor->pointers[pos]);
+    freeRemovedRecords();
+    maxVotes.erase(key);
+    directoryForget(key);
 
     // Now, we can delete the key. Move all keys/pointers forward to replace its values.
-    for (int i = pos; i < cursor->numKeys; i++)
+    for (int i = pos; i < cursor->numKeys - 1; i++)
     {
       cursor->keys[i] = cursor->keys[i + 1];
+    }
+    for (int i = pos; i < cursor->numKeys; i++)
+    {
       cursor->pointers[i] = cursor->pointers[i + 1];
     }
 
@@ -139,22 +239,22 @@ int BPlusTree::remove(float key)
 
         // Deallocate block used to store root node.
         Address rootDiskAddress{rootAddress, 0};
-        index->deallocate(rootDiskAddress, nodeSize);
+        freeNode(rootDiskAddress, cursor, nodeSize);
 
         // Reset root pointers in the B+ Tree.
         root = nullptr;
         rootAddress = nullptr;
-        
+        learnedLeafRemoved(cursorDiskAddress);
       }
       std::cout << "Successfully deleted " << key << endl;
       
       // update numNodes and numNodesDeleted after deletion
-      int numNodesDeleted = numNodes - index->getAllocated();
-      numNodes = index->getAllocated();
+      int numNodesDeleted = numNodes - countNodes();
+      numNodes = countNodes();
 
       // Save to disk.
       Address cursorAddress = {cursorDiskAddress, 0};
-      index->saveToDisk(cursor, nodeSize, cursorAddress);
+      index->saveToDisk(cursor, sizeof(Node), cursorAddress);
       
       return numNodesDeleted;
     }
@@ -166,12 +266,12 @@ int BPlusTree::remove(float key)
       std::cout << "Successfully deleted " << key << endl;
 
       // update numNodes and numNodesDeleted after deletion
-      int numNodesDeleted = numNodes - index->getAllocated();
-      numNodes = index->getAllocated();
+      int numNodesDeleted = numNodes - countNodes();
+      numNodes = countNodes();
 
       // Save to disk.
       Address cursorAddress = {cursorDiskAddress, 0};
-      index->saveToDisk(cursor, nodeSize, cursorAddress);
+      index->saveToDisk(cursor, sizeof(Node), cursorAddress);
 
       return numNodesDeleted;
     }
@@ -182,7 +282,7 @@ int BPlusTree::remove(float key)
     if (leftSibling >= 0)
     {
       // Load in left sibling from disk.
-      Node *leftNode = (Node *)index->loadFromDisk(parent->pointers[leftSibling], nodeSize);
+      Node *leftNode = (Node *)index->loadFromDisk(parent->pointers[leftSibling], sizeof(Node));
 
       // Check if we can steal (ahem, borrow) a key without underflow.
       if (leftNode->numKeys >= (maxKeys + 1) / 2 + 1)
@@ -206,25 +306,27 @@ int BPlusTree::remove(float key)
         leftNode->numKeys--;
 
         // Update left sibling (shift pointers left)
-        leftNode->pointers[cursor->numKeys] = leftNode->pointers[cursor->numKeys + 1];
+        leftNode->pointers[leftNode->numKeys] = leftNode->pointers[leftNode->numKeys + 1];
 
         // Update parent node's key
         parent->keys[leftSibling] = cursor->keys[0];
+        unpinLevels(parentDiskAddress);
+        learnedLeafMoved(cursorDiskAddress, cursor->keys[0]);
 
         // Save parent to disk.
         Address parentAddress{parentDiskAddress, 0};
-        index->saveToDisk(parent, nodeSize, parentAddress);
+        index->saveToDisk(parent, sizeof(Node), parentAddress);
 
         // Save left sibling to disk.
-        index->saveToDisk(leftNode, nodeSize, parent->pointers[leftSibling]);
+        index->saveToDisk(leftNode, sizeof(Node), parent->pointers[leftSibling]);
 
         // Save current node to disk.
         Address cursorAddress = {cursorDiskAddress, 0};
-        index->saveToDisk(cursor, nodeSize, cursorAddress);
+        index->saveToDisk(cursor, sizeof(Node), cursorAddress);
     
         // update numNodes and numNodesDeleted after deletion
-        int numNodesDeleted = numNodes - index->getAllocated();
-        numNodes = index->getAllocated();
+        int numNodesDeleted = numNodes - countNodes();
+        numNodes = countNodes();
         return numNodesDeleted;
       }
     }
@@ -234,7 +336,7 @@ int BPlusTree::remove(float key)
     if (rightSibling <= parent->numKeys)
     {
       // If we do, load in right sibling from disk.
-      Node *rightNode = (Node *)index->loadFromDisk(parent->pointers[rightSibling], nodeSize);
+      Node *rightNode = (Node *)index->loadFromDisk(parent->pointers[rightSibling], sizeof(Node));
 
       // Check if we can steal (ahem, borrow) a key without underflow.
       if (rightNode->numKeys >= (maxKeys + 1) / 2 + 1)
@@ -259,25 +361,27 @@ int BPlusTree::remove(float key)
         }
 
         // Move right sibling's last pointer left by one too.
-        rightNode->pointers[cursor->numKeys] = rightNode->pointers[cursor->numKeys + 1];
+        rightNode->pointers[rightNode->numKeys] = rightNode->pointers[rightNode->numKeys + 1];
 
         // Update parent node's key to be new lower bound of right sibling.
         parent->keys[rightSibling - 1] = rightNode->keys[0];
+        unpinLevels(parentDiskAddress);
+        learnedLeafMoved(parent->pointers[rightSibling].blockAddress, rightNode->keys[0]);
 
         // Save parent to disk.
         Address parentAddress{parentDiskAddress, 0};
-        index->saveToDisk(parent, nodeSize, parentAddress);
+        index->saveToDisk(parent, sizeof(Node), parentAddress);
 
         // Save right sibling to disk.
-        index->saveToDisk(rightNode, nodeSize, parent->pointers[rightSibling]);
+        index->saveToDisk(rightNode, sizeof(Node), parent->pointers[rightSibling]);
 
         // Save current node to disk.
         Address cursorAddress = {cursorDiskAddress, 0};
-        index->saveToDisk(cursor, nodeSize, cursorAddress);
+        index->saveToDisk(cursor, sizeof(Node), cursorAddress);
 
         // update numNodes and numNodesDeleted after deletion
-        int numNodesDeleted = numNodes - index->getAllocated();
-        numNodes = index->getAllocated();
+        int numNodesDeleted = numNodes - countNodes();
+        numNodes = countNodes();
         return numNodesDeleted;        
       }
     }
@@ -289,7 +393,7 @@ int BPlusTree::remove(float key)
     if (leftSibling >= 0)
     {
       // Load in left sibling from disk.
-      Node *leftNode = (Node *)index->loadFromDisk(parent->pointers[leftSibling], nodeSize);
+      Node *leftNode = (Node *)index->loadFromDisk(parent->pointers[leftSibling], sizeof(Node));
 
       // Transfer all keys and pointers from current node to left node.
       // Note: Merging will always suceed due to ⌊(n)/2⌋ (left) + ⌊(n-1)/2⌋ (current).
@@ -304,20 +408,21 @@ int BPlusTree::remove(float key)
       leftNode->pointers[leftNode->numKeys] = cursor->pointers[cursor->numKeys];
 
       // Save left node to disk.
-      index->saveToDisk(leftNode, nodeSize, parent->pointers[leftSibling]);
+      index->saveToDisk(leftNode, sizeof(Node), parent->pointers[leftSibling]);
 
       // We need to update the parent in order to fully remove the current node.
       removeInternal(parent->keys[leftSibling], (Node *)parentDiskAddress, (Node *)cursorDiskAddress);
+      learnedLeafRemoved(cursorDiskAddress);
 
       // Now that we have updated parent, we can just delete the current node from disk.
       Address cursorAddress{cursorDiskAddress, 0};
-      index->deallocate(cursorAddress, nodeSize);
+      freeNode(cursorAddress, cursor, nodeSize);
     }
     // If left sibling doesn't exist, try to merge with right sibling.
     else if (rightSibling <= parent->numKeys)
     {
       // Load in right sibling from disk.
-      Node *rightNode = (Node *)index->loadFromDisk(parent->pointers[rightSibling], nodeSize);
+      Node *rightNode = (Node *)index->loadFromDisk(parent->pointers[rightSibling], sizeof(Node));
 
       // Note we are moving right node's stuff into ours.
       // Transfer all keys and pointers from right node into current.
@@ -334,21 +439,22 @@ int BPlusTree::remove(float key)
 
       // Save current node to disk.
       Address cursorAddress{cursorDiskAddress, 0};
-      index->saveToDisk(cursor, nodeSize, cursorAddress);
+      index->saveToDisk(cursor, sizeof(Node), cursorAddress);
 
       // We need to update the parent in order to fully remove the right node.
       void *rightNodeAddress = parent->pointers[rightSibling].blockAddress;
       removeInternal(parent->keys[rightSibling - 1], (Node *)parentDiskAddress, (Node *)rightNodeAddress);
+      learnedLeafRemoved(rightNodeAddress);
 
       // Now that we have updated parent, we can just delete the right node from disk.
       Address rightNodeDiskAddress{rightNodeAddress, 0};
-      index->deallocate(rightNodeDiskAddress, nodeSize);
+      freeNode(rightNodeDiskAddress, rightNode, nodeSize);
     }
   }
 
   // update numNodes and numNodesDeleted after deletion
-  int numNodesDeleted = numNodes - index->getAllocated();
-  numNodes = index->getAllocated();
+  int numNodesDeleted = numNodes - countNodes();
+  numNodes = countNodes();
   return numNodesDeleted;
 }
 
@@ -356,9 +462,12 @@ int BPlusTree::remove(float key)
 // Takes in the parent disk address, the child address to delete, and removes the child.
 void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDiskAddress)
 {
+  // The parent is about to change (and may borrow or merge), so it can't stay pinned.
+  unpinLevels(cursorDiskAddress);
+
   // Load in cursor (parent) and child from disk to get latest copy.
   Address cursorAddress{cursorDiskAddress, 0};
-  Node *cursor = (Node *)index->loadFromDisk(cursorAddress, nodeSize);
+  Node *cursor = (Node *)index->loadFromDisk(cursorAddress, sizeof(Node));
 
   // Check if cursor is root via disk address.
   if (cursorDiskAddress == rootAddress)
@@ -378,16 +487,16 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
       // If the larger pointer points to child, make it the new root.
       if (cursor->pointers[1].blockAddress == childDiskAddress)
       {
-        // Delete the child completely
-        index->deallocate(childAddress, nodeSize);
-
         // Set new root to be the parent's left pointer
         // Load left pointer into main memory and update root.
-        root = (Node *)index->loadFromDisk(cursor->pointers[0], nodeSize);
+        root = (Node *)index->loadFromDisk(cursor->pointers[0], sizeof(Node));
         rootAddress = (Node *)cursor->pointers[0].blockAddress;
 
+        // Delete the child completely. It sits on the same level as the new root, so it's a leaf if the root is.
+        index->deallocate(childAddress, root->isLeaf ? nodeSize : internalNodeSize);
+
         // We can delete the old root (parent).
-        index->deallocate(cursorAddress, nodeSize);
+        freeNode(cursorAddress, cursor, internalNodeSize);
 
         // Nothing to save to disk. All updates happened in main memory.
         std::cout << "Root node changed." << endl;
@@ -396,16 +505,16 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
       // Else if left pointer in root (parent) contains the child, delete from there.
       else if (cursor->pointers[0].blockAddress == childDiskAddress)
       {
-        // Delete the child completely
-        index->deallocate(childAddress, nodeSize);
-
         // Set new root to be the parent's right pointer
         // Load right pointer into main memory and update root.
-        root = (Node *)index->loadFromDisk(cursor->pointers[1], nodeSize);
+        root = (Node *)index->loadFromDisk(cursor->pointers[1], sizeof(Node));
         rootAddress = (Node *)cursor->pointers[1].blockAddress;
 
+        // Delete the child completely. It sits on the same level as the new root, so it's a leaf if the root is.
+        index->deallocate(childAddress, root->isLeaf ? nodeSize : internalNodeSize);
+
         // We can delete the old root (parent).
-        index->deallocate(cursorAddress, nodeSize);
+        freeNode(cursorAddress, cursor, internalNodeSize);
 
         // Nothing to save to disk. All updates happened in main memory.
         std::cout << "Root node changed." << endl;
@@ -428,7 +537,7 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
   }
 
   // Delete the key by shifting all keys forward
-  for (int i = pos; i < cursor->numKeys; i++)
+  for (int i = pos; i < cursor->numKeys - 1; i++)
   {
     cursor->keys[i] = cursor->keys[i + 1];
   }
@@ -444,7 +553,7 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
   }
 
   // Now move all pointers from that point on forward by one to delete it.
-  for (int i = pos; i < cursor->numKeys + 1; i++)
+  for (int i = pos; i < cursor->numKeys; i++)
   {
     cursor->pointers[i] = cursor->pointers[i + 1];
   }
@@ -452,9 +561,15 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
   // Update numKeys
   cursor->numKeys--;
 
-  // Check if there's underflow in parent
+  // Save the updated parent to disk, so it no longer points at the child.
+  index->saveToDisk(cursor, sizeof(Node), cursorAddress);
+
+  // Check if there's underflow in parent. An internal node keeps at least one key (two children), even when it
+  // is so small that half full would be none.
+  int minKeys = std::max(1, (maxInternalKeys + 1) / 2 - 1);
+
   // No underflow, life is good.
-  if (cursor->numKeys >= (maxKeys + 1) / 2 - 1)
+  if (cursor->numKeys >= minKeys)
   {
     return;
   }
@@ -474,7 +589,8 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
 
   // Load parent into main memory.
   Address parentAddress{parentDiskAddress, 0};
-  Node *parent = (Node *)index->loadFromDisk(parentAddress, nodeSize);
+  Node *parent = (Node *)index->loadFromDisk(parentAddress, sizeof(Node));
+  unpinLevels(parentDiskAddress);
 
   // Find left and right sibling of cursor, iterate through pointers.
   for (pos = 0; pos < parent->numKeys + 1; pos++)
@@ -492,11 +608,11 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
   if (leftSibling >= 0)
   {
     // Load in left sibling from disk.
-    Node *leftNode = (Node *)index->loadFromDisk(parent->pointers[leftSibling], nodeSize);
+    Node *leftNode = (Node *)index->loadFromDisk(parent->pointers[leftSibling], sizeof(Node));
 
     // Check if we can steal (ahem, borrow) a key without underflow.
     // Non leaf nodes require a minimum of ⌊n/2⌋
-    if (leftNode->numKeys >= (maxKeys + 1) / 2)
+    if (leftNode->numKeys > minKeys)
     {
       // We will insert this borrowed key into the leftmost of current node (smaller).
       // Shift all remaining keys and pointers back by one.
@@ -523,19 +639,20 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
       cursor->numKeys++;
       leftNode->numKeys--;
 
-      // Update left sibling (shift pointers left)
-      leftNode->pointers[cursor->numKeys] = leftNode->pointers[cursor->numKeys + 1];
+      // Clear the pointer moved out of the left sibling.
+      Address nullAddress{nullptr, 0};
+      leftNode->pointers[leftNode->numKeys + 1] = nullAddress;
 
       // Save parent to disk.
       Address parentAddress{parentDiskAddress, 0};
-      index->saveToDisk(parent, nodeSize, parentAddress);
+      index->saveToDisk(parent, sizeof(Node), parentAddress);
 
       // Save left sibling to disk.
-      index->saveToDisk(leftNode, nodeSize, parent->pointers[leftSibling]);
+      index->saveToDisk(leftNode, sizeof(Node), parent->pointers[leftSibling]);
 
       // Save current node to disk.
       Address cursorAddress = {cursorDiskAddress, 0};
-      index->saveToDisk(cursor, nodeSize, cursorAddress);
+      index->saveToDisk(cursor, sizeof(Node), cursorAddress);
       return;
     }
   }
@@ -545,10 +662,10 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
   if (rightSibling <= parent->numKeys)
   {
     // If we do, load in right sibling from disk.
-    Node *rightNode = (Node *)index->loadFromDisk(parent->pointers[rightSibling], nodeSize);
+    Node *rightNode = (Node *)index->loadFromDisk(parent->pointers[rightSibling], sizeof(Node));
 
     // Check if we can steal (ahem, borrow) a key without underflow.
-    if (rightNode->numKeys >= (maxKeys + 1) / 2)
+    if (rightNode->numKeys > minKeys)
     {
       // No need to shift remaining pointers and keys since we are inserting on the rightmost.
       // Transfer borrowed key and pointer (leftmost of right node) over to rightmost of current node.
@@ -576,14 +693,14 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
 
       // Save parent to disk.
       Address parentAddress{parentDiskAddress, 0};
-      index->saveToDisk(parent, nodeSize, parentAddress);
+      index->saveToDisk(parent, sizeof(Node), parentAddress);
 
       // Save right sibling to disk.
-      index->saveToDisk(rightNode, nodeSize, parent->pointers[rightSibling]);
+      index->saveToDisk(rightNode, sizeof(Node), parent->pointers[rightSibling]);
 
       // Save current node to disk.
       Address cursorAddress = {cursorDiskAddress, 0};
-      index->saveToDisk(cursor, nodeSize, cursorAddress);
+      index->saveToDisk(cursor, sizeof(Node), cursorAddress);
       return;
     }
   }
@@ -595,21 +712,21 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
   if (leftSibling >= 0)
   {
     // Load in left sibling from disk.
-    Node *leftNode = (Node *)index->loadFromDisk(parent->pointers[leftSibling], nodeSize);
+    Node *leftNode = (Node *)index->loadFromDisk(parent->pointers[leftSibling], sizeof(Node));
 
     // Make left node's upper bound to be cursor's lower bound.
     leftNode->keys[leftNode->numKeys] = parent->keys[leftSibling];
 
     // Transfer all keys from current node to left node.
     // Note: Merging will always suceed due to ⌊(n)/2⌋ (left) + ⌊(n-1)/2⌋ (current).
-    for (int i = leftNode->numKeys + 1, j = 0; j < cursor->numKeys; j++)
+    for (int i = leftNode->numKeys + 1, j = 0; j < cursor->numKeys; i++, j++)
     {
       leftNode->keys[i] = cursor->keys[j];
     }
 
     // Transfer all pointers too.
     Address nullAddress{nullptr, 0};
-    for (int i = leftNode->numKeys + 1, j = 0; j < cursor->numKeys + 1; j++)
+    for (int i = leftNode->numKeys + 1, j = 0; j < cursor->numKeys + 1; i++, j++)
     {
       leftNode->pointers[i] = cursor->pointers[j];
       cursor->pointers[j] = nullAddress;
@@ -620,7 +737,7 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
     cursor->numKeys = 0;
 
     // Save left node to disk.
-    index->saveToDisk(leftNode, nodeSize, parent->pointers[leftSibling]);
+    index->saveToDisk(leftNode, sizeof(Node), parent->pointers[leftSibling]);
 
     // Delete current node (cursor)
     // We need to update the parent in order to fully remove the current node.
@@ -630,7 +747,7 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
   else if (rightSibling <= parent->numKeys)
   {
     // Load in right sibling from disk.
-    Node *rightNode = (Node *)index->loadFromDisk(parent->pointers[rightSibling], nodeSize);
+    Node *rightNode = (Node *)index->loadFromDisk(parent->pointers[rightSibling], sizeof(Node));
 
     // Set upper bound of cursor to be lower bound of right sibling.
     cursor->keys[cursor->numKeys] = parent->keys[rightSibling - 1];
@@ -638,14 +755,14 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
     // Note we are moving right node's stuff into ours.
     // Transfer all keys from right node into current.
     // Note: Merging will always suceed due to ⌊(n)/2⌋ (left) + ⌊(n-1)/2⌋ (current).
-    for (int i = cursor->numKeys + 1, j = 0; j < rightNode->numKeys; j++)
+    for (int i = cursor->numKeys + 1, j = 0; j < rightNode->numKeys; i++, j++)
     {
       cursor->keys[i] = rightNode->keys[j];
     }
 
     // Transfer all pointers from right node into current.
     Address nullAddress = {nullptr, 0};
-    for (int i = cursor->numKeys + 1, j = 0; j < rightNode->numKeys + 1; j++)
+    for (int i = cursor->numKeys + 1, j = 0; j < rightNode->numKeys + 1; i++, j++)
     {
       cursor->pointers[i] = rightNode->pointers[j];
       rightNode->pointers[j] = nullAddress;
@@ -657,7 +774,7 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
 
     // Save current node to disk.
     Address cursorAddress{cursorDiskAddress, 0};
-    index->saveToDisk(cursor, nodeSize, cursorAddress);
+    index->saveToDisk(cursor, sizeof(Node), cursorAddress);
 
     // Delete right node.
     // We need to update the parent in order to fully remove the right node.
@@ -667,17 +784,537 @@ void BPlusTree::removeInternal(float key, Node *cursorDiskAddress, Node *childDi
 }
 
 
+// Remove every key in [lowerBoundKey, upperBoundKey]. Instead of one descent and one rebalance per key, we go down
+// the two boundary paths of the range once: each internal node on them drops the children wholly inside the range
+// in one pass, and the leaves at either end lose the keys in range. Only then are the leaves linked past the gap,
+// and the nodes left underfull on the boundary paths rebalanced, a level at a time from the leaves up.
+int BPlusTree::removeRange(float lowerBoundKey, float upperBoundKey)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+  applyPending();
+  if (lowerBoundKey <= upperBoundKey)
+  {
+    keyCounts.erase(keyCounts.lower_bound(lowerBoundKey), keyCounts.upper_bound(upperBoundKey));
+  }
+
+  // set numNodes before deletion
+  numNodes = countNodes();
+
+  // Tree is empty.
+  if (rootAddress == nullptr)
+  {
+    throw std::logic_error("Tree is empty!");
+  }
+
+  RangeRemoval removal;
+  removal.lowerBoundKey = lowerBoundKey;
+  removal.upperBoundKey = upperBoundKey;
+  removal.leftSubtree = Address{nullptr, 0};
+  removal.firstLeaf = nullptr;
+  removal.firstLeafKept = false;
+  removal.lastLeaf = nullptr;
+  removal.lastLeafKept = false;
+  removal.lastLeafNext = Address{nullptr, 0};
+
+  // Strip the range out of the tree. Nodes on the boundary paths change, so the pinned levels can't stay.
+  unpinLevels();
+  Address rootDiskAddress{rootAddress, 0};
+  bool rootFreed = stripRange(rootDiskAddress, 0, removal);
+
+  // Free the linked lists of all removed keys.
+  for (Address LLHead : removal.LLHeads)
+  {
+    removeLL(LLHead);
+  }
+  freeRemovedRecords();
+
+  if (rootFreed)
+  {
+    // Every key was in range, so the whole index is gone.
+    std::cout << "Congratulations! You deleted the entire index!" << endl;
+    root = nullptr;
+    rootAddress = nullptr;
+  }
+  else
+  {
+    // Link the last leaf kept before the range to the first one kept after it.
+    void *previousLeafDiskAddress = nullptr;
+    if (removal.firstLeafKept)
+    {
+      previousLeafDiskAddress = removal.firstLeaf;
+    }
+    else if (removal.leftSubtree.blockAddress != nullptr)
+    {
+      // The leaf before the range is the rightmost leaf of the subtree just left of it.
+      Address cursorAddress = removal.leftSubtree;
+      Node *cursor = (Node *)index->loadFromDisk(cursorAddress, sizeof(Node));
+      while (cursor->isLeaf == false)
+      {
+        cursorAddress = cursor->pointers[cursor->numKeys];
+        cursor = (Node *)index->loadFromDisk(cursorAddress, sizeof(Node));
+      }
+      previousLeafDiskAddress = cursorAddress.blockAddress;
+    }
+
+    Address nextLeafAddress = removal.lastLeafKept ? Address{removal.lastLeaf, 0} : removal.lastLeafNext;
+    if (previousLeafDiskAddress != nullptr && previousLeafDiskAddress != nextLeafAddress.blockAddress)
+    {
+      Address previousLeafAddress{previousLeafDiskAddress, 0};
+      Node *previousLeaf = (Node *)index->loadFromDisk(previousLeafAddress, sizeof(Node));
+      if (previousLeaf->pointers[previousLeaf->numKeys].blockAddress != nextLeafAddress.blockAddress)
+      {
+        previousLeaf->pointers[previousLeaf->numKeys] = nextLeafAddress;
+        index->saveToDisk(previousLeaf, sizeof(Node), previousLeafAddress);
+      }
+    }
+
+    // Rebalance the boundary paths from the level above the leaves up to the root. Each node kept on them fixes
+    // the boundary children it still has, and a child merged away by its neighbour is simply no longer found.
+    for (int level = (int)removal.keptNodes.size() - 2; level >= 0; level--)
+    {
+      for (void *parentDiskAddress : removal.keptNodes[level])
+      {
+        Address parentAddress{parentDiskAddress, 0};
+        Node *parent = (Node *)index->loadFromDisk(parentAddress, sizeof(Node));
+        bool changed = false;
+
+        for (void *childDiskAddress : removal.keptNodes[level + 1])
+        {
+          int pos = findChildPosition(parent, childDiskAddress);
+          if (pos >= 0)
+          {
+            changed = rebalanceChild(parent, pos) || changed;
+          }
+        }
+
+        if (changed)
+        {
+          index->saveToDisk(parent, sizeof(Node), parentAddress);
+        }
+      }
+    }
+
+    // A root left with a single child hands the root over to it.
+    Address newRootAddress{rootAddress, 0};
+    root = (Node *)index->loadFromDisk(newRootAddress, sizeof(Node));
+    while (root->isLeaf == false && root->numKeys == 0)
+    {
+      Address oldRootAddress = newRootAddress;
+      Node *oldRoot = root;
+      newRootAddress = root->pointers[0];
+      rootAddress = newRootAddress.blockAddress;
+      root = (Node *)index->loadFromDisk(newRootAddress, sizeof(Node));
+      freeNode(oldRootAddress, oldRoot, internalNodeSize);
+      std::cout << "Root node changed." << endl;
+    }
+  }
+
+  // Detached and merged leaves change the leaf level, so rebuild the learned directory.
+  if (learnedIndex)
+  {
+    buildLearnedIndex();
+  }
+
+  std::cout << "Successfully deleted " << lowerBoundKey << " to " << upperBoundKey << endl;
+
+  // update numNodes and numNodesDeleted after deletion
+  int numNodesDeleted = numNodes - countNodes();
+  numNodes = countNodes();
+  return numNodesDeleted;
+}
+
+bool BPlusTree::stripRange(Address nodeAddress, int level, RangeRemoval &removal)
+{
+  Node *node = (Node *)index->loadFromDisk(nodeAddress, sizeof(Node));
+  Address nullAddress{nullptr, 0};
+
+  if (node->isLeaf)
+  {
+    Address next = node->pointers[node->numKeys];
+
+    // Keep the keys (and pointers) that are outside the range, moving them forward over the removed ones.
+    int numKept = 0;
+    for (int i = 0; i < node->numKeys; i++)
+    {
+      if (node->keys[i] >= removal.lowerBoundKey && node->keys[i] <= removal.upperBoundKey)
+      {
+        takeRangeKey(node, i, removal);
+      }
+      else
+      {
+        node->keys[numKept] = node->keys[i];
+        node->pointers[numKept] = node->pointers[i];
+        numKept++;
+      }
+    }
+
+    bool changed = numKept != node->numKeys;
+    node->numKeys = numKept;
+    node->pointers[node->numKeys] = next;
+    for (int i = node->numKeys + 1; i < maxKeys + 1; i++)
+    {
+      node->pointers[i] = nullAddress;
+    }
+
+    // Remember the leaves at either end of the range, to link the leaf level past it later.
+    if (removal.firstLeaf == nullptr)
+    {
+      removal.firstLeaf = nodeAddress.blockAddress;
+      removal.firstLeafKept = numKept > 0;
+    }
+    removal.lastLeaf = nodeAddress.blockAddress;
+    removal.lastLeafKept = numKept > 0;
+    removal.lastLeafNext = next;
+
+    if (numKept == 0)
+    {
+      freeNode(nodeAddress, node, nodeSize);
+      return true;
+    }
+
+    if (changed)
+    {
+      index->saveToDisk(node, sizeof(Node), nodeAddress);
+    }
+  }
+  else
+  {
+    // Children first to last hold keys in range. Those strictly between them lie wholly inside it.
+    int first = findChildIndex(node, removal.lowerBoundKey);
+    int last = findChildIndex(node, removal.upperBoundKey);
+    if (first > 0)
+    {
+      removal.leftSubtree = node->pointers[first - 1];
+    }
+
+    for (int i = first + 1; i < last; i++)
+    {
+      freeSubtree(node->pointers[i], removal);
+    }
+    bool firstFreed = stripRange(node->pointers[first], level + 1, removal);
+    bool lastFreed = last != first && stripRange(node->pointers[last], level + 1, removal);
+
+    // Drop the freed children in one pass. The key left of a kept child still bounds it from below.
+    int numKept = 0;
+    for (int i = 0; i <= node->numKeys; i++)
+    {
+      bool freed = (i > first && i < last) || (i == first && firstFreed) || (i == last && lastFreed);
+      if (freed)
+      {
+        continue;
+      }
+
+      if (numKept > 0)
+      {
+        node->keys[numKept - 1] = node->keys[i - 1];
+      }
+      node->pointers[numKept] = node->pointers[i];
+      numKept++;
+    }
+
+    if (numKept == 0)
+    {
+      freeNode(nodeAddress, node, internalNodeSize);
+      return true;
+    }
+
+    bool changed = numKept != node->numKeys + 1;
+    node->numKeys = numKept - 1;
+    for (int i = numKept; i < maxInternalKeys + 1; i++)
+    {
+      node->pointers[i] = nullAddress;
+    }
+
+    if (changed)
+    {
+      index->saveToDisk(node, sizeof(Node), nodeAddress);
+    }
+  }
+
+  // The node stays on a boundary path, where it may need rebalancing.
+  if ((int)removal.keptNodes.size() <= level)
+  {
+    removal.keptNodes.resize(level + 1);
+  }
+  removal.keptNodes[level].push_back(nodeAddress.blockAddress);
+  return false;
+}
+
+void BPlusTree::freeSubtree(Address nodeAddress, RangeRemoval &removal)
+{
+  Node *node = (Node *)index->loadFromDisk(nodeAddress, sizeof(Node));
+
+  if (node->isLeaf)
+  {
+    for (int i = 0; i < node->numKeys; i++)
+    {
+      takeRangeKey(node, i, removal);
+    }
+    freeNode(nodeAddress, node, nodeSize);
+    return;
+  }
+
+  for (int i = 0; i <= node->numKeys; i++)
+  {
+    freeSubtree(node->pointers[i], removal);
+  }
+  freeNode(nodeAddress, node, internalNodeSize);
+}
+
+void BPlusTree::takeRangeKey(Node *leaf, int pos, RangeRemoval &removal)
+{
+  if (isTombstone(leaf->pointers[pos]))
+  {
+    leaf->pointers[pos].offset = 0;
+    numTombstones--;
+  }
+
+  removal.LLHeads.push_back(leaf->pointers[pos]);
+  maxVotes.erase(leaf->keys[pos]);
+  directoryForget(leaf->keys[pos]);
+}
+
+int BPlusTree::findChildPosition(Node *parent, void *childDiskAddress)
+{
+  for (int pos = 0; pos <= parent->numKeys; pos++)
+  {
+    if (parent->pointers[pos].blockAddress == childDiskAddress)
+    {
+      return pos;
+    }
+  }
+  return -1;
+}
+
+bool BPlusTree::rebalanceChild(Node *parent, int pos)
+{
+  Address nullAddress{nullptr, 0};
+  bool changed = false;
+
+  // Stop once the child has enough keys, or has no sibling left to work with.
+  while (parent->numKeys > 0)
+  {
+    Node *child = (Node *)index->loadFromDisk(parent->pointers[pos], sizeof(Node));
+    // An internal node needs a key (two children) even when it is so small that half full would be none.
+    int minKeys = child->isLeaf ? (maxKeys + 1) / 2 : std::max(1, (maxInternalKeys + 1) / 2 - 1);
+    if (child->numKeys >= minKeys)
+    {
+      return changed;
+    }
+    changed = true;
+
+    // Pair the child with its left sibling if it has one, else its right one. k is the key between the two.
+    int k = pos > 0 ? pos - 1 : pos;
+    Address leftAddress = parent->pointers[k];
+    Address rightAddress = parent->pointers[k + 1];
+    Node *left = (Node *)index->loadFromDisk(leftAddress, sizeof(Node));
+    Node *right = (Node *)index->loadFromDisk(rightAddress, sizeof(Node));
+
+    // Internal nodes pull the key between them down from the parent. An internal node left with a single child
+    // couldn't rebalance that child, so once it has siblings again it's rebalanced too.
+    bool isLeaf = left->isLeaf;
+    int total = left->numKeys + right->numKeys + (isLeaf ? 0 : 1);
+    std::vector<void *> orphans;
+    if (!isLeaf && left->numKeys == 0)
+    {
+      orphans.push_back(left->pointers[0].blockAddress);
+    }
+    if (!isLeaf && right->numKeys == 0)
+    {
+      orphans.push_back(right->pointers[0].blockAddress);
+    }
+
+    if (total <= (isLeaf ? maxKeys : maxInternalKeys))
+    {
+      // Merge the right node into the left one. The left one keeps its block, so the leaf linking to it stays right.
+      if (isLeaf)
+      {
+        for (int i = 0; i < right->numKeys; i++)
+        {
+          left->keys[left->numKeys + i] = right->keys[i];
+          left->pointers[left->numKeys + i] = right->pointers[i];
+        }
+        left->numKeys = total;
+        left->pointers[left->numKeys] = right->pointers[right->numKeys];
+      }
+      else
+      {
+        left->keys[left->numKeys] = parent->keys[k];
+        for (int i = 0; i < right->numKeys; i++)
+        {
+          left->keys[left->numKeys + 1 + i] = right->keys[i];
+        }
+        for (int i = 0; i <= right->numKeys; i++)
+        {
+          left->pointers[left->numKeys + 1 + i] = right->pointers[i];
+        }
+        left->numKeys = total;
+
+        for (void *orphan : orphans)
+        {
+          int orphanPos = findChildPosition(left, orphan);
+          if (orphanPos >= 0)
+          {
+            rebalanceChild(left, orphanPos);
+          }
+        }
+      }
+      index->saveToDisk(left, sizeof(Node), leftAddress);
+
+      // Take the key and the pointer to the right node out of the parent.
+      for (int i = k; i < parent->numKeys - 1; i++)
+      {
+        parent->keys[i] = parent->keys[i + 1];
+      }
+      for (int i = k + 1; i < parent->numKeys; i++)
+      {
+        parent->pointers[i] = parent->pointers[i + 1];
+      }
+      parent->pointers[parent->numKeys] = nullAddress;
+      parent->numKeys--;
+
+      freeNode(rightAddress, right, isLeaf ? nodeSize : internalNodeSize);
+
+      // The merged node may still be underfull, if both were.
+      pos = k;
+      continue;
+    }
+
+    // Too many keys for one node, so even them out between the two (both then have enough).
+    float *keys = nodeArena.scratchKeys(total);
+    Address *pointers = nodeArena.scratchPointers(total + 1);
+    int numLeftKeys = total / 2;
+
+    if (isLeaf)
+    {
+      Address next = right->pointers[right->numKeys];
+      for (int i = 0; i < left->numKeys; i++)
+      {
+        keys[i] = left->keys[i];
+        pointers[i] = left->pointers[i];
+      }
+      for (int i = 0; i < right->numKeys; i++)
+      {
+        keys[left->numKeys + i] = right->keys[i];
+        pointers[left->numKeys + i] = right->pointers[i];
+      }
+
+      left->numKeys = numLeftKeys;
+      right->numKeys = total - numLeftKeys;
+      for (int i = 0; i < left->numKeys; i++)
+      {
+        left->keys[i] = keys[i];
+        left->pointers[i] = pointers[i];
+      }
+      left->pointers[left->numKeys] = rightAddress;
+      for (int i = left->numKeys + 1; i < maxKeys + 1; i++)
+      {
+        left->pointers[i] = nullAddress;
+      }
+      for (int i = 0; i < right->numKeys; i++)
+      {
+        right->keys[i] = keys[numLeftKeys + i];
+        right->pointers[i] = pointers[numLeftKeys + i];
+      }
+      right->pointers[right->numKeys] = next;
+      for (int i = right->numKeys + 1; i < maxKeys + 1; i++)
+      {
+        right->pointers[i] = nullAddress;
+      }
+      parent->keys[k] = right->keys[0];
+    }
+    else
+    {
+      // Line up the keys of both with the parent's key between them, and the pointers of both.
+      for (int i = 0; i < left->numKeys; i++)
+      {
+        keys[i] = left->keys[i];
+      }
+      keys[left->numKeys] = parent->keys[k];
+      for (int i = 0; i < right->numKeys; i++)
+      {
+        keys[left->numKeys + 1 + i] = right->keys[i];
+      }
+      for (int i = 0; i <= left->numKeys; i++)
+      {
+        pointers[i] = left->pointers[i];
+      }
+      for (int i = 0; i <= right->numKeys; i++)
+      {
+        pointers[left->numKeys + 1 + i] = right->pointers[i];
+      }
+
+      // The key after the left node's keys goes up to the parent.
+      left->numKeys = numLeftKeys;
+      right->numKeys = total - numLeftKeys - 1;
+      for (int i = 0; i < left->numKeys; i++)
+      {
+        left->keys[i] = keys[i];
+      }
+      for (int i = 0; i <= left->numKeys; i++)
+      {
+        left->pointers[i] = pointers[i];
+      }
+      for (int i = left->numKeys + 1; i < maxInternalKeys + 1; i++)
+      {
+        left->pointers[i] = nullAddress;
+      }
+      parent->keys[k] = keys[numLeftKeys];
+      for (int i = 0; i < right->numKeys; i++)
+      {
+        right->keys[i] = keys[numLeftKeys + 1 + i];
+      }
+      for (int i = 0; i <= right->numKeys; i++)
+      {
+        right->pointers[i] = pointers[numLeftKeys + 1 + i];
+      }
+      for (int i = right->numKeys + 1; i < maxInternalKeys + 1; i++)
+      {
+        right->pointers[i] = nullAddress;
+      }
+    }
+
+    // Two nodes without keys always fit in one, so there is at most one orphan here.
+    // Rebalancing the orphan may leave the node holding it underfull again, so check that one next.
+    if (!orphans.empty())
+    {
+      int orphanPos = findChildPosition(left, orphans[0]);
+      pos = orphanPos >= 0 ? k : k + 1;
+      Node *orphanParent = orphanPos >= 0 ? left : right;
+      rebalanceChild(orphanParent, orphanPos >= 0 ? orphanPos : findChildPosition(right, orphans[0]));
+    }
+
+    index->saveToDisk(left, sizeof(Node), leftAddress);
+    index->saveToDisk(right, sizeof(Node), rightAddress);
+    if (orphans.empty())
+    {
+      return changed;
+    }
+  }
+
+  return changed;
+}
 
 void BPlusTree::removeLL(Address LLHeadAddress)
 {
   // Load in first node from disk.
-  Node *head = (Node *)index->loadFromDisk(LLHeadAddress, nodeSize);
+  Node *head = (Node *)index->loadFromDisk(LLHeadAddress, sizeof(Node));
 
   // Removing the current head. Simply deallocate the entire block since it is safe to do so for the linked list
   // Keep going down the list until no more nodes to deallocate.
 
+  // Keep the records of this node, to deallocate them from the data pool once the whole list is gone.
+  if (cascadeDeletes)
+  {
+    recordsToFree.insert(recordsToFree.end(), head->pointers, head->pointers + head->numKeys);
+  }
+  else
+  {
+    orphanedRecords = true;
+  }
+
   // Deallocate the current node.
-  index->deallocate(LLHeadAddress, nodeSize);
+  freeNode(LLHeadAddress, head, LLNodeSize);
 
   // End of linked list
   if (head->pointers[head->numKeys].blockAddress == nullptr)
@@ -692,3 +1329,119 @@ void BPlusTree::removeLL(Address LLHeadAddress)
     removeLL(head->pointers[head->numKeys]);
   }
 }
+
+
+// Deallocate the records of removed keys from the data pool. Grouping them by block means each block is
+// checked once, and given back to the pool as soon as its last record is gone.
+void BPlusTree::freeRemovedRecords()
+{
+  if (recordsToFree.empty())
+  {
+    return;
+  }
+
+  int blocksFreed = disk->deallocateAll(recordsToFree, sizeof(Record));
+  std::cout << "Deallocated " << recordsToFree.size() << " records, freeing " << blocksFreed << " record blocks." << endl;
+
+  recordsToFree.clear();
+}
+
+
+// Physically remove the oldest tombstone that is still in the tree.
+int BPlusTree::compactOne()
+{
+  while (!tombstoneKeys.empty())
+  {
+    float key = tombstoneKeys.front();
+    tombstoneKeys.pop_front();
+
+    // The key may have been inserted again (or removed for real) since it was marked, so check it's still a tombstone.
+    if (rootAddress == nullptr)
+    {
+      continue;
+    }
+
+    Node *leaf = findLeaf(key);
+    for (int pos = 0; pos < leaf->numKeys; pos++)
+    {
+      if (leaf->keys[pos] == key && isTombstone(leaf->pointers[pos]))
+      {
+        return removeKey(key);
+      }
+    }
+  }
+
+  return 0;
+}
+
+int BPlusTree::compact()
+{
+  int numNodesDeleted = 0;
+
+  // Take the lock per key, so other operations can get in between.
+  while (true)
+  {
+    std::unique_lock<std::mutex> lock = lockTree();
+    if (tombstoneKeys.empty())
+    {
+      break;
+    }
+    numNodesDeleted += compactOne();
+  }
+
+  return numNodesDeleted;
+}
+
+void BPlusTree::startBackgroundCompaction(int idleMilliseconds)
+{
+  if (compactionRunning)
+  {
+    return;
+  }
+
+  stopCompaction = false;
+  compactionRunning = true;
+  compactionThread = std::thread(&BPlusTree::compactionLoop, this, idleMilliseconds);
+}
+
+void BPlusTree::stopBackgroundCompaction()
+{
+  if (!compactionRunning)
+  {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(treeMutex);
+    stopCompaction = true;
+  }
+  compactionWanted.notify_one();
+  compactionThread.join();
+
+  compactionRunning = false;
+}
+
+// Wait for tombstones, then remove them one at a time whenever no other operation touched the tree
+// for a whole idle period. Foreground deletes therefore never pay for rebalancing.
+void BPlusTree::compactionLoop(int idleMilliseconds)
+{
+  std::unique_lock<std::mutex> lock(treeMutex);
+
+  while (!stopCompaction)
+  {
+    if (tombstoneKeys.empty())
+    {
+      compactionWanted.wait(lock);
+      continue;
+    }
+
+    // Only compact if no operation came in while we waited, and no cursor is walking the leaves.
+    long opsBefore = foregroundOps;
+    compactionWanted.wait_for(lock, std::chrono::milliseconds(idleMilliseconds));
+
+    if (!stopCompaction && foregroundOps == opsBefore && openCursors == 0)
+    {
+      compactOne();
+    }
+  }
+}
@@ -1,14 +1,27 @@
 #include "b_plus_tree.h"
 #include "types.h"
+#include "work_stealing_pool.h"
 
 #include <vector>
 #include <cstring>
 #include <iostream>
+#include <algorithm>
+#include <limits>
+
+// Hints the CPU to start fetching a cache line we are about to read.
+static inline void prefetch(const void *address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(address);
+#endif
+}
 
 using namespace std;
 
 void BPlusTree::search(float lowerBoundKey, float upperBoundKey)
 { 
+  std::unique_lock<std::mutex> lock = lockTree();
+
   // Tree is empty.
   if (rootAddress == nullptr)
   {
@@ -17,9 +30,9 @@ void BPlusTree::search(float lowerBoundKey, float upperBoundKey)
   // Else iterate through root node and follow the keys to find the correct key.
   else
   {
-    // Load in root from disk.
+    // Load in root (from the pinned levels, if any).
     Address rootDiskAddress{rootAddress, 0};
-    root = (Node *)index->loadFromDisk(rootDiskAddress, nodeSize);
+    root = loadNode(rootDiskAddress);
 
     // for displaying to output file
     std::cout << "Index node accessed. Content is -----";
@@ -32,34 +45,13 @@ void BPlusTree::search(float lowerBoundKey, float upperBoundKey)
     // While we haven't hit a leaf node, and haven't found a range.
     while (cursor->isLeaf == false)
     {
-      // Iterate through each key in the current node. We need to load nodes from the disk whenever we want to traverse to another node.
-      for (int i = 0; i < cursor->numKeys; i++)
-      {
-        // If lowerBoundKey is lesser than current key, go to the left pointer's node to continue searching.
-        if (lowerBoundKey < cursor->keys[i])
-        {
-          // Load node from disk to main memory.
-          cursor = (Node *)index->loadFromDisk(cursor->pointers[i], nodeSize);
-
-          // for displaying to output file
-          std::cout << "Index node accessed. Content is -----";
-          displayNode(cursor);
+      // Find the pointer to follow for lowerBoundKey. We need to load nodes from the disk whenever we want to traverse to another node.
+      // Load node from disk to main memory.
+      cursor = loadNode(cursor->pointers[findChildIndex(cursor, lowerBoundKey)]);
 
-          break;
-        }
-        // If we reached the end of all keys in this node (larger than all), then go to the right pointer's node to continue searching.
-        if (i == cursor->numKeys - 1)
-        {
-          // Load node from disk to main memory.
-          // Set cursor to the child node, now loaded in main memory.
-          cursor = (Node *)index->loadFromDisk(cursor->pointers[i + 1], nodeSize);
-
-          // for displaying to output file
-          std::cout << "Index node accessed. Content is -----";
-          displayNode(cursor);
-          break;
-        }
-      }
+      // for displaying to output file
+      std::cout << "Index node accessed. Content is -----";
+      displayNode(cursor);
     }
 
     // When we reach here, we have hit a leaf node corresponding to the lowerBoundKey.
@@ -67,6 +59,20 @@ void BPlusTree::search(float lowerBoundKey, float upperBoundKey)
     // vector<Record> results;
     // unordered_map<void *, void *> loadedBlocks; // Maintain a reference to all loaded blocks in main memory.
 
+    // Buffered inserts and deletes in range that haven't reached the leaves yet, merged in as we go.
+    std::map<float, PendingRecords> pending = collectPending(lowerBoundKey, upperBoundKey);
+    std::map<float, PendingRecords>::iterator nextPending = pending.begin();
+
+    // Prints the buffered keys smaller than a key that aren't in the tree.
+    auto displayPendingBelow = [&](float key)
+    {
+      while (nextPending != pending.end() && nextPending->first < key)
+      {
+        displayPending(nextPending->first, nextPending->second);
+        nextPending++;
+      }
+    };
+
     // Keep searching whole range until we find a key that is out of range.
     bool stop = false;
 
@@ -83,16 +89,34 @@ void BPlusTree::search(float lowerBoundKey, float upperBoundKey)
         }
         if (cursor->keys[i] >= lowerBoundKey && cursor->keys[i] <= upperBoundKey)
         {
-          // for displaying to output file
-          std::cout << "Index node (LLNode) accessed. Content is -----";
-          displayNode(cursor);
+          displayPendingBelow(cursor->keys[i]);
+
+          // Check whether buffered messages change this key.
+          PendingRecords *keyPending = nullptr;
+          if (nextPending != pending.end() && nextPending->first == cursor->keys[i])
+          {
+            keyPending = &nextPending->second;
+            nextPending++;
+          }
+
+          if (!isTombstone(cursor->pointers[i]) && !(keyPending != nullptr && keyPending->deleted))
+          {
+            // for displaying to output file
+            std::cout << "Index node (LLNode) accessed. Content is -----";
+            displayNode(cursor);
+
+            // Add new line for each leaf node's linked list printout.
+            std::cout << endl;
+            std::cout << "LLNode: tconst for average rating: " << cursor->keys[i] << " > ";          
 
-          // Add new line for each leaf node's linked list printout.
-          std::cout << endl;
-          std::cout << "LLNode: tconst for average rating: " << cursor->keys[i] << " > ";          
+            // Access the linked list node and print records.
+            displayLL(cursor->pointers[i]);
+          }
 
-          // Access the linked list node and print records.
-          displayLL(cursor->pointers[i]);
+          if (keyPending != nullptr)
+          {
+            displayPending(cursor->keys[i], *keyPending);
+          }
         }
       }
 
@@ -100,7 +124,7 @@ void BPlusTree::search(float lowerBoundKey, float upperBoundKey)
       if (cursor->pointers[cursor->numKeys].blockAddress != nullptr && cursor->keys[i] != upperBoundKey)
       {
         // Set cursor to be next leaf node (load from disk).
-        cursor = (Node *)index->loadFromDisk(cursor->pointers[cursor->numKeys], nodeSize);
+        cursor = (Node *)index->loadFromDisk(cursor->pointers[cursor->numKeys], sizeof(Node));
 
         // for displaying to output file
         std::cout << "Index node accessed. Content is -----";
@@ -112,6 +136,394 @@ void BPlusTree::search(float lowerBoundKey, float upperBoundKey)
         stop = true;
       }
     }
+
+    // Buffered keys past the last key in the tree.
+    displayPendingBelow(std::numeric_limits<float>::infinity());
   }
   return;
-}
\ No newline at end of file
+}
+
+// Return the k records with the largest value of a field among keys within [lowerBoundKey, upperBoundKey].
+std::vector<Record> BPlusTree::topK(float lowerBoundKey, float upperBoundKey, int k, RecordField field)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  // Bounded heap of the best k records seen so far. The front is the current k-th best.
+  std::vector<Record> heap;
+
+  if (k <= 0)
+  {
+    return heap;
+  }
+
+  auto value = [field](const Record &record) -> double
+  {
+    return field == NUM_VOTES ? (double)record.numVotes : (double)record.averageRating;
+  };
+
+  // Orders records so that the heap keeps the smallest value at its front.
+  auto isBetter = [&value](const Record &a, const Record &b)
+  {
+    return value(a) > value(b);
+  };
+
+  scanMerged(lowerBoundKey, upperBoundKey, [&](float key, Address LLHeadAddress, const PendingRecords *changes)
+  {
+    // Once the heap is full, skip the whole linked list if none of its records can beat the k-th best.
+    if ((int)heap.size() == k)
+    {
+      double bound = std::numeric_limits<double>::infinity();
+      if (field == AVERAGE_RATING)
+      {
+        // Every record in the linked list has the key as its rating.
+        bound = key;
+      }
+      else if (useVotesSummary && changes == nullptr && maxVotes.count(key) > 0)
+      {
+        // Pending inserts only count towards the summary once they reach the leaves.
+        bound = maxVotes[key];
+      }
+
+      if (bound <= value(heap.front()))
+      {
+        return;
+      }
+    }
+
+    // Go through every record of the key, keeping the best k.
+    forEachRecord(LLHeadAddress, changes, [&](Address recordAddress)
+    {
+      Record record = loadRecord(recordAddress);
+
+      if ((int)heap.size() < k)
+      {
+        heap.push_back(record);
+        std::push_heap(heap.begin(), heap.end(), isBetter);
+      }
+      else if (value(record) > value(heap.front()))
+      {
+        std::pop_heap(heap.begin(), heap.end(), isBetter);
+        heap.back() = record;
+        std::push_heap(heap.begin(), heap.end(), isBetter);
+      }
+    });
+  });
+
+  // Largest value first.
+  std::sort_heap(heap.begin(), heap.end(), isBetter);
+  return heap;
+}
+
+// Compute the max numVotes of every key, and keep it updated on insert and remove from now on.
+void BPlusTree::enableVotesSummary()
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+  applyPending();
+
+  maxVotes.clear();
+  useVotesSummary = true;
+
+  scanRange(std::numeric_limits<float>::lowest(), std::numeric_limits<float>::max(), [&](float key, Address LLHeadAddress)
+  {
+    forEachInLL(LLHeadAddress, [&](Address recordAddress)
+    {
+      updateVotesSummary(key, recordAddress);
+    });
+  });
+}
+
+
+// Look up a batch of keys with a single shared traversal of the tree.
+std::vector<std::vector<Record>> BPlusTree::lookupBatch(const std::vector<float> &keys)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  std::vector<std::vector<Record>> results(keys.size());
+
+  if (rootAddress == nullptr || keys.empty())
+  {
+    mergePendingLookups(keys, results);
+    return results;
+  }
+
+  // Keys the direct key directory knows need no descent.
+  std::vector<bool> found(keys.size(), false);
+  std::vector<float> probes;
+  for (int i = 0; i < (int)keys.size(); i++)
+  {
+    found[i] = directoryLookup(keys[i], results[i]);
+    if (found[i] == false)
+    {
+      probes.push_back(keys[i]);
+    }
+  }
+
+  if (probes.empty())
+  {
+    mergePendingLookups(keys, results);
+    return results;
+  }
+
+  // Sort the distinct probe keys, so that probes going into the same subtree sit next to each other.
+  std::sort(probes.begin(), probes.end());
+  probes.erase(std::unique(probes.begin(), probes.end()), probes.end());
+
+  // Descend once from the root, splitting the probes among the children of each node.
+  std::vector<std::vector<Record>> matches(probes.size());
+  Address rootDiskAddress{rootAddress, 0};
+  Node *cursor = loadNode(rootDiskAddress);
+  lookupBatchNode(cursor, probes, 0, probes.size(), matches);
+
+  // Hand each key the records found for it.
+  for (int i = 0; i < (int)keys.size(); i++)
+  {
+    if (found[i])
+    {
+      continue;
+    }
+
+    int probe = std::lower_bound(probes.begin(), probes.end(), keys[i]) - probes.begin();
+    results[i] = matches[probe];
+  }
+
+  // Buffered inserts and deletes of the keys that haven't reached the leaves yet.
+  mergePendingLookups(keys, results);
+  return results;
+}
+
+// Look up the probes in [begin, end) within the subtree rooted at cursor.
+void BPlusTree::lookupBatchNode(Node *cursor, const std::vector<float> &probes, int begin, int end, std::vector<std::vector<Record>> &matches)
+{
+  // At a leaf, merge the sorted probes against the sorted keys of the leaf.
+  if (cursor->isLeaf)
+  {
+    int i = 0;
+    for (int probe = begin; probe < end; probe++)
+    {
+      while (i < cursor->numKeys && cursor->keys[i] < probes[probe])
+      {
+        i++;
+      }
+      if (i < cursor->numKeys && cursor->keys[i] == probes[probe])
+      {
+        // Fill in the key's slot in the direct key directory, so the next lookup needs no descent.
+        directoryRemember(probes[probe], cursor->pointers[i]);
+      }
+      if (i < cursor->numKeys && cursor->keys[i] == probes[probe] && !isTombstone(cursor->pointers[i]))
+      {
+        forEachInLL(cursor->pointers[i], [&](Address recordAddress)
+        {
+          matches[probe].push_back(loadRecord(recordAddress));
+        });
+      }
+    }
+    return;
+  }
+
+  // Else give each child the probes that are smaller than its upper bound key, and load it only if it got any.
+  int probe = begin;
+  for (int i = 0; i <= cursor->numKeys && probe < end; i++)
+  {
+    int childEnd = probe;
+    while (childEnd < end && (i == cursor->numKeys || probes[childEnd] < cursor->keys[i]))
+    {
+      childEnd++;
+    }
+
+    if (childEnd > probe)
+    {
+      Node *child = loadNode(cursor->pointers[i]);
+      lookupBatchNode(child, probes, probe, childEnd, matches);
+      probe = childEnd;
+    }
+  }
+}
+
+// Look up a batch of keys by interleaving several traversals. Each step of a traversal prefetches the memory
+// the next step needs and then yields to the other traversals, so their cache misses overlap.
+std::vector<std::vector<Record>> BPlusTree::lookupInterleaved(const std::vector<float> &keys, int groupSize)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  std::vector<std::vector<Record>> results(keys.size());
+
+  if (rootAddress == nullptr || keys.empty())
+  {
+    mergePendingLookups(keys, results);
+    return results;
+  }
+
+  // Each in-flight traversal is a small state machine:
+  // FETCH loads the node whose block was prefetched, then prefetches the node's keys.
+  // SEARCH picks the child to follow (or finishes at a leaf), then prefetches the child's block.
+  enum Step
+  {
+    IDLE,
+    FETCH,
+    SEARCH
+  };
+
+  struct Lookup
+  {
+    Step step;
+    int probe;    // Index of the key this traversal is looking up.
+    Address next; // Disk address of the node to load in the FETCH step.
+    Node *cursor; // Node loaded in main memory, searched in the SEARCH step.
+  };
+
+  std::vector<Lookup> lookups(std::max(groupSize, 1), Lookup{IDLE, 0, {nullptr, 0}, nullptr});
+  int nextProbe = 0;
+  int active = 0;
+
+  do
+  {
+    for (Lookup &lookup : lookups)
+    {
+      switch (lookup.step)
+      {
+      case IDLE:
+        // Start the next key (if any) from the root.
+        if (nextProbe < (int)keys.size())
+        {
+          lookup.probe = nextProbe++;
+          lookup.next = Address{rootAddress, 0};
+          lookup.step = FETCH;
+          prefetch(rootAddress);
+          active++;
+        }
+        break;
+
+      case FETCH:
+        lookup.cursor = loadNode(lookup.next);
+        lookup.step = SEARCH;
+        prefetch(lookup.cursor->keys);
+        break;
+
+      case SEARCH:
+        if (lookup.cursor->isLeaf == false)
+        {
+          // Same node search as search(), then suspend until the child's block arrives.
+          lookup.next = lookup.cursor->pointers[findChildIndex(lookup.cursor, keys[lookup.probe])];
+          lookup.step = FETCH;
+          prefetch(lookup.next.blockAddress);
+        }
+        else
+        {
+          // Reached the leaf, collect the records of the key (if it's there) and free up this slot.
+          for (int i = 0; i < lookup.cursor->numKeys; i++)
+          {
+            if (lookup.cursor->keys[i] == keys[lookup.probe])
+            {
+              if (!isTombstone(lookup.cursor->pointers[i]))
+              {
+                forEachInLL(lookup.cursor->pointers[i], [&](Address recordAddress)
+                {
+                  results[lookup.probe].push_back(loadRecord(recordAddress));
+                });
+              }
+              break;
+            }
+          }
+          lookup.step = IDLE;
+          active--;
+        }
+        break;
+      }
+    }
+  } while (active > 0 || nextProbe < (int)keys.size());
+
+  // Buffered inserts and deletes of the keys that haven't reached the leaves yet.
+  mergePendingLookups(keys, results);
+  return results;
+}
+
+// Search a range on several threads. The range is cut into sub-ranges at the separator keys of the upper levels of
+// the tree, and the sub-ranges are scanned by a work-stealing pool. Returns the matching records in key order.
+std::vector<Record> BPlusTree::parallelSearch(float lowerBoundKey, float upperBoundKey, int numThreads)
+{
+  std::unique_lock<std::mutex> lock = lockTree();
+
+  std::vector<Record> results;
+
+  // Gather separator keys inside the range, one level at a time from the root, until we have a few sub-ranges
+  // per thread (so stealing can even out sub-ranges holding many more records than others).
+  std::vector<float> splitKeys;
+  std::vector<Address> level;
+  if (rootAddress != nullptr)
+  {
+    level.push_back(Address{rootAddress, 0});
+  }
+
+  while (!level.empty() && (int)splitKeys.size() < numThreads * 4)
+  {
+    std::vector<Address> nextLevel;
+
+    for (Address nodeAddress : level)
+    {
+      Node *node = loadNode(nodeAddress);
+
+      // We only split on internal nodes, leaves are left to the scans.
+      if (node->isLeaf)
+      {
+        continue;
+      }
+
+      for (int i = 0; i <= node->numKeys; i++)
+      {
+        // Keep keys that fall strictly inside the range.
+        if (i < node->numKeys && node->keys[i] > lowerBoundKey && node->keys[i] <= upperBoundKey)
+        {
+          splitKeys.push_back(node->keys[i]);
+        }
+
+        // Only go down into children whose key range overlaps ours.
+        bool aboveLowerBound = i == node->numKeys || node->keys[i] > lowerBoundKey;
+        bool belowUpperBound = i == 0 || node->keys[i - 1] <= upperBoundKey;
+        if (aboveLowerBound && belowUpperBound)
+        {
+          nextLevel.push_back(node->pointers[i]);
+        }
+      }
+    }
+
+    level = nextLevel;
+  }
+
+  std::sort(splitKeys.begin(), splitKeys.end());
+  splitKeys.erase(std::unique(splitKeys.begin(), splitKeys.end()), splitKeys.end());
+
+  // Sub-range t is [bounds[t], bounds[t + 1]), except the last one which includes upperBoundKey.
+  std::vector<float> bounds;
+  bounds.push_back(lowerBoundKey);
+  bounds.insert(bounds.end(), splitKeys.begin(), splitKeys.end());
+  bounds.push_back(upperBoundKey);
+
+  int numRanges = bounds.size() - 1;
+  std::vector<std::vector<Record>> partialResults(numRanges);
+
+  WorkStealingPool pool(numThreads);
+  pool.run(numRanges, [&](int t)
+  {
+    bool isLastRange = t == numRanges - 1;
+
+    // Each scan merges in the buffered inserts and deletes of its own sub-range.
+    scanMerged(bounds[t], bounds[t + 1], [&](float key, Address LLHeadAddress, const PendingRecords *changes)
+    {
+      if (key < bounds[t + 1] || isLastRange)
+      {
+        forEachRecord(LLHeadAddress, changes, [&](Address recordAddress)
+        {
+          partialResults[t].push_back(loadRecord(recordAddress));
+        });
+      }
+    });
+  });
+
+  // Sub-ranges are in key order, so concatenating them keeps the results sorted by key.
+  for (std::vector<Record> &partialResult : partialResults)
+  {
+    results.insert(results.end(), partialResult.begin(), partialResult.end());
+  }
+
+  return results;
+}
@@ -4,6 +4,7 @@
 #include <vector>
 #include <cstring>
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 
@@ -12,7 +13,7 @@ Node *BPlusTree::findParent(Node *cursorDiskAddress, Node *childDiskAddress, flo
 {
   // Load in cursor into main memory, starting from root.
   Address cursorAddress{cursorDiskAddress, 0};
-  Node *cursor = (Node *)index->loadFromDisk(cursorAddress, nodeSize);
+  Node *cursor = (Node *)index->loadFromDisk(cursorAddress, sizeof(Node));
 
   // If the root cursor passed in is a leaf node, there is no children, therefore no parent.
   if (cursor->isLeaf)
@@ -41,7 +42,7 @@ Node *BPlusTree::findParent(Node *cursorDiskAddress, Node *childDiskAddress, flo
       if (lowerBoundKey < cursor->keys[i])
       {
         // Load node in from disk to main memory.
-        Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i], nodeSize);
+        Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i], sizeof(Node));
 
         // Update parent address.
         parentDiskAddress = (Node *)cursor->pointers[i].blockAddress;
@@ -55,7 +56,7 @@ Node *BPlusTree::findParent(Node *cursorDiskAddress, Node *childDiskAddress, flo
       if (i == cursor->numKeys - 1)
       {
         // Load node in from disk to main memory.
-        Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i + 1], nodeSize);
+        Node *mainMemoryNode = (Node *)index->loadFromDisk(cursor->pointers[i + 1], sizeof(Node));
 
         // Update parent address.
         parentDiskAddress = (Node *)cursor->pointers[i + 1].blockAddress;
@@ -74,19 +75,21 @@ Node *BPlusTree::findParent(Node *cursorDiskAddress, Node *childDiskAddress, flo
 
 int BPlusTree::getLevels() {
 
+  std::unique_lock<std::mutex> lock = lockTree();
+
   if (rootAddress == nullptr) {
     return 0;
   }
 
   // Load in the root node from disk
   Address rootDiskAddress{rootAddress, 0};
-  root = (Node *)index->loadFromDisk(rootDiskAddress, nodeSize);
+  root = loadNode(rootDiskAddress);
   Node *cursor = root;
 
   levels = 1;
 
   while (!cursor->isLeaf) {
-    cursor = (Node *)index->loadFromDisk(cursor->pointers[0], nodeSize);
+    cursor = loadNode(cursor->pointers[0]);
     levels++;
   }
 
@@ -95,3 +98,226 @@ int BPlusTree::getLevels() {
 
   return levels;
 }
+
+// Find which pointer of an internal node leads towards a key.
+int BPlusTree::findChildIndex(Node *node, float key)
+{
+  // Follow the left pointer of the first key larger than our key.
+  for (int i = 0; i < node->numKeys; i++)
+  {
+    if (key < node->keys[i])
+    {
+      return i;
+    }
+  }
+
+  // Else key is larger than all keys in the node, go to last pointer's node (rightmost).
+  return node->numKeys;
+}
+
+// Load a node, skipping the disk if it sits in the pinned levels.
+Node *BPlusTree::loadNode(Address address)
+{
+  if (pinnedLevels > 0)
+  {
+    if (pinnedStale)
+    {
+      pinUpperLevels();
+    }
+
+    auto pinned = pinnedNodes.find(address.blockAddress);
+    if (pinned != pinnedNodes.end())
+    {
+      pinnedAccessed++;
+      return pinned->second;
+    }
+  }
+
+  return (Node *)index->loadFromDisk(address, sizeof(Node));
+}
+
+// Load the top levels of internal nodes, one level at a time from the root, and keep them in main memory.
+void BPlusTree::pinUpperLevels()
+{
+  pinnedNodes.clear();
+  pinnedStale = false;
+
+  if (rootAddress == nullptr)
+  {
+    return;
+  }
+
+  std::vector<Address> level(1, Address{rootAddress, 0});
+  for (int depth = 0; depth < pinnedLevels && !level.empty(); depth++)
+  {
+    std::vector<Address> nextLevel;
+
+    for (Address nodeAddress : level)
+    {
+      Node *node = (Node *)index->loadFromDisk(nodeAddress, sizeof(Node));
+
+      // Leaves change on every insert and remove, so only internal nodes are pinned.
+      if (node->isLeaf)
+      {
+        continue;
+      }
+
+      pinnedNodes[nodeAddress.blockAddress] = node;
+      nextLevel.insert(nextLevel.end(), node->pointers, node->pointers + node->numKeys + 1);
+    }
+
+    level = nextLevel;
+  }
+}
+
+// Forget the pinned nodes. They are loaded again by the next traversal that needs them.
+void BPlusTree::unpinLevels()
+{
+  pinnedNodes.clear();
+  pinnedStale = true;
+}
+
+void BPlusTree::unpinLevels(void *nodeDiskAddress)
+{
+  if (pinnedNodes.count(nodeDiskAddress) > 0)
+  {
+    unpinLevels();
+  }
+}
+
+// Find the leaf node that would contain a key.
+Node *BPlusTree::findLeaf(float key)
+{
+  // Load in root (from the pinned levels, if any).
+  Address rootDiskAddress{rootAddress, 0};
+  Node *cursor = loadNode(rootDiskAddress);
+
+  // While not leaf, keep following the nodes to correct key.
+  while (cursor->isLeaf == false)
+  {
+    cursor = loadNode(cursor->pointers[findChildIndex(cursor, key)]);
+  }
+
+  return cursor;
+}
+
+// Walk every key in a range along the leaf level.
+void BPlusTree::scanRange(float lowerBoundKey, float upperBoundKey, const std::function<void(float, Address)> &visit)
+{
+  if (rootAddress == nullptr)
+  {
+    return;
+  }
+
+  Node *cursor = findLeaf(lowerBoundKey);
+
+  while (cursor != nullptr)
+  {
+    for (int i = 0; i < cursor->numKeys; i++)
+    {
+      // Keys are sorted, so the first key past the upper bound ends the scan.
+      if (cursor->keys[i] > upperBoundKey)
+      {
+        return;
+      }
+      if (cursor->keys[i] >= lowerBoundKey && !isTombstone(cursor->pointers[i]))
+      {
+        visit(cursor->keys[i], cursor->pointers[i]);
+      }
+    }
+
+    // Move on to the next leaf node (if any).
+    if (cursor->pointers[cursor->numKeys].blockAddress == nullptr)
+    {
+      return;
+    }
+    cursor = (Node *)index->loadFromDisk(cursor->pointers[cursor->numKeys], sizeof(Node));
+  }
+}
+
+// Load a copy of a record from the disk.
+Record BPlusTree::loadRecord(Address address)
+{
+  void *mainMemoryAddress = disk->loadFromDisk(address, sizeof(Record));
+  Record record = *(Record *)mainMemoryAddress;
+  operator delete(mainMemoryAddress);
+
+  return record;
+}
+
+// Update the max numVotes of a key with a record that was just stored under it.
+void BPlusTree::updateVotesSummary(float key, Address address)
+{
+  int numVotes = loadRecord(address).numVotes;
+
+  std::unordered_map<float, int>::iterator summary = maxVotes.find(key);
+  if (summary == maxVotes.end() || summary->second < numVotes)
+  {
+    maxVotes[key] = numVotes;
+  }
+}
+
+// Visit every record in a linked list of duplicates.
+void BPlusTree::forEachInLL(Address LLHeadAddress, const std::function<void(Address)> &visit)
+{
+  Address LLNodeAddress = LLHeadAddress;
+
+  while (LLNodeAddress.blockAddress != nullptr)
+  {
+    Node *LLNode = (Node *)index->loadFromDisk(LLNodeAddress, sizeof(Node));
+
+    for (int i = 0; i < LLNode->numKeys; i++)
+    {
+      visit(LLNode->pointers[i]);
+    }
+
+    // Move to next node in linked list.
+    LLNodeAddress = LLNode->pointers[LLNode->numKeys];
+  }
+}
+
+// Take the tree lock, but only if there is a background compaction thread to guard against.
+std::unique_lock<std::mutex> BPlusTree::lockTree()
+{
+  std::unique_lock<std::mutex> lock(treeMutex, std::defer_lock);
+  if (compactionRunning)
+  {
+    lock.lock();
+  }
+
+  // No operation is running, so the nodes freed by the ones before can be reused.
+  nodeArena.release();
+
+  foregroundOps++;
+  return lock;
+}
+
+// Work out how many keys a full node keeps on the left when it splits.
+int BPlusTree::leftSplitSize(int maxNodeKeys, int maxLeftKeys, bool appendingAtEnd)
+{
+  int evenSize = (maxNodeKeys + 1) / 2;
+
+  if (splitPolicy == RIGHT_BIASED_SPLIT && appendingAtEnd)
+  {
+    // Keys only ever arrive on the right, so fill the left node up to the fill factor (never below an even split).
+    int fillSize = (int)(fillFactor * maxNodeKeys + 0.5);
+    return std::max(evenSize, std::min(maxLeftKeys, fillSize));
+  }
+
+  return evenSize;
+}
+
+// Save a new node into a block of its own size class. Only the node itself is copied, its keys and pointers stay
+// where they are in main memory.
+Address BPlusTree::saveNewNode(Node *node, std::size_t size)
+{
+  Address diskAddress = index->allocate(size);
+  return index->saveToDisk(node, sizeof(Node), diskAddress);
+}
+
+// Free a node on disk. Its arrays go back to the arena, to be reused once the current operation is over.
+void BPlusTree::freeNode(Address address, Node *node, std::size_t size)
+{
+  index->deallocate(address, size);
+  nodeArena.recycle(node);
+}
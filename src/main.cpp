@@ -1,5 +1,8 @@
 #include "memory_pool.h"
+#include "memory_budget.h"
 #include "b_plus_tree.h"
+#include "pax_pool.h"
+#include "record_codec.h"
 #include "types.h"
 
 #include <iostream>
@@ -9,6 +12,8 @@
 #include <string.h>
 #include <vector>
 #include <unordered_map>
+#include <chrono>
+#include <limits>
 
 using namespace std;
 
@@ -57,14 +62,24 @@ int main()
   =============================================================
   */
 
-  // Create memory pools for the disk and the index, total 500MB
-  // The split is determined empirically. We split so that we can have a contiguous disk address space for records
+  // Create memory pools for the disk and the index, sharing a budget of 500MB
+  // Each pool can grow to the whole budget, committing memory as it goes, so neither runs out while the other has room.
+  // Blocks start on cache lines, and the pools ask for huge pages so walking them takes fewer TLB misses.
   std::cout << "creating the disk on the stack for records, index" << endl;
-  MemoryPool disk(150000000, BLOCKSIZE);  // 150MB
-  MemoryPool index(350000000, BLOCKSIZE); // 350MB
+  MemoryBudget budget(500000000); // 500MB
+  MemoryPool disk(budget.getLimit(), BLOCKSIZE, 64, HUGE_PAGES);
+  MemoryPool index(budget.getLimit(), BLOCKSIZE, 64, HUGE_PAGES);
+  disk.setBudget(&budget);
+  index.setBudget(&budget);
+  PaxPool columns(150000000, BLOCKSIZE);  // Up to 150MB of the budget, the same records in a columnar layout
+  columns.setBudget(&budget);
+
+  // Store records encoded, so more of them fit in each block.
+  RecordCodec codec;
+  disk.setCodec(&codec);
 
   // Creating the tree 
-  BPlusTree tree = BPlusTree(BLOCKSIZE, &disk, &index);
+  BPlusTree tree(BLOCKSIZE, &disk, &index);
   std::cout << "Max keys for a B+ tree node: " << tree.getMaxKeys() << endl;
 
   // Reset the number of blocks accessed to zero
@@ -86,6 +101,10 @@ int main()
     std::string line;
     int recordNum = 0;
 
+    // Records are added to the tree in batches of this many, one pass per leaf.
+    const int BATCHSIZE = 1000;
+    std::vector<std::pair<float, Address>> batch;
+
     while (std::getline(file, line))
     {
       //temporary struct Record
@@ -102,22 +121,40 @@ int main()
 
       //insert this record into the database
       Address tempAddress = disk.saveToDisk(&temp, sizeof(Record));
+      columns.saveRecord(temp);
 
-      //build the bplustree as we insert records
-      tree.insert(tempAddress, float(temp.averageRating));
+      //build the bplustree as we insert records, a batch at a time
+      batch.push_back(std::make_pair(float(temp.averageRating), tempAddress));
+      if ((int)batch.size() == BATCHSIZE)
+      {
+        tree.insertBatch(batch);
+        batch.clear();
+      }
 
       //logging
       // cout << "Inserted record " << recordNum + 1 << " at block address: " << &tempAddress.blockAddress << " and offset " << &tempAddress.offset << endl;
       recordNum += 1;
     }
+    tree.insertBatch(batch);
     file.close();
   }
 
   // call experiment 1
   std::cout <<"=====================================Experiment 1=========================================="<<endl;
-  std::cout << "Number of records per record block --- " << BLOCKSIZE / sizeof(Record) << endl;
+  std::cout << "Number of records per record block (unencoded) --- " << BLOCKSIZE / sizeof(Record) << endl;
   std::cout << "Number of keys per index block --- " << tree.getMaxKeys() << endl;
   std::cout << "Number of record blocks --- " << disk.getAllocated() << endl;
+
+  // Count the records by reading the data pool straight through, instead of through the index.
+  int recordsInPool = 0;
+  MemoryPool::RecordIterator poolRecords = disk.scanRecords(sizeof(Record));
+  while (poolRecords.next())
+  {
+    recordsInPool++;
+  }
+  disk.resetBlocksAccessed();
+  std::cout << "Number of records in record blocks (full scan) --- " << recordsInPool << endl;
+  std::cout << "Average number of records per record block (encoded) --- " << (double)recordsInPool / disk.getAllocated() << endl;
   std::cout << "Number of index blocks --- " << index.getAllocated() << endl;
   std::cout << "Size of actual record data stored --- " << disk.getActualSizeUsed() << endl;
   std::cout << "Size of actual index data stored --- " << index.getActualSizeUsed() << endl;
@@ -126,6 +163,11 @@ int main()
   std::cout <<"Total number of blocks   : "<<disk.getAllocated() + index.getAllocated()<<endl;
   std::cout <<"Actual size of database : "<<disk.getActualSizeUsed() + index.getActualSizeUsed()<<endl;
   std::cout <<"Size of database (size of all blocks): "<<disk.getSizeUsed()+index.getSizeUsed()<<endl;
+
+  // Loading is done, so most record blocks are cold. Compress them, and read them through a small cache from now on.
+  int segmentsCompressed = disk.compressSegments();
+  std::cout << "Number of record block segments compressed --- " << segmentsCompressed << endl;
+  std::cout << "Memory taken by record blocks (after compression) --- " << disk.getFootprint() << endl;
   
   // finish saving experiment1 logging
   std::cout.rdbuf(coutbuf); //reset to standard output again
@@ -219,11 +261,61 @@ int main()
   std::cout << endl;
   std::cout <<"Number of index blocks the process accesses: "<<index.resetBlocksAccessed()<<endl; 
   std::cout <<"Number of data blocks the process accesses: "<<disk.resetBlocksAccessed()<<endl;
+
+  // Let the planner pick how to read the same range, now that it matches a large share of the records.
+  std::cout << endl << "Retrieving the same range with the planner's choice of scan..." << endl;
+  tree.plannedSearch(7, 9);
+  index.resetBlocksAccessed();
+  disk.resetBlocksAccessed();
   
 
   // finish saving experiment4 logging
   std::cout.rdbuf(coutbuf); //reset to standard output again
 
+  /*
+  =============================================================
+  Columnar scan:
+  Retrieve the movies with averageRating from 7 to 9 (inclusively) again, through the index and by scanning every
+  block of the columnar copy of the data, and report the following statistics for both:
+  - The number of records returned;
+  - The number of blocks the process accesses;
+  - The time the process takes;
+  =============================================================
+  */
+
+  // save columnar scan logging
+  ofstream outColumnar("../outputs_test/columnar_scan_" + to_string(BLOCKSIZE) + "MB.txt");
+  std::cout.rdbuf(outColumnar.rdbuf());           //redirect std::cout to filename.txt!
+
+  std::cout <<"=====================================Columnar scan=========================================="<<endl;
+  std::cout << "Number of records per columnar block --- " << columns.getRecordsPerBlock() << endl;
+  std::cout << "Number of columnar blocks --- " << columns.getAllocated() << endl;
+  index.resetBlocksAccessed();
+  disk.resetBlocksAccessed();
+  columns.resetBlocksAccessed();
+
+  int indexRecords = 0;
+  auto indexStart = std::chrono::steady_clock::now();
+  BPlusTree::RangeCursor rangeCursor = tree.openRange(7, 9);
+  Record rangeRecord;
+  while (rangeCursor.next(rangeRecord))
+  {
+    indexRecords++;
+  }
+  auto indexEnd = std::chrono::steady_clock::now();
+  std::cout << "Index: " << indexRecords << " records, " << index.resetBlocksAccessed() << " index blocks and "
+            << disk.resetBlocksAccessed() << " record blocks accessed, "
+            << std::chrono::duration<double, std::micro>(indexEnd - indexStart).count() << " us" << endl;
+
+  auto scanStart = std::chrono::steady_clock::now();
+  int scanRecords = columns.scan(7, 9, 0, std::numeric_limits<int>::max()).size();
+  auto scanEnd = std::chrono::steady_clock::now();
+  std::cout << "Columnar scan: " << scanRecords << " records, " << columns.resetBlocksAccessed() << " columnar blocks accessed, "
+            << std::chrono::duration<double, std::micro>(scanEnd - scanStart).count() << " us" << endl;
+
+  // finish saving columnar scan logging
+  std::cout.rdbuf(coutbuf); //reset to standard output again
+
   /*
   =============================================================
   Experiment 5:
@@ -244,12 +336,16 @@ int main()
   std::cout <<"=====================================Experiment 5=========================================="<<endl;
   std::cout<<"Deleting those movies with the attribute averageRating equal to 7...\n";
   
+  // Also deallocate the deleted movies from the record blocks, not just their index entries.
+  tree.setCascadeDeletes(true);
   int nodesDeleted = tree.remove(7.0);
 
   std::cout << "B+ Tree after deletion" << endl;
   std::cout <<"Number of times that a node is deleted (or two nodes are merged): "<< nodesDeleted << endl; 
   std::cout << "Number of nodes in updated B+ Tree --- " << tree.getNumNodes() << endl;
   std::cout << "Height of updated B+ tree --- " << tree.getLevels() << endl;
+  std::cout << "Number of record blocks after deletion --- " << disk.getAllocated() << endl;
+  std::cout << "Size of record blocks after deletion --- " << disk.getSizeUsed() << endl;
   std::cout << endl;
   tree.display(tree.getRoot(), 1);
   std::cout << endl;
@@ -260,6 +356,53 @@ int main()
   // reset counts for next part
   index.resetBlocksAccessed();
   disk.resetBlocksAccessed(); 
+
+  /*
+  =============================================================
+  Learned index:
+  Look up every averageRating from 1.0 to 10.0 going down the internal nodes, then again through the learned
+  directory over the leaf level, and report the following statistics for both:
+  - The number of index blocks the lookups access;
+  - The time the lookups take;
+  =============================================================
+  */
+
+  // save learned index logging
+  ofstream out6("../outputs_test/learned_index_" + to_string(BLOCKSIZE) + "MB.txt");
+  std::cout.rdbuf(out6.rdbuf());           //redirect std::cout to filename.txt!
+
+  std::cout <<"=====================================Learned index=========================================="<<endl;
+  tree.setLearnedIndex(true);
+  std::cout << "Number of segments in the learned directory --- " << tree.getNumSegments() << endl;
+  index.resetBlocksAccessed();
+  disk.resetBlocksAccessed();
+
+  int classicRecords = 0;
+  auto classicStart = std::chrono::steady_clock::now();
+  for (int rating = 10; rating <= 100; rating++)
+  {
+    classicRecords += tree.lookupBatch({rating / 10.0f})[0].size();
+  }
+  auto classicEnd = std::chrono::steady_clock::now();
+  std::cout << "Internal node descent: " << classicRecords << " records, "
+            << index.resetBlocksAccessed() << " index blocks accessed, "
+            << std::chrono::duration<double, std::micro>(classicEnd - classicStart).count() << " us" << endl;
+  disk.resetBlocksAccessed();
+
+  int learnedRecords = 0;
+  auto learnedStart = std::chrono::steady_clock::now();
+  for (int rating = 10; rating <= 100; rating++)
+  {
+    learnedRecords += tree.learnedSearch(rating / 10.0f, rating / 10.0f).size();
+  }
+  auto learnedEnd = std::chrono::steady_clock::now();
+  std::cout << "Learned directory: " << learnedRecords << " records, "
+            << index.resetBlocksAccessed() << " index blocks accessed, "
+            << std::chrono::duration<double, std::micro>(learnedEnd - learnedStart).count() << " us" << endl;
+  disk.resetBlocksAccessed();
+
+  // finish saving learned index logging
+  std::cout.rdbuf(coutbuf); //reset to standard output again
   
 
   std::cerr << "\n\n================================================================================================================" << endl;
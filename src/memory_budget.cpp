@@ -0,0 +1,34 @@
+#include "memory_budget.h"
+
+#include <stdexcept>
+
+// Constructors
+
+MemoryBudget::MemoryBudget(std::size_t limit)
+{
+  this->limit = limit;
+  this->used = 0;
+}
+
+// Methods
+
+bool MemoryBudget::reserve(std::size_t size)
+{
+  if (size > limit - used)
+  {
+    return false;
+  }
+
+  used += size;
+  return true;
+}
+
+void MemoryBudget::release(std::size_t size)
+{
+  if (size > used)
+  {
+    throw std::logic_error("Released more memory than was reserved!");
+  }
+
+  used -= size;
+}
@@ -0,0 +1,47 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <cstddef>
+
+// Caps the memory a group of pools can commit between them. Pools take memory out of the budget as they grow, so
+// each can grow into whatever the others leave, instead of being given a fixed share of it up front.
+class MemoryBudget
+{
+public:
+  // =============== Methods ================ //
+
+  // Creates a budget of limit bytes.
+  MemoryBudget(std::size_t limit);
+
+  // Takes size bytes out of the budget. Returns false (and takes nothing) if that would go over the limit.
+  bool reserve(std::size_t size);
+
+  // Gives back size bytes taken out before.
+  void release(std::size_t size);
+
+  // Returns the most memory the pools can commit between them.
+  std::size_t getLimit() const
+  {
+    return limit;
+  }
+
+  // Returns the memory the pools have committed so far.
+  std::size_t getUsed() const
+  {
+    return used;
+  }
+
+  // Returns the memory left in the budget.
+  std::size_t getAvailable() const
+  {
+    return limit - used;
+  }
+
+private:
+  // =============== Data ================ //
+
+  std::size_t limit; // Most memory that can be taken out.
+  std::size_t used;  // Memory taken out so far.
+};
+
+#endif
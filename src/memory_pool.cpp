@@ -1,56 +1,228 @@
 #include "memory_pool.h"
+#include "memory_budget.h"
+#include "record_codec.h"
 #include "types.h"
 
 #include <iostream>
 #include <vector>
 #include <tuple>
 #include <cstring>
+#include <algorithm>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define MEMORY_POOL_MMAP
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#endif
 
 // We need to create a general memory pool that can be used for both the relational data and the index.
 // This pool should be able to assign new blocks if necessary.
 
+// Hints the CPU to start fetching a cache line we are about to read.
+static inline void prefetch(const void *address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(address);
+#endif
+}
+
+// Rounds size up to a multiple of alignment.
+static std::size_t roundUp(std::size_t size, std::size_t alignment)
+{
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// Size of the huge pages MAP_HUGETLB maps with, unless the system is set up otherwise.
+static const std::size_t hugePageSize = 2 << 20;
+
+// Memory is committed to a pool this much at a time (a whole number of huge pages).
+static const std::size_t extentSize = 4 << 20;
+
 // Constructors
 
-MemoryPool::MemoryPool(std::size_t maxPoolSize, std::size_t blockSize)
+MemoryPool::MemoryPool(std::size_t maxPoolSize, std::size_t blockSize, std::size_t blockAlignment, PoolPages pages)
 {
+  if (blockAlignment == 0 || (blockAlignment & (blockAlignment - 1)) != 0)
+  {
+    std::cout << "Error: Block alignment must be a power of two (" << blockAlignment << " given)." << '\n';
+    throw std::invalid_argument("Block alignment must be a power of two!");
+  }
+
   this->maxPoolSize = maxPoolSize;
   this->blockSize = blockSize;
+  this->blockAlignment = blockAlignment;
+  this->blockStride = roundUp(blockSize, blockAlignment);
   this->sizeUsed = 0;
   this->actualSizeUsed = 0;
   this->allocated = 0;
 
-  // Create pool of blocks.
-  this->pool = operator new(maxPoolSize);
-  std::memset(pool, '\0', maxPoolSize); // Initialize pool all to null.
+  // Create pool of blocks. Its memory must read as all null, but doesn't need clearing up front.
+  mapPool(pages);
   this->block = nullptr;
   this->blockSizeUsed = 0;
+  this->nextBlock = 0;
+  this->codec = nullptr;
+  this->budget = nullptr;
+  this->committedSize = 0;
+  this->segmentBlocks = 0;
+  this->cacheSegments = 0;
+  this->numCompressed = 0;
+  this->compressedSizeUsed = 0;
+  this->releasedSize = 0;
 
   this->blocksAccessed = 0;
 }
 
 // Methods
 
-bool MemoryPool::allocateBlock()
+void MemoryPool::mapPool(PoolPages pages)
 {
-  // Only allocate a new block if we don't exceed maxPoolSize.
-  if (sizeUsed + blockSize <= maxPoolSize)
+  this->pages = NORMAL_PAGES;
+  this->mapping = nullptr;
+
+#ifdef MEMORY_POOL_MMAP
+  // The pool's address space is only reserved here, and made usable an extent at a time as blocks reach it.
+  // Anonymous pages are zero-filled by the system the first time they are touched, so a pool only takes up the
+  // memory its blocks have reached. Pages are aligned far beyond any block alignment short of a page.
+  std::size_t pageSize = sysconf(_SC_PAGESIZE);
+  std::size_t slack = blockAlignment > pageSize ? blockAlignment : 0;
+
+#ifdef MAP_HUGETLB
+  if (pages == HUGETLB_PAGES)
+  {
+    mappedSize = roundUp(maxPoolSize + slack, hugePageSize);
+    mapping = mmap(nullptr, mappedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    // Huge pages are taken from the system's reserve as the pool is mapped (not as it is touched), so a pool that
+    // doesn't fit in it fails here and not later.
+    if (mapping == MAP_FAILED)
+    {
+      // Not enough huge pages reserved with the system, ask for transparent ones instead.
+      mapping = nullptr;
+      pages = HUGE_PAGES;
+    }
+    else
+    {
+      this->pages = HUGETLB_PAGES;
+    }
+  }
+#endif
+
+  if (mapping == nullptr)
+  {
+    mappedSize = roundUp(maxPoolSize + slack, pageSize);
+    mapping = mmap(nullptr, mappedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+      mapping = nullptr;
+      std::cout << "Error: Could not map memory for the pool (" << maxPoolSize << " bytes)." << '\n';
+      throw std::bad_alloc();
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (pages != NORMAL_PAGES && madvise(mapping, mappedSize, MADV_HUGEPAGE) == 0)
+    {
+      this->pages = HUGE_PAGES;
+    }
+#endif
+  }
+#else
+  // Without mmap, the pool has to be allocated and cleared by hand, and only gets the usual pages. Its extents are
+  // still taken out of the budget as blocks reach them.
+  (void)pages;
+  std::size_t slack = blockAlignment > 1 ? blockAlignment : 0;
+  mappedSize = maxPoolSize + slack;
+  mapping = operator new(mappedSize);
+  std::memset(mapping, '\0', mappedSize);
+#endif
+
+  pool = (void *)roundUp((std::size_t)mapping, blockAlignment);
+}
+
+bool MemoryPool::commitUpTo(std::size_t size)
+{
+  // Extents are counted from the start of the mapping, which is aligned to them.
+  std::size_t end = ((char *)pool - (char *)mapping) + size;
+  if (end <= committedSize)
   {
-    // Update variables
-    sizeUsed += blockSize;
-    block = (char *)pool + allocated * blockSize; // Set current block pointer to new block.
-    blockSizeUsed = 0;                    // Reset offset to 0.
-    allocated += 1;
     return true;
   }
+
+  std::size_t newCommittedSize = std::min(roundUp(end, extentSize), mappedSize);
+  std::size_t growth = newCommittedSize - committedSize;
+  if (budget != nullptr && !budget->reserve(growth))
+  {
+    std::cout << "Error: Memory budget used up (" << budget->getUsed() << "/" << budget->getLimit() << " committed), no memory left to allocate new block." << '\n';
+    return false;
+  }
+
+#ifdef MEMORY_POOL_MMAP
+  if (mprotect((char *)mapping + committedSize, growth, PROT_READ | PROT_WRITE) != 0)
+  {
+    if (budget != nullptr)
+    {
+      budget->release(growth);
+    }
+    std::cout << "Error: Could not commit memory to the pool (" << committedSize << " bytes committed)." << '\n';
+    return false;
+  }
+#endif
+
+  committedSize = newCommittedSize;
+  return true;
+}
+
+bool MemoryPool::allocateBlock()
+{
+  // Reuse a block that was emptied before, if any.
+  if (!freeBlocks.empty())
+  {
+    block = freeBlocks.back();
+    freeBlocks.pop_back();
+    isBlockFree[indexOf(block)] = false;
+    blockSizesUsed[indexOf(block)] = 0;
+  }
+  // Else only allocate a new block if we don't exceed maxPoolSize, committing memory for it if it needs more.
+  else if (nextBlock * blockStride + blockSize <= maxPoolSize)
+  {
+    if (!commitUpTo(nextBlock * blockStride + blockSize))
+    {
+      return false;
+    }
+
+    block = blockAt(nextBlock); // Set current block pointer to new block.
+    nextBlock += 1;
+    isBlockFree.push_back(false);
+    blockSizesUsed.push_back(0);
+  }
   else
   {
     std::cout << "Error: No memory left to allocate new block (" << sizeUsed << "/" << maxPoolSize << " used)." << '\n';
     return false;
   }
+
+  // Update variables
+  sizeUsed += blockSize;
+  blockSizeUsed = 0; // Reset offset to 0.
+  allocated += 1;
+  return true;
 }
 
 Address MemoryPool::allocate(std::size_t sizeRequired)
 {
+  // Take it from the size class with the smallest blocks that fit, if that isn't this pool's own.
+  MemoryPool *sizeClass = classFor(sizeRequired);
+  if (sizeClass != this)
+  {
+    return sizeClass->allocate(sizeRequired);
+  }
+
   // If record size exceeds block size, throw an error.
   if (sizeRequired > blockSize)
   {
@@ -59,7 +231,7 @@ Address MemoryPool::allocate(std::size_t sizeRequired)
   }
 
   // If no current block, or record can't fit into current block, make a new block.
-  if (allocated == 0 || (blockSizeUsed + sizeRequired > blockSize))
+  if (block == nullptr || (blockSizeUsed + sizeRequired > blockSize))
   {
     bool isSuccessful = allocateBlock();
     if (!isSuccessful)
@@ -73,6 +245,7 @@ Address MemoryPool::allocate(std::size_t sizeRequired)
 
   blockSizeUsed += sizeRequired;
   actualSizeUsed += sizeRequired;
+  blockSizesUsed[indexOf(block)] = blockSizeUsed;
 
   // Return the new memory space to put in the record.
   Address recordAddress = {block, offset};
@@ -82,26 +255,28 @@ Address MemoryPool::allocate(std::size_t sizeRequired)
 
 bool MemoryPool::deallocate(Address address, std::size_t sizeToDelete)
 {
+  MemoryPool *sizeClass = classOf(address.blockAddress);
+  if (sizeClass != this)
+  {
+    return sizeClass->deallocate(address, sizeToDelete);
+  }
+
   try
   {
     // Remove record from block.
+    decompressSegment(address.blockAddress);
     void *addressToDelete = (char *)address.blockAddress + address.offset;
+    if (codec != nullptr)
+    {
+      sizeToDelete = codec->encodedSize((unsigned char *)addressToDelete);
+    }
     std::memset(addressToDelete, '\0', sizeToDelete);
 
     // Update actual size used.
     actualSizeUsed -= sizeToDelete;
 
-    // If block is empty, just remove the size of the block (but don't deallocate block!).
-    // Create a new test block full of NULL to test against the actual block to see if it's empty.
-    unsigned char testBlock[blockSize];
-    memset(testBlock, '\0', blockSize);
-
-    // Block is empty, remove size of block.
-    if (memcmp(testBlock, address.blockAddress, blockSize) == 0)
-    {
-      sizeUsed -= blockSize;
-      allocated--;
-    }
+    // If block is empty, give it back to the pool.
+    freeBlockIfEmpty(address.blockAddress);
 
     return true;
   }
@@ -112,11 +287,686 @@ bool MemoryPool::deallocate(Address address, std::size_t sizeToDelete)
   };
 }
 
+int MemoryPool::deallocateAll(std::vector<Address> addresses, std::size_t sizeToDelete)
+{
+  int blocksFreed = 0;
+
+  // Hand the records in other size classes over to them, and keep our own.
+  if (!sizeClasses.empty())
+  {
+    std::vector<Address> ownAddresses;
+    std::vector<std::vector<Address>> classAddresses(sizeClasses.size());
+    for (const Address &address : addresses)
+    {
+      MemoryPool *sizeClass = classOf(address.blockAddress);
+      for (int c = 0; c < (int)sizeClasses.size(); c++)
+      {
+        if (sizeClasses[c].get() == sizeClass)
+        {
+          classAddresses[c].push_back(address);
+        }
+      }
+      if (sizeClass == this)
+      {
+        ownAddresses.push_back(address);
+      }
+    }
+
+    for (int c = 0; c < (int)sizeClasses.size(); c++)
+    {
+      if (!classAddresses[c].empty())
+      {
+        blocksFreed += sizeClasses[c]->deallocateAll(classAddresses[c], sizeToDelete);
+      }
+    }
+    addresses.swap(ownAddresses);
+  }
+
+  // Sort records by block, so all records of a block are next to each other.
+  std::sort(addresses.begin(), addresses.end(), [](const Address &a, const Address &b)
+  {
+    return a.blockAddress < b.blockAddress;
+  });
+
+  for (int i = 0; i < (int)addresses.size(); i++)
+  {
+    // Remove record from block.
+    decompressSegment(addresses[i].blockAddress);
+    char *addressToDelete = (char *)addresses[i].blockAddress + addresses[i].offset;
+    std::size_t recordSize = codec != nullptr ? codec->encodedSize((unsigned char *)addressToDelete) : sizeToDelete;
+    std::memset(addressToDelete, '\0', recordSize);
+    actualSizeUsed -= recordSize;
+
+    // After the last record of this block, check once if the block is now empty.
+    if (i + 1 == (int)addresses.size() || addresses[i + 1].blockAddress != addresses[i].blockAddress)
+    {
+      if (freeBlockIfEmpty(addresses[i].blockAddress))
+      {
+        blocksFreed++;
+      }
+    }
+  }
+
+  return blocksFreed;
+}
+
+bool MemoryPool::freeBlockIfEmpty(void *blockAddress)
+{
+  // Block was already given back (e.g. deallocated twice), nothing to do.
+  int blockIndex = indexOf(blockAddress);
+  if (isBlockFree[blockIndex])
+  {
+    return false;
+  }
+
+  // Create a new test block full of NULL to test against the actual block to see if it's empty.
+  unsigned char testBlock[blockSize];
+  memset(testBlock, '\0', blockSize);
+
+  if (memcmp(testBlock, blockAddress, blockSize) != 0)
+  {
+    return false;
+  }
+
+  // Block is empty, remove size of block and keep it for reuse.
+  sizeUsed -= blockSize;
+  allocated--;
+  freeBlocks.push_back(blockAddress);
+  isBlockFree[blockIndex] = true;
+
+  // If we emptied the block we are inserting to, the next allocation has to take a block again.
+  if (blockAddress == block)
+  {
+    block = nullptr;
+  }
+
+  return true;
+}
+
+void MemoryPool::forEachBlock(const std::function<void(const void *)> &visit)
+{
+  BlockIterator blocks = scanBlocks();
+  while (blocks.next())
+  {
+    visit(blocks.getBlockData());
+  }
+}
+
+MemoryPool::BlockIterator MemoryPool::scanBlocks(int readahead)
+{
+  return BlockIterator(this, readahead);
+}
+
+MemoryPool::RecordIterator MemoryPool::scanRecords(std::size_t recordSize, const std::function<bool(const void *)> &predicate, int readahead)
+{
+  return RecordIterator(this, recordSize, predicate, readahead);
+}
+
+MemoryPool::BlockIterator::BlockIterator(MemoryPool *memoryPool, int readahead)
+{
+  this->memoryPool = memoryPool;
+  this->readahead = std::max(0, readahead);
+  this->blockIndex = -1;
+}
+
+bool MemoryPool::BlockIterator::next()
+{
+  // Skip the blocks sitting in the free list.
+  do
+  {
+    blockIndex++;
+  } while (blockIndex < memoryPool->nextBlock && memoryPool->isBlockFree[blockIndex]);
+
+  if (blockIndex >= memoryPool->nextBlock)
+  {
+    return false;
+  }
+
+  // Ask for the block readahead steps ahead, a cache line at a time, so it's there by the time we get to it.
+  int aheadIndex = blockIndex + readahead;
+  if (readahead > 0 && aheadIndex < memoryPool->nextBlock)
+  {
+    const char *ahead = memoryPool->blockAt(aheadIndex);
+    for (std::size_t line = 0; line < memoryPool->blockSize; line += 64)
+    {
+      prefetch(ahead + line);
+    }
+  }
+
+  // A block of a compressed segment is read through the cache.
+  copy.clear();
+  if (memoryPool->numCompressed > 0 && memoryPool->isCompressed(getBlock()))
+  {
+    Address blockStart{getBlock(), 0};
+    copy.resize(memoryPool->blockSize);
+    memoryPool->readCompressed(blockStart, copy.data(), memoryPool->blockSize);
+  }
+
+  // Update blocks accessed
+  memoryPool->blocksAccessed++;
+
+  return true;
+}
+
+MemoryPool::RecordIterator::RecordIterator(MemoryPool *memoryPool, std::size_t recordSize, const std::function<bool(const void *)> &predicate, int readahead)
+    : blocks(memoryPool, readahead)
+{
+  this->recordSize = recordSize;
+  this->predicate = predicate;
+  this->offset = 0;
+  this->inBlock = false;
+  this->codec = memoryPool->codec;
+  this->decodedIndex = 0;
+}
+
+bool MemoryPool::RecordIterator::isLive(const char *slot) const
+{
+  for (std::size_t i = 0; i < recordSize; i++)
+  {
+    if (slot[i] != '\0')
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MemoryPool::RecordIterator::next()
+{
+  if (codec != nullptr)
+  {
+    return nextDecoded();
+  }
+
+  while (true)
+  {
+    // Step past the current record, or start on the next block.
+    if (inBlock)
+    {
+      offset += recordSize;
+    }
+    else
+    {
+      if (!blocks.next())
+      {
+        return false;
+      }
+      inBlock = true;
+      offset = 0;
+    }
+
+    if (offset + recordSize > blocks.getBlockSizeUsed())
+    {
+      inBlock = false;
+      continue;
+    }
+
+    const char *slot = (const char *)blocks.getBlockData() + offset;
+    if (isLive(slot) && (!predicate || predicate(slot)))
+    {
+      return true;
+    }
+  }
+}
+
+bool MemoryPool::RecordIterator::nextDecoded()
+{
+  while (true)
+  {
+    // Step past the current record, or decode the whole of the next block.
+    if (inBlock)
+    {
+      decodedIndex++;
+    }
+    else
+    {
+      if (!blocks.next())
+      {
+        return false;
+      }
+      inBlock = true;
+      decoded.clear();
+      decodedOffsets.clear();
+      codec->decodeBlock(blocks.getBlockData(), blocks.getBlockSizeUsed(), decoded, &decodedOffsets);
+      decodedIndex = 0;
+    }
+
+    if (decodedIndex >= (int)decoded.size())
+    {
+      inBlock = false;
+      continue;
+    }
+
+    offset = decodedOffsets[decodedIndex];
+    if (!predicate || predicate(&decoded[decodedIndex]))
+    {
+      return true;
+    }
+  }
+}
+
+void MemoryPool::setCodec(const RecordCodec *codec)
+{
+  if (actualSizeUsed != 0)
+  {
+    throw std::logic_error("Codec must be set before anything is saved!");
+  }
+  if (codec != nullptr && !sizeClasses.empty())
+  {
+    throw std::logic_error("A pool with size classes can't have a codec!");
+  }
+
+  this->codec = codec;
+}
+
+void MemoryPool::setBudget(MemoryBudget *budget)
+{
+  if (getCommittedSize() != 0)
+  {
+    throw std::logic_error("Budget must be set before anything is allocated!");
+  }
+
+  this->budget = budget;
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    sizeClass->setBudget(budget);
+  }
+}
+
+void MemoryPool::addSizeClass(std::size_t blockSize, std::size_t maxSlabSize)
+{
+  if (codec != nullptr)
+  {
+    throw std::logic_error("A pool with a codec can't have size classes!");
+  }
+  if (blockSize == this->blockSize || getBlockSizeFor(blockSize) == blockSize)
+  {
+    throw std::invalid_argument("Pool already has a size class with this block size!");
+  }
+
+  // Keep the classes sorted by block size, so the first one that fits is the smallest.
+  std::unique_ptr<MemoryPool> sizeClass(new MemoryPool(maxSlabSize, blockSize, blockAlignment, pages));
+  sizeClass->budget = budget;
+  auto position = std::find_if(sizeClasses.begin(), sizeClasses.end(), [&](const std::unique_ptr<MemoryPool> &other)
+  {
+    return other->blockSize > blockSize;
+  });
+  sizeClasses.insert(position, std::move(sizeClass));
+}
+
+std::size_t MemoryPool::getBlockSizeFor(std::size_t sizeRequired) const
+{
+  std::size_t fittingSize = blockSize;
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    if (sizeClass->blockSize >= sizeRequired && (sizeClass->blockSize < fittingSize || fittingSize < sizeRequired))
+    {
+      fittingSize = sizeClass->blockSize;
+    }
+  }
+  return fittingSize;
+}
+
+MemoryPool *MemoryPool::classFor(std::size_t sizeRequired)
+{
+  std::size_t fittingSize = getBlockSizeFor(sizeRequired);
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    if (sizeClass->blockSize == fittingSize)
+    {
+      return sizeClass.get();
+    }
+  }
+  return this;
+}
+
+MemoryPool *MemoryPool::classOf(void *blockAddress)
+{
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    char *slab = (char *)sizeClass->pool;
+    if ((char *)blockAddress >= slab && (char *)blockAddress < slab + sizeClass->maxPoolSize)
+    {
+      return sizeClass.get();
+    }
+  }
+  return this;
+}
+
+std::size_t MemoryPool::getSizeUsed() const
+{
+  std::size_t total = sizeUsed;
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    total += sizeClass->getSizeUsed();
+  }
+  return total;
+}
+
+std::size_t MemoryPool::getActualSizeUsed() const
+{
+  std::size_t total = actualSizeUsed;
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    total += sizeClass->getActualSizeUsed();
+  }
+  return total;
+}
+
+std::size_t MemoryPool::getCommittedSize() const
+{
+  std::size_t total = committedSize;
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    total += sizeClass->getCommittedSize();
+  }
+  return total;
+}
+
+int MemoryPool::getAllocated() const
+{
+  int total = allocated;
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    total += sizeClass->getAllocated();
+  }
+  return total;
+}
+
+int MemoryPool::getBlocksAccessed() const
+{
+  int total = blocksAccessed;
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    total += sizeClass->getBlocksAccessed();
+  }
+  return total;
+}
+
+int MemoryPool::resetBlocksAccessed()
+{
+  int total = blocksAccessed.exchange(0);
+  for (const std::unique_ptr<MemoryPool> &sizeClass : sizeClasses)
+  {
+    total += sizeClass->resetBlocksAccessed();
+  }
+  return total;
+}
+
+int MemoryPool::compressSegments(int segmentBlocks, int cacheSegments)
+{
+  if (codec == nullptr)
+  {
+    throw std::logic_error("Segments can only be compressed in a pool with a codec!");
+  }
+  segmentBlocks = std::max(1, segmentBlocks);
+
+  // Segments compressed with another size go back into the pool first.
+  if (segmentBlocks != this->segmentBlocks)
+  {
+    for (int s = 0; s < (int)compressedSegments.size(); s++)
+    {
+      decompressSegment(blockAt(s * this->segmentBlocks));
+    }
+    compressedSegments.clear();
+  }
+
+  this->segmentBlocks = segmentBlocks;
+  this->cacheSegments = std::max(1, cacheSegments);
+  {
+    std::lock_guard<std::mutex> lock(segmentCacheMutex);
+    segmentCache.clear();
+  }
+
+  int numSegments = nextBlock / segmentBlocks;
+  if ((int)compressedSegments.size() < numSegments)
+  {
+    compressedSegments.resize(numSegments);
+  }
+
+  // Blocks padded out to their alignment are gathered back to back first, the way the codec takes them.
+  std::vector<char> gathered;
+
+  int segmentsCompressed = 0;
+  for (int s = 0; s < numSegments; s++)
+  {
+    char *segment = blockAt(s * segmentBlocks);
+    bool isCold = compressedSegments[s].empty();
+    for (int b = 0; isCold && b < segmentBlocks; b++)
+    {
+      isCold = !isBlockFree[s * segmentBlocks + b] && segment + b * blockStride != block;
+    }
+    if (!isCold)
+    {
+      continue;
+    }
+
+    const char *blocks = segment;
+    if (blockStride != blockSize)
+    {
+      gathered.resize(segmentBlocks * blockSize);
+      for (int b = 0; b < segmentBlocks; b++)
+      {
+        std::memcpy(gathered.data() + b * blockSize, segment + b * blockStride, blockSize);
+      }
+      blocks = gathered.data();
+    }
+
+    // Only keep it compressed if that saves space.
+    std::vector<unsigned char> &compressed = compressedSegments[s];
+    codec->compressBlocks(blocks, segmentBlocks, blockSize, compressed);
+    if (compressed.size() >= segmentBlocks * blockSize)
+    {
+      std::vector<unsigned char>().swap(compressed);
+      continue;
+    }
+    compressed.shrink_to_fit();
+
+    // Its blocks are given up, reads go to the compressed copy from now on. The pages they leave holding nothing but
+    // compressed segments go back to the system, and read as zeroes if they are touched again.
+    compressedSizeUsed += compressed.size();
+    numCompressed++;
+    segmentsCompressed++;
+
+    std::pair<char *, char *> pages = releasablePages(s);
+    if (pages.first != pages.second)
+    {
+#ifdef MEMORY_POOL_MMAP
+      if (madvise(pages.first, pages.second - pages.first, MADV_DONTNEED) == 0)
+      {
+        releasedSize += pages.second - pages.first;
+      }
+      else
+      {
+        std::cout << "Error: Could not give back the pages of a compressed segment, they stay in memory." << '\n';
+      }
+#endif
+    }
+  }
+
+  return segmentsCompressed;
+}
+
+std::size_t MemoryPool::getFootprint() const
+{
+  std::lock_guard<std::mutex> lock(segmentCacheMutex);
+  std::size_t segmentSize = segmentBlocks * blockSize;
+  // Blocks of compressed segments only stop taking up memory once their pages are given back.
+  std::size_t releasedBlocksSize = releasedSize / blockStride * blockSize;
+  return getSizeUsed() - releasedBlocksSize + compressedSizeUsed + segmentCache.size() * segmentSize;
+}
+
+std::size_t MemoryPool::getPageSize() const
+{
+#ifdef MEMORY_POOL_MMAP
+  if (pages == HUGETLB_PAGES)
+  {
+    return hugePageSize;
+  }
+  return sysconf(_SC_PAGESIZE);
+#else
+  return 1;
+#endif
+}
+
+std::pair<char *, char *> MemoryPool::releasablePages(int segment) const
+{
+  std::size_t pageSize = getPageSize();
+  std::size_t segmentSize = segmentBlocks * blockStride;
+  std::size_t start = (std::size_t)blockAt(segment * segmentBlocks);
+  std::size_t end = start + segmentSize;
+
+  // The pages inside the segment only hold it. A page it shares can go if the other segments on it are compressed.
+  std::size_t first = start / pageSize * pageSize;
+  if (first < start)
+  {
+    bool othersCompressed = first >= (std::size_t)pool;
+    for (int s = othersCompressed ? (first - (std::size_t)pool) / segmentSize : segment; s < segment; s++)
+    {
+      othersCompressed = othersCompressed && !compressedSegments[s].empty();
+    }
+    if (!othersCompressed)
+    {
+      first += pageSize;
+    }
+  }
+
+  std::size_t last = roundUp(end, pageSize);
+  if (last > end)
+  {
+    bool othersCompressed = true;
+    for (int s = segment + 1; othersCompressed && s <= (int)((last - 1 - (std::size_t)pool) / segmentSize); s++)
+    {
+      othersCompressed = s < (int)compressedSegments.size() && !compressedSegments[s].empty();
+    }
+    if (!othersCompressed)
+    {
+      last -= pageSize;
+    }
+  }
+
+  if (last <= first)
+  {
+    return std::make_pair(nullptr, nullptr);
+  }
+  return std::make_pair((char *)first, (char *)last);
+}
+
+bool MemoryPool::isCompressed(void *blockAddress) const
+{
+  if (segmentBlocks == 0)
+  {
+    return false;
+  }
+
+  std::size_t segment = indexOf(blockAddress) / segmentBlocks;
+  return segment < compressedSegments.size() && !compressedSegments[segment].empty();
+}
+
+void MemoryPool::readCompressed(Address address, void *data, std::size_t size)
+{
+  int blockIndex = indexOf(address.blockAddress);
+  int segment = blockIndex / segmentBlocks;
+
+  std::lock_guard<std::mutex> lock(segmentCacheMutex);
+
+  // Look for the segment in the cache, moving it to the back (most recently used) if it's there.
+  auto cached = std::find_if(segmentCache.begin(), segmentCache.end(), [&](const std::pair<int, std::vector<char>> &entry)
+  {
+    return entry.first == segment;
+  });
+  if (cached != segmentCache.end())
+  {
+    std::rotate(cached, cached + 1, segmentCache.end());
+  }
+  else
+  {
+    if ((int)segmentCache.size() >= cacheSegments)
+    {
+      segmentCache.erase(segmentCache.begin());
+    }
+    segmentCache.push_back(std::make_pair(segment, std::vector<char>(segmentBlocks * blockSize)));
+    codec->decompressBlocks(compressedSegments[segment].data(), segmentBlocks, blockSize, segmentCache.back().second.data());
+  }
+
+  const char *block = segmentCache.back().second.data() + (blockIndex - segment * segmentBlocks) * blockSize;
+  std::memcpy(data, block + address.offset, size);
+}
+
+void MemoryPool::decompressSegment(void *blockAddress)
+{
+  if (numCompressed == 0 || !isCompressed(blockAddress))
+  {
+    return;
+  }
+
+  int segment = indexOf(blockAddress) / segmentBlocks;
+  char *segmentStart = blockAt(segment * segmentBlocks);
+
+  // Its pages that were given back are taken up again as it is written to.
+#ifdef MEMORY_POOL_MMAP
+  std::pair<char *, char *> pages = releasablePages(segment);
+  releasedSize -= std::min(releasedSize, (std::size_t)(pages.second - pages.first));
+#endif
+
+  if (blockStride == blockSize)
+  {
+    codec->decompressBlocks(compressedSegments[segment].data(), segmentBlocks, blockSize, segmentStart);
+  }
+  else
+  {
+    // Blocks come out back to back, and are spread back out to their aligned places.
+    std::vector<char> blocks(segmentBlocks * blockSize);
+    codec->decompressBlocks(compressedSegments[segment].data(), segmentBlocks, blockSize, blocks.data());
+    for (int b = 0; b < segmentBlocks; b++)
+    {
+      std::memcpy(segmentStart + b * blockStride, blocks.data() + b * blockSize, blockSize);
+    }
+  }
+
+  compressedSizeUsed -= compressedSegments[segment].size();
+  std::vector<unsigned char>().swap(compressedSegments[segment]);
+  numCompressed--;
+
+  std::lock_guard<std::mutex> lock(segmentCacheMutex);
+  segmentCache.erase(std::remove_if(segmentCache.begin(), segmentCache.end(), [&](const std::pair<int, std::vector<char>> &entry)
+  {
+    return entry.first == segment;
+  }), segmentCache.end());
+}
+
 // Give a block address, offset and size, returns the data there.
 void *MemoryPool::loadFromDisk(Address address, std::size_t size)
 {
+  MemoryPool *sizeClass = classOf(address.blockAddress);
+  if (sizeClass != this)
+  {
+    return sizeClass->loadFromDisk(address, size);
+  }
+
   void *mainMemoryAddress = operator new(size);
-  std::memcpy(mainMemoryAddress, (char *)address.blockAddress + address.offset, size);
+  if (numCompressed > 0 && isCompressed(address.blockAddress))
+  {
+    // Read the bytes through the cache, and decode them if they are a record.
+    if (codec != nullptr && size == sizeof(Record))
+    {
+      unsigned char encoded[RecordCodec::maxEncodedSize];
+      readCompressed(address, encoded, std::min(sizeof(encoded), blockSize - address.offset));
+      codec->decode(encoded, *(Record *)mainMemoryAddress);
+    }
+    else
+    {
+      readCompressed(address, mainMemoryAddress, size);
+    }
+  }
+  else if (codec != nullptr && size == sizeof(Record))
+  {
+    codec->decode((unsigned char *)address.blockAddress + address.offset, *(Record *)mainMemoryAddress);
+  }
+  else
+  {
+    std::memcpy(mainMemoryAddress, (char *)address.blockAddress + address.offset, size);
+  }
 
   // Update blocks accessed
   blocksAccessed++;
@@ -124,9 +974,42 @@ void *MemoryPool::loadFromDisk(Address address, std::size_t size)
   return mainMemoryAddress;
 }
 
+void MemoryPool::readBlock(void *blockAddress, void *data)
+{
+  MemoryPool *sizeClass = classOf(blockAddress);
+  if (sizeClass != this)
+  {
+    sizeClass->readBlock(blockAddress, data);
+    return;
+  }
+
+  if (numCompressed > 0 && isCompressed(blockAddress))
+  {
+    Address blockStart{blockAddress, 0};
+    readCompressed(blockStart, data, blockSize);
+  }
+  else
+  {
+    std::memcpy(data, blockAddress, blockSize);
+  }
+}
+
 // Saves something into the disk. Returns disk address.
 Address MemoryPool::saveToDisk(void *itemAddress, std::size_t size)
 {
+  MemoryPool *sizeClass = classFor(size);
+  if (sizeClass != this)
+  {
+    return sizeClass->saveToDisk(itemAddress, size);
+  }
+
+  unsigned char encoded[RecordCodec::maxEncodedSize];
+  if (codec != nullptr)
+  {
+    size = codec->encode(*(Record *)itemAddress, encoded);
+    itemAddress = encoded;
+  }
+
   Address diskAddress = allocate(size);
   std::memcpy((char *)diskAddress.blockAddress + diskAddress.offset, itemAddress, size);
 
@@ -139,6 +1022,26 @@ Address MemoryPool::saveToDisk(void *itemAddress, std::size_t size)
 // Update data in disk if I have already saved it before.
 Address MemoryPool::saveToDisk(void *itemAddress, std::size_t size, Address diskAddress)
 {
+  MemoryPool *sizeClass = classOf(diskAddress.blockAddress);
+  if (sizeClass != this)
+  {
+    return sizeClass->saveToDisk(itemAddress, size, diskAddress);
+  }
+
+  unsigned char encoded[RecordCodec::maxEncodedSize];
+  if (codec != nullptr)
+  {
+    size = codec->encode(*(Record *)itemAddress, encoded);
+    itemAddress = encoded;
+
+    // Records are packed back to back, so one can't grow or shrink in place.
+    decompressSegment(diskAddress.blockAddress);
+    if (size != codec->encodedSize((unsigned char *)diskAddress.blockAddress + diskAddress.offset))
+    {
+      throw std::logic_error("Encoded record no longer fits its place on disk!");
+    }
+  }
+
   std::memcpy((char *)diskAddress.blockAddress + diskAddress.offset, itemAddress, size);
 
   // Update blocks accessed
@@ -147,4 +1050,16 @@ Address MemoryPool::saveToDisk(void *itemAddress, std::size_t size, Address disk
   return diskAddress;
 }
 
-MemoryPool::~MemoryPool(){};
\ No newline at end of file
+MemoryPool::~MemoryPool()
+{
+  if (budget != nullptr)
+  {
+    budget->release(committedSize);
+  }
+
+#ifdef MEMORY_POOL_MMAP
+  munmap(mapping, mappedSize);
+#else
+  operator delete(mapping);
+#endif
+}
\ No newline at end of file
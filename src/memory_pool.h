@@ -6,18 +6,113 @@
 #include <vector>
 #include <unordered_map>
 #include <tuple>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <memory>
+
+class RecordCodec;
+class MemoryBudget;
 
 class MemoryPool
 {
 public:
+  // Walks the blocks in use in address order, hinting the CPU to fetch the blocks a few steps ahead.
+  // Get one with scanBlocks(). The pool must not allocate or free blocks while an iterator is in use.
+  class BlockIterator
+  {
+  private:
+    MemoryPool *memoryPool; // Pool being walked.
+    int readahead;          // Number of blocks ahead to prefetch.
+    int blockIndex;         // Index of the current block (-1 before the first call to next()).
+    std::vector<char> copy; // Decompressed copy of the current block, if its segment is compressed.
+
+  public:
+    BlockIterator(MemoryPool *memoryPool, int readahead);
+
+    // Moves on to the next block in use. Returns false once there are no more blocks.
+    bool next();
+
+    // Returns the address of the current block in the pool.
+    void *getBlock() const
+    {
+      return memoryPool->blockAt(blockIndex);
+    }
+
+    // Returns the contents of the current block: the block itself, or a decompressed copy if its segment is compressed.
+    const void *getBlockData() const
+    {
+      return copy.empty() ? getBlock() : copy.data();
+    }
+
+    // Returns the number of bytes handed out in the current block. Slots past this were never allocated.
+    std::size_t getBlockSizeUsed() const
+    {
+      return memoryPool->blockSizesUsed[blockIndex];
+    }
+  };
+
+  // Walks the live fixed-size records of the pool in address order, skipping slots that were never allocated or
+  // were deallocated (all zero), and the records a predicate turns down. Get one with scanRecords().
+  // In a pool with a codec, each block is decoded in one go as we get to it, and records are handed out decoded.
+  class RecordIterator
+  {
+  private:
+    BlockIterator blocks;                         // Blocks being walked.
+    std::size_t recordSize;                       // Size of each record, which sets where the slots are.
+    std::function<bool(const void *)> predicate;  // Records it returns false for are skipped (none if empty).
+    std::size_t offset;                           // Offset of the current record in the current block.
+    bool inBlock;                                 // Whether blocks is on a block we haven't finished.
+
+    const RecordCodec *codec;                     // Codec of the pool (null if records are stored as they are).
+    std::vector<Record> decoded;                  // Records of the current block, decoded.
+    std::vector<short int> decodedOffsets;        // Offset of each decoded record in the current block.
+    int decodedIndex;                             // Index of the current record in decoded.
+
+    // Returns whether the slot at offset holds a record (deallocation zeroes a slot).
+    bool isLive(const char *slot) const;
+
+    // Moves on to the next record that passes the predicate in a pool with a codec.
+    bool nextDecoded();
+
+  public:
+    RecordIterator(MemoryPool *memoryPool, std::size_t recordSize, const std::function<bool(const void *)> &predicate, int readahead);
+
+    // Moves on to the next live record that passes the predicate. Returns false once there are no more records.
+    bool next();
+
+    // Returns the address of the current record.
+    Address getAddress() const
+    {
+      Address address{blocks.getBlock(), (short int)offset};
+      return address;
+    }
+
+    // Returns the current record, in the pool itself (not a copy) unless compressed, or decoded if the pool has a codec.
+    const void *getRecord() const
+    {
+      if (codec != nullptr)
+      {
+        return &decoded[decodedIndex];
+      }
+      return (const char *)blocks.getBlockData() + offset;
+    }
+  };
+
   // =============== Methods ================ //
 
   // Creates a new memory pool with the following parameters:
-  // maxPoolSize: Maximum size of the memory pool.
+  // maxPoolSize: Maximum size of the memory pool. Address space is reserved for all of it, but memory is only
+  // committed to the pool a few MB at a time, as its blocks reach it.
   // blockSize: The fixed size of each block in the pool.
-  MemoryPool(std::size_t maxPoolSize, std::size_t blockSize);
+  // blockAlignment: Each block starts on a multiple of this (a power of two, e.g. 64 for a cache line or 4096 for a
+  // page), blocks being padded out to it.
+  // pages: The pages the pool is mapped with. Huge pages the system can't give fall back to the usual ones.
+  // The pool's memory is mapped rather than allocated and cleared up front, so only the pages blocks have reached
+  // take up memory.
+  MemoryPool(std::size_t maxPoolSize, std::size_t blockSize, std::size_t blockAlignment = 1, PoolPages pages = NORMAL_PAGES);
 
-  // Allocate a new block from the memory pool. Returns false if error.
+  // Allocate a new block from the memory pool. Returns false if error (the pool is full, or its budget is used up).
   bool allocateBlock();
 
   // Allocates a new chunk to the memory pool. Creates a new block if chunk is unable to fit in current free block.
@@ -25,17 +120,88 @@ public:
   Address allocate(std::size_t sizeRequired);
 
   // Deallocates an existing record and block if block becomes empty. Returns false if error.
+  // With a codec, the record's encoded size is used in place of sizeToDelete.
   bool deallocate(Address address, std::size_t sizeToDelete);
 
+  // Deallocates many records of the same size at once. Records are grouped by block, so each block is checked
+  // (and freed if it became empty) only once. Returns the number of blocks freed. With a codec, each record's
+  // encoded size is used in place of sizeToDelete.
+  int deallocateAll(std::vector<Address> addresses, std::size_t sizeToDelete);
+
   // Give a block address, offset and size, returns the data there.
+  // With a codec, loading sizeof(Record) bytes decodes the record at the address. Other sizes (e.g. a whole block)
+  // are copied as they are on disk.
   void *loadFromDisk(Address address, std::size_t size);
 
-  // Save data to the disk given a main memory address.
+  // Copies the whole of a block into data, as it reads before any compression (through the segment cache, like
+  // loadFromDisk). Unlike loadFromDisk, this doesn't count as an access, as it's only used to display blocks.
+  void readBlock(void *blockAddress, void *data);
+
+  // Save data to the disk given a main memory address. With a codec, the data is a Record and is saved encoded.
   Address saveToDisk(void *itemAddress, std::size_t size);
 
-  // Update data in disk if I have already saved it before.
+  // Update data in disk if I have already saved it before. With a codec, the record must encode to the same size.
   Address saveToDisk(void *itemAddress, std::size_t size, Address diskAddress);
 
+  // Stores records through a codec from now on (or as they are, if null). Only a pool holding nothing but records
+  // can have one, and it must be set before anything is saved.
+  void setCodec(const RecordCodec *codec);
+
+  // Returns the codec records are stored with (null if they are stored as they are).
+  const RecordCodec *getCodec() const
+  {
+    return codec;
+  }
+
+  // Takes the memory committed to the pool (and its size classes) out of a budget from now on, which other pools
+  // may share (or out of none, if null). It must be set before anything is allocated.
+  void setBudget(MemoryBudget *budget);
+
+  // Returns the budget the pool's memory is taken out of (null if none).
+  MemoryBudget *getBudget() const
+  {
+    return budget;
+  }
+
+  // Compresses the cold segments of the pool with its codec: each run of segmentBlocks blocks (starting from the first
+  // block) whose blocks are all in use, other than the one we are inserting to. A compressed segment's blocks read
+  // as before, through a cache of the cacheSegments segments last decompressed, and writing to one of its blocks
+  // decompresses it back into the pool. Each page left holding only compressed segments is given back to the system
+  // (it stays committed, and taken out of the budget, so a segment can always be decompressed back onto it).
+  // Returns the number of segments compressed.
+  int compressSegments(int segmentBlocks = 8, int cacheSegments = 4);
+
+  // Adds a size class to the pool: a slab of its own, of at most maxSlabSize bytes, cut into blocks of blockSize
+  // bytes. From then on, allocating (or saving) takes a block from the class with the smallest blocks that fit the
+  // size asked for, this pool's own blocks being one of the classes. Loading, updating and deallocating go to the
+  // class holding the address. Counts of blocks, sizes and accesses cover every class, while iterators, codecs and
+  // compression only cover this pool's own blocks. A pool with a codec can't have size classes.
+  void addSizeClass(std::size_t blockSize, std::size_t maxSlabSize);
+
+  // Returns the size of the blocks that allocating sizeRequired bytes would take from.
+  std::size_t getBlockSizeFor(std::size_t sizeRequired) const;
+
+  // Returns the size of all compressed segments.
+  std::size_t getCompressedSizeUsed() const
+  {
+    return compressedSizeUsed;
+  }
+
+  // Returns the memory the blocks in use really take up: blocks other than those on the pages given back to the
+  // system after compression, compressed segments, and the segments sitting decompressed in the cache.
+  std::size_t getFootprint() const;
+
+  // Calls visit on the contents of every block in use, in address order. Each block visited counts as an access.
+  void forEachBlock(const std::function<void(const void *)> &visit);
+
+  // Returns an iterator over the blocks in use, in address order, prefetching readahead blocks ahead.
+  // Each block visited counts as an access.
+  BlockIterator scanBlocks(int readahead = 2);
+
+  // Returns an iterator over the live records of recordSize bytes each, in address order, that pass a predicate
+  // (all of them if none is given). Only pools holding records of one size can be walked this way.
+  RecordIterator scanRecords(std::size_t recordSize, const std::function<bool(const void *)> &predicate = nullptr, int readahead = 2);
+
   // Returns the maximum size of this memory pool.
   std::size_t getMaxPoolSize() const
   {
@@ -48,6 +214,18 @@ public:
     return blockSize;
   };
 
+  // Returns what each block starts on a multiple of.
+  std::size_t getBlockAlignment() const
+  {
+    return blockAlignment;
+  }
+
+  // Returns the pages the pool really got (which may not be the ones asked for).
+  PoolPages getPages() const
+  {
+    return pages;
+  }
+
   // Returns the size used in the current block.
   std::size_t getBlockSizeUsed() const
   {
@@ -55,34 +233,20 @@ public:
   };
 
   // Returns current size used in memory pool (total blocks size).
-  std::size_t getSizeUsed() const
-  {
-    return sizeUsed;
-  }
+  std::size_t getSizeUsed() const;
 
   // Returns actual size of all records stored in memory pool.
-  std::size_t getActualSizeUsed() const
-  {
-    return actualSizeUsed;
-  }
+  std::size_t getActualSizeUsed() const;
+
+  // Returns the memory committed to the pool (and its size classes) so far.
+  std::size_t getCommittedSize() const;
 
   // Returns number of currently allocated blocks.
-  int getAllocated() const
-  {
-    return allocated;
-  };
+  int getAllocated() const;
 
-  int getBlocksAccessed() const
-  {
-    return blocksAccessed;
-  }
+  int getBlocksAccessed() const;
 
-  int resetBlocksAccessed()
-  {
-    int tempBlocksAccessed = blocksAccessed;
-    blocksAccessed = 0;
-    return tempBlocksAccessed;
-  }
+  int resetBlocksAccessed();
 
   // Destructor
   ~MemoryPool();
@@ -92,15 +256,85 @@ private:
 
   std::size_t maxPoolSize;    // Maximum size allowed for pool.
   std::size_t blockSize;      // Size of each block in pool in bytes.
+  std::size_t blockAlignment; // Each block starts on a multiple of this.
+  std::size_t blockStride;    // Distance between the starts of two blocks: the block size rounded up to the alignment.
   std::size_t sizeUsed;       // Current size used up for storage (total block size).
   std::size_t actualSizeUsed; // Actual size used based on records stored in storage.
   std::size_t blockSizeUsed;  // Size used up within the curent block we are pointing to.
 
-  int allocated;      // Number of currently allocated blocks.
-  int blocksAccessed; // Counts number of blocks accessed.
+  int allocated;                   // Number of currently allocated blocks.
+  std::atomic<int> blocksAccessed; // Counts number of blocks accessed. Atomic since scans may run on several threads.
 
-  void *pool;  // Pointer to the memory pool.
+  void *pool;  // Pointer to the memory pool (its first block).
+  void *mapping;             // Memory mapped (or allocated) for the pool, which starts at the first aligned address in it.
+  std::size_t mappedSize;    // Size of the mapping.
+  std::size_t committedSize; // Size of the start of the mapping that has been committed and can be used.
+  PoolPages pages;           // Pages the pool is mapped with.
   void *block; // Current block pointer we are inserting to.
+
+  const RecordCodec *codec; // Encodes records on the way to disk and decodes them on the way back (null if none).
+  MemoryBudget *budget;     // Budget the pool's committed memory is taken out of (null if none).
+
+  int segmentBlocks;                                              // Number of blocks in a segment (0 if none compressed yet).
+  int cacheSegments;                                              // Number of decompressed segments the cache holds.
+  int numCompressed;                                              // Number of segments currently compressed.
+  std::size_t compressedSizeUsed;                                 // Size of all compressed segments.
+  std::size_t releasedSize;                                       // Size of the pages of compressed segments given back to the system.
+  std::vector<std::vector<unsigned char>> compressedSegments;     // Each segment, compressed (empty if it isn't).
+  std::vector<std::pair<int, std::vector<char>>> segmentCache;    // Decompressed segments, least recently used first.
+  mutable std::mutex segmentCacheMutex;                           // Guards the cache, as scans may run on several threads.
+
+  std::vector<std::unique_ptr<MemoryPool>> sizeClasses; // Slabs of other block sizes, smallest blocks first.
+
+  int nextBlock;                  // Index of the first block in the pool that has never been handed out.
+  std::vector<void *> freeBlocks; // Blocks that were emptied by deallocation, reused before new ones.
+  std::vector<bool> isBlockFree;  // Whether each handed out block is currently sitting in freeBlocks.
+  std::vector<std::size_t> blockSizesUsed; // Bytes handed out in each block since it was last taken from the pool.
+
+  // Maps the memory of the pool, with the given pages if the system has them.
+  void mapPool(PoolPages pages);
+
+  // Commits memory to the pool, a whole extent at a time, until its first size bytes can be used. Returns false if
+  // the budget or the system has no more to give.
+  bool commitUpTo(std::size_t size);
+
+  // Returns the index of the block at blockAddress.
+  int indexOf(const void *blockAddress) const
+  {
+    return ((const char *)blockAddress - (const char *)pool) / blockStride;
+  }
+
+  // Returns the address of the block at index.
+  char *blockAt(int index) const
+  {
+    return (char *)pool + index * blockStride;
+  }
+
+  // Returns the size class to allocate sizeRequired bytes from (this pool if it's its own blocks, or none fit).
+  MemoryPool *classFor(std::size_t sizeRequired);
+
+  // Returns the size class whose slab holds a block (this pool if none of the others do).
+  MemoryPool *classOf(void *blockAddress);
+
+  // Checks if a block is entirely empty, and if so gives it back to the pool. Returns true if block was freed.
+  bool freeBlockIfEmpty(void *blockAddress);
+
+  // Returns whether the segment a block is in is compressed.
+  bool isCompressed(void *blockAddress) const;
+
+  // Copies size bytes at an address in a compressed segment into data, decompressing the segment into the cache
+  // if it isn't there.
+  void readCompressed(Address address, void *data, std::size_t size);
+
+  // Returns the size of the pages the pool's memory can be given back to the system in.
+  std::size_t getPageSize() const;
+
+  // Returns the pages [first, last) overlapping a compressed segment that hold nothing but compressed segments, and
+  // so can be given back to the system (first == last if there are none).
+  std::pair<char *, char *> releasablePages(int segment) const;
+
+  // Decompresses the segment a block is in back into the pool, if it's compressed, so the block can be written to.
+  void decompressSegment(void *blockAddress);
 };
 
 #endif
\ No newline at end of file
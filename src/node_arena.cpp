@@ -0,0 +1,128 @@
+#include "node_arena.h"
+#include "b_plus_tree.h"
+#include "types.h"
+
+#include <new>
+#include <vector>
+#include <algorithm>
+
+// Each node in a chunk is laid out as: its number of keys (so a recycled node goes back to the right free list),
+// the node itself, its keys, then its pointers.
+
+// Rounds size up to a multiple of alignment.
+static std::size_t roundUp(std::size_t size, std::size_t alignment)
+{
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+static const std::size_t headerSize = roundUp(sizeof(int), alignof(Address));
+
+// Constructors
+
+NodeArena::NodeArena(std::size_t chunkSize)
+{
+  this->chunkSize = chunkSize;
+  this->chunkUsed = 0;
+}
+
+// Methods
+
+std::size_t NodeArena::nodeBytes(int maxKeys)
+{
+  std::size_t keysEnd = roundUp(headerSize + sizeof(Node) + maxKeys * sizeof(float), alignof(Address));
+  return roundUp(keysEnd + (maxKeys + 1) * sizeof(Address), alignof(Address));
+}
+
+Node *NodeArena::allocate(int maxKeys)
+{
+  char *memory;
+
+  // Reuse a free node of the same size, or else bump through the last chunk (taking a new one if it's full).
+  std::vector<Node *> &free = freeNodes[maxKeys];
+  if (!free.empty())
+  {
+    memory = (char *)free.back() - headerSize;
+    free.pop_back();
+  }
+  else
+  {
+    std::size_t size = nodeBytes(maxKeys);
+    if (chunks.empty() || chunkUsed + size > chunkSize)
+    {
+      chunks.push_back((char *)operator new(std::max(chunkSize, size)));
+      chunkUsed = 0;
+    }
+
+    memory = chunks.back() + chunkUsed;
+    chunkUsed += size;
+  }
+
+  *(int *)memory = maxKeys;
+  float *keys = (float *)(memory + headerSize + sizeof(Node));
+  Address *pointers = (Address *)(memory + roundUp(headerSize + sizeof(Node) + maxKeys * sizeof(float), alignof(Address)));
+  return new (memory + headerSize) Node(maxKeys, keys, pointers);
+}
+
+void NodeArena::recycle(Node *node)
+{
+  // The node's keys sit right behind the node the arena handed out, whether this is that node or a copy of it.
+  Node *original = (Node *)((char *)node->keys - sizeof(Node));
+  recycledNodes.push_back(original);
+}
+
+void NodeArena::release()
+{
+  if (recycledNodes.empty())
+  {
+    return;
+  }
+
+  // A node can be freed twice in one operation (e.g. a leaf merged away as the root changes), keep it only once.
+  std::sort(recycledNodes.begin(), recycledNodes.end());
+  recycledNodes.erase(std::unique(recycledNodes.begin(), recycledNodes.end()), recycledNodes.end());
+
+  for (Node *node : recycledNodes)
+  {
+    int maxKeys = *(int *)((char *)node - headerSize);
+    freeNodes[maxKeys].push_back(node);
+  }
+  recycledNodes.clear();
+}
+
+float *NodeArena::scratchKeys(int count)
+{
+  if ((int)keyScratch.size() < count)
+  {
+    keyScratch.resize(count);
+  }
+  return keyScratch.data();
+}
+
+Address *NodeArena::scratchPointers(int count)
+{
+  if ((int)pointerScratch.size() < count)
+  {
+    pointerScratch.resize(count);
+  }
+  return pointerScratch.data();
+}
+
+int NodeArena::getNumFree() const
+{
+  int numFree = 0;
+  for (const auto &free : freeNodes)
+  {
+    numFree += free.second.size();
+  }
+  return numFree;
+}
+
+// Destructor
+
+NodeArena::~NodeArena()
+{
+  for (char *chunk : chunks)
+  {
+    operator delete(chunk);
+  }
+}
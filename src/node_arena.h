@@ -0,0 +1,70 @@
+#ifndef NODE_ARENA_H
+#define NODE_ARENA_H
+
+#include "types.h"
+
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+
+class Node;
+
+// Hands out the nodes of a tree, each with its key and pointer arrays right behind it, by bumping through large
+// chunks instead of going to the allocator for every node. Nodes the tree frees are recycled into new nodes with the
+// same number of keys. A freed node may still be read until the operation that freed it is over, so recycled nodes
+// are only handed out again after release(). Also keeps the scratch lists that splits build their keys and pointers in.
+class NodeArena
+{
+public:
+  // =============== Methods ================ //
+
+  // Creates an arena that takes memory chunkSize bytes at a time.
+  NodeArena(std::size_t chunkSize = 1 << 20);
+
+  // Returns an empty node with room for maxKeys keys (and maxKeys + 1 null pointers), recycled if one is free.
+  Node *allocate(int maxKeys);
+
+  // Takes back a node nothing will refer to once the current operation is over. The node can be a copy loaded from
+  // disk, as long as it was allocated by this arena. Recycling the same node twice only keeps it once.
+  void recycle(Node *node);
+
+  // Makes the nodes recycled so far available to allocate(). Call it between operations.
+  void release();
+
+  // Returns scratch space for count keys (or pointers). It stays valid until the next call asking for more.
+  float *scratchKeys(int count);
+  Address *scratchPointers(int count);
+
+  // Returns the number of chunks taken so far.
+  int getNumChunks() const
+  {
+    return chunks.size();
+  }
+
+  // Returns the number of nodes waiting to be handed out again.
+  int getNumFree() const;
+
+  // Destructor, gives all chunks back. Every node allocated is gone with them.
+  ~NodeArena();
+
+private:
+  // =============== Data ================ //
+
+  std::size_t chunkSize;     // Size of each chunk, unless a node needs a bigger one.
+  std::vector<char *> chunks; // Chunks taken so far, the last one being bumped through.
+  std::size_t chunkUsed;     // Bytes handed out from the last chunk.
+
+  std::unordered_map<int, std::vector<Node *>> freeNodes; // Nodes free to hand out, by number of keys.
+  std::vector<Node *> recycledNodes;                       // Nodes recycled during the current operation.
+
+  std::vector<float> keyScratch;       // Scratch keys for splits.
+  std::vector<Address> pointerScratch; // Scratch pointers for splits.
+
+  NodeArena(const NodeArena &) = delete;
+  NodeArena &operator=(const NodeArena &) = delete;
+
+  // Returns the bytes a node of maxKeys keys takes, its arrays and the header in front of it included.
+  static std::size_t nodeBytes(int maxKeys);
+};
+
+#endif
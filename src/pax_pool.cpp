@@ -0,0 +1,154 @@
+#include "pax_pool.h"
+#include "types.h"
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Records are appended block by block, and blocks are taken in order from one contiguous memory pool that never
+// frees any, so a full scan just walks the pool up to the current block.
+
+// Constructors
+
+PaxPool::PaxPool(std::size_t maxPoolSize, std::size_t blockSize)
+    : blocks(maxPoolSize, blockSize)
+{
+  this->maxPoolSize = maxPoolSize;
+  this->blockSize = blockSize;
+  this->recordsPerBlock = (blockSize - sizeof(int)) / (sizeof(float) + sizeof(int) + sizeof(Record::tconst));
+  this->numRecords = 0;
+  this->allocated = 0;
+
+  if (blockSize < sizeof(int) || recordsPerBlock < 1)
+  {
+    std::cout << "Error: Block size too small to hold a record (" << blockSize << ")! Increase block size to store data." << '\n';
+    throw std::invalid_argument("Block size too small!");
+  }
+
+  // Blocks are taken from the memory pool as records reach them, and read as all null until written to.
+  this->pool = nullptr;
+  this->block = nullptr;
+
+  this->blocksAccessed = 0;
+}
+
+// Methods
+
+Address PaxPool::saveRecord(const Record &record)
+{
+  // If no current block, or it is full, move on to the next block.
+  if (block == nullptr || *countOf(block) == recordsPerBlock)
+  {
+    block = blocks.allocate(blockSize).blockAddress;
+    if (pool == nullptr)
+    {
+      pool = block;
+    }
+    allocated++;
+  }
+
+  // Write each field into its own minipage.
+  int slot = *countOf(block);
+  ratingsOf(block)[slot] = record.averageRating;
+  votesOf(block)[slot] = record.numVotes;
+  std::memcpy(tconstsOf(block) + slot * sizeof(Record::tconst), record.tconst, sizeof(Record::tconst));
+  (*countOf(block))++;
+  numRecords++;
+
+  // Update blocks accessed
+  blocksAccessed++;
+
+  Address recordAddress = {block, (short int)slot};
+  return recordAddress;
+}
+
+Record PaxPool::loadRecord(Address address)
+{
+  // Stitch the record back together from the minipages.
+  Record record;
+  record.averageRating = ratingsOf(address.blockAddress)[address.offset];
+  record.numVotes = votesOf(address.blockAddress)[address.offset];
+  std::memcpy(record.tconst, tconstsOf(address.blockAddress) + address.offset * sizeof(Record::tconst), sizeof(Record::tconst));
+
+  // Update blocks accessed
+  blocksAccessed++;
+
+  return record;
+}
+
+std::vector<Record> PaxPool::scan(float minRating, float maxRating, int minVotes, int maxVotes)
+{
+  std::vector<Record> results;
+
+  for (int i = 0; i < allocated; i++)
+  {
+    scanBlock((char *)pool + i * blockSize, minRating, maxRating, minVotes, maxVotes, results);
+  }
+
+  // Update blocks accessed
+  blocksAccessed += allocated;
+
+  return results;
+}
+
+void PaxPool::scanBlock(void *blockAddress, float minRating, float maxRating, int minVotes, int maxVotes, std::vector<Record> &results)
+{
+  int count = *countOf(blockAddress);
+  const float *ratings = ratingsOf(blockAddress);
+  const int *votes = votesOf(blockAddress);
+  const char *tconsts = tconstsOf(blockAddress);
+
+  // Only matching records have their tconst read from its minipage.
+  auto addMatch = [&](int slot)
+  {
+    Record record;
+    record.averageRating = ratings[slot];
+    record.numVotes = votes[slot];
+    std::memcpy(record.tconst, tconsts + slot * sizeof(Record::tconst), sizeof(Record::tconst));
+    results.push_back(record);
+  };
+
+  int slot = 0;
+
+#ifdef __AVX2__
+  // Compare 8 ratings and 8 vote counts at a time, and get one bit per record that matches both predicates.
+  const __m256 minRatings = _mm256_set1_ps(minRating);
+  const __m256 maxRatings = _mm256_set1_ps(maxRating);
+  const __m256i minVoteCounts = _mm256_set1_epi32(minVotes);
+  const __m256i maxVoteCounts = _mm256_set1_epi32(maxVotes);
+
+  for (; slot + 8 <= count; slot += 8)
+  {
+    __m256 rating = _mm256_loadu_ps(ratings + slot);
+    __m256i voteCount = _mm256_loadu_si256((const __m256i *)(votes + slot));
+
+    __m256 ratingInRange = _mm256_and_ps(_mm256_cmp_ps(rating, minRatings, _CMP_GE_OQ), _mm256_cmp_ps(rating, maxRatings, _CMP_LE_OQ));
+    __m256i votesOutOfRange = _mm256_or_si256(_mm256_cmpgt_epi32(minVoteCounts, voteCount), _mm256_cmpgt_epi32(voteCount, maxVoteCounts));
+    int matches = _mm256_movemask_ps(_mm256_andnot_ps(_mm256_castsi256_ps(votesOutOfRange), ratingInRange));
+
+    while (matches != 0)
+    {
+      addMatch(slot + __builtin_ctz(matches));
+      matches &= matches - 1;
+    }
+  }
+#endif
+
+  // The records left over (or all of them, without AVX2) are compared one at a time.
+  for (; slot < count; slot++)
+  {
+    if (ratings[slot] >= minRating && ratings[slot] <= maxRating && votes[slot] >= minVotes && votes[slot] <= maxVotes)
+    {
+      addMatch(slot);
+    }
+  }
+}
+
+// Destructor, the memory pool of blocks unmaps them and gives their memory back to the budget.
+
+PaxPool::~PaxPool(){};
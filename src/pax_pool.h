@@ -0,0 +1,125 @@
+#ifndef PAX_POOL_H
+#define PAX_POOL_H
+
+#include "types.h"
+#include "memory_pool.h"
+
+#include <vector>
+#include <atomic>
+
+// A pool of record blocks in a columnar (PAX) layout. Each block keeps the records' fields in separate minipages:
+// a count of records, then every averageRating, then every numVotes, then every tconst. A scan that filters on
+// one field only reads that field's minipage, and the rating and votes minipages can be compared 8 at a time.
+// Records are addressed by their block and their slot within it (in place of a byte offset).
+class PaxPool
+{
+public:
+  // =============== Methods ================ //
+
+  // Creates a new pool with the following parameters:
+  // maxPoolSize: Maximum size of the pool.
+  // blockSize: The fixed size of each block in the pool.
+  // Its blocks come from a memory pool of their own, so memory is only committed to it as blocks reach it.
+  PaxPool(std::size_t maxPoolSize, std::size_t blockSize);
+
+  // Takes the memory committed to the pool out of a budget from now on, which other pools may share (or out of
+  // none, if null). It must be set before any record is saved.
+  void setBudget(MemoryBudget *budget)
+  {
+    blocks.setBudget(budget);
+  }
+
+  // Appends a record to the current block, taking a new block once it's full. Returns the record's address.
+  Address saveRecord(const Record &record);
+
+  // Returns a copy of the record at an address.
+  Record loadRecord(Address address);
+
+  // Scans every block and returns the records with averageRating in [minRating, maxRating] and numVotes in
+  // [minVotes, maxVotes]. Uses AVX2 when compiled with it (e.g. -mavx2), otherwise compares one record at a time.
+  std::vector<Record> scan(float minRating, float maxRating, int minVotes, int maxVotes);
+
+  // Returns the maximum size of this pool.
+  std::size_t getMaxPoolSize() const
+  {
+    return maxPoolSize;
+  }
+
+  // Returns the size of a block in the pool.
+  std::size_t getBlockSize() const
+  {
+    return blockSize;
+  }
+
+  // Returns the number of records each block holds.
+  int getRecordsPerBlock() const
+  {
+    return recordsPerBlock;
+  }
+
+  // Returns the number of records stored in the pool.
+  int getNumRecords() const
+  {
+    return numRecords;
+  }
+
+  // Returns number of currently allocated blocks.
+  int getAllocated() const
+  {
+    return allocated;
+  }
+
+  int getBlocksAccessed() const
+  {
+    return blocksAccessed;
+  }
+
+  int resetBlocksAccessed()
+  {
+    return blocksAccessed.exchange(0);
+  }
+
+  // Destructor
+  ~PaxPool();
+
+private:
+  // =============== Data ================ //
+
+  std::size_t maxPoolSize; // Maximum size allowed for pool.
+  std::size_t blockSize;   // Size of each block in pool in bytes.
+  int recordsPerBlock;     // Number of records that fit in a block, which sets the size of each minipage.
+
+  int numRecords;                  // Number of records stored.
+  int allocated;                   // Number of currently allocated blocks.
+  std::atomic<int> blocksAccessed; // Counts number of blocks accessed.
+
+  MemoryPool blocks; // Pool the blocks are taken from, in order and never given back.
+  void *pool;        // Pointer to the first block.
+  void *block;       // Current block pointer we are appending to.
+
+  // Minipages of a block: the record count sits at the start, followed by the three field arrays.
+  int *countOf(void *blockAddress) const
+  {
+    return (int *)blockAddress;
+  }
+
+  float *ratingsOf(void *blockAddress) const
+  {
+    return (float *)((char *)blockAddress + sizeof(int));
+  }
+
+  int *votesOf(void *blockAddress) const
+  {
+    return (int *)((char *)blockAddress + sizeof(int) + recordsPerBlock * sizeof(float));
+  }
+
+  char *tconstsOf(void *blockAddress) const
+  {
+    return (char *)blockAddress + sizeof(int) + recordsPerBlock * (sizeof(float) + sizeof(int));
+  }
+
+  // Finds the records of a block that match the predicates, and adds them to results.
+  void scanBlock(void *blockAddress, float minRating, float maxRating, int minVotes, int maxVotes, std::vector<Record> &results);
+};
+
+#endif
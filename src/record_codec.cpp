@@ -0,0 +1,329 @@
+#include "record_codec.h"
+#include "types.h"
+
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+
+// Layout of the 4-byte tconst: the low 27 bits hold the number (the 7 digits that fit in a tconst need 24), and the
+// bits above hold how many digits it was written with, so leading zeroes come back.
+static const int tconstDigitsShift = 27;
+static const std::uint32_t tconstNumberMask = (1u << tconstDigitsShift) - 1;
+static const unsigned char rawRecord = 255;
+
+// Writes a varint at encoded, returning the number of bytes written.
+static std::size_t putVarint(unsigned int value, unsigned char *encoded)
+{
+  std::size_t size = 0;
+  while (value >= 0x80)
+  {
+    encoded[size++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  encoded[size++] = value;
+  return size;
+}
+
+// Reads the varint at encoded into value, returning the number of bytes it took.
+static std::size_t getVarint(const unsigned char *encoded, unsigned int &value)
+{
+  std::size_t size = 0;
+  int shift = 0;
+  value = 0;
+  while (encoded[size] & 0x80)
+  {
+    value |= (unsigned int)(encoded[size++] & 0x7f) << shift;
+    shift += 7;
+  }
+  value |= (unsigned int)encoded[size++] << shift;
+  return size;
+}
+
+// Adds a column to the end of packed: its smallest value, the number of bits a value takes, and then each value
+// less the smallest in that many bits.
+static void packColumn(const std::vector<long long> &values, std::vector<unsigned char> &packed)
+{
+  long long reference = values.empty() ? 0 : *std::min_element(values.begin(), values.end());
+  unsigned long long maxDifference = 0;
+  for (long long value : values)
+  {
+    maxDifference = std::max(maxDifference, (unsigned long long)(value - reference));
+  }
+
+  unsigned char width = 0;
+  while (width < 64 && (maxDifference >> width) != 0)
+  {
+    width++;
+  }
+
+  packed.insert(packed.end(), (unsigned char *)&reference, (unsigned char *)&reference + sizeof(reference));
+  packed.push_back(width);
+
+  // Values are written low bits first. Fields come from 32-bit values, so a difference never needs more than 56 bits.
+  unsigned long long pending = 0;
+  int pendingBits = 0;
+  for (long long value : values)
+  {
+    pending |= (unsigned long long)(value - reference) << pendingBits;
+    pendingBits += width;
+    while (pendingBits >= 8)
+    {
+      packed.push_back(pending & 0xff);
+      pending >>= 8;
+      pendingBits -= 8;
+    }
+  }
+  if (pendingBits > 0)
+  {
+    packed.push_back(pending & 0xff);
+  }
+}
+
+// Reads a column of count values written by packColumn. Returns where the column ends.
+static const unsigned char *unpackColumn(const unsigned char *packed, int count, std::vector<long long> &values)
+{
+  long long reference;
+  std::memcpy(&reference, packed, sizeof(reference));
+  packed += sizeof(reference);
+  int width = *packed++;
+
+  unsigned long long mask = width == 64 ? ~0ull : (1ull << width) - 1;
+  unsigned long long pending = 0;
+  int pendingBits = 0;
+  values.clear();
+  for (int i = 0; i < count; i++)
+  {
+    while (pendingBits < width)
+    {
+      pending |= (unsigned long long)*packed++ << pendingBits;
+      pendingBits += 8;
+    }
+    values.push_back(reference + (long long)(pending & mask));
+    pending = width == 64 ? 0 : pending >> width;
+    pendingBits -= width;
+  }
+
+  return packed;
+}
+
+std::size_t RecordCodec::encode(const Record &record, unsigned char *encoded) const
+{
+  // The rating must come back as the exact same float.
+  bool fits = record.averageRating >= 0 && record.averageRating < 25.35f;
+  int tenths = fits ? (int)(record.averageRating * 10 + 0.5f) : 0;
+  fits = fits && (float)(tenths / 10.0) == record.averageRating;
+
+  // The tconst must be "tt" and its digits, and nothing else.
+  std::size_t length = strnlen(record.tconst, sizeof(Record::tconst));
+  std::uint32_t number = 0;
+  int digits = length - 2;
+  fits = fits && length < sizeof(Record::tconst) && digits >= 1 && record.tconst[0] == 't' && record.tconst[1] == 't';
+  for (int i = 0; fits && i < digits; i++)
+  {
+    char digit = record.tconst[2 + i];
+    fits = digit >= '0' && digit <= '9';
+    number = number * 10 + (digit - '0');
+  }
+
+  if (fits == false || record.numVotes < 0)
+  {
+    encoded[0] = rawRecord;
+    std::memcpy(encoded + 1, &record, sizeof(Record));
+    return 1 + sizeof(Record);
+  }
+
+  encoded[0] = tenths + 1;
+  std::uint32_t packedTconst = number | ((std::uint32_t)digits << tconstDigitsShift);
+  std::memcpy(encoded + 1, &packedTconst, sizeof(packedTconst));
+
+  return 1 + sizeof(packedTconst) + putVarint(record.numVotes, encoded + 1 + sizeof(packedTconst));
+}
+
+std::size_t RecordCodec::decode(const unsigned char *encoded, Record &record) const
+{
+  if (encoded[0] == rawRecord)
+  {
+    std::memcpy(&record, encoded + 1, sizeof(Record));
+    return 1 + sizeof(Record);
+  }
+
+  record.averageRating = (float)((encoded[0] - 1) / 10.0);
+
+  std::uint32_t packedTconst;
+  std::memcpy(&packedTconst, encoded + 1, sizeof(packedTconst));
+  // Formatted into room for any digit count the bits can hold, though an encoded tconst always fits in a record's.
+  char tconst[48];
+  std::size_t length = std::snprintf(tconst, sizeof(tconst), "tt%0*u", (int)(packedTconst >> tconstDigitsShift), (unsigned int)(packedTconst & tconstNumberMask));
+  std::memset(record.tconst, '\0', sizeof(Record::tconst));
+  std::memcpy(record.tconst, tconst, std::min(length, sizeof(Record::tconst) - 1));
+
+  unsigned int votes;
+  std::size_t size = 1 + sizeof(packedTconst) + getVarint(encoded + 1 + sizeof(packedTconst), votes);
+  record.numVotes = votes;
+
+  return size;
+}
+
+std::size_t RecordCodec::encodedSize(const unsigned char *encoded) const
+{
+  if (encoded[0] == rawRecord)
+  {
+    return 1 + sizeof(Record);
+  }
+
+  // Only the varint's last byte has its top bit clear.
+  std::size_t size = 1 + sizeof(std::uint32_t);
+  while (encoded[size] & 0x80)
+  {
+    size++;
+  }
+  return size + 1;
+}
+
+int RecordCodec::decodeBlock(const void *block, std::size_t size, std::vector<Record> &records, std::vector<short int> *offsets) const
+{
+  const unsigned char *data = (const unsigned char *)block;
+  int decoded = 0;
+
+  std::size_t offset = 0;
+  while (offset < size)
+  {
+    // A deallocated record is all zeroes, and no record starts with one.
+    if (data[offset] == 0)
+    {
+      offset++;
+      continue;
+    }
+
+    Record record;
+    std::size_t recordSize = decode(data + offset, record);
+    records.push_back(record);
+    if (offsets != nullptr)
+    {
+      offsets->push_back(offset);
+    }
+
+    offset += recordSize;
+    decoded++;
+  }
+
+  return decoded;
+}
+
+void RecordCodec::compressBlocks(const void *blocks, int numBlocks, std::size_t blockSize, std::vector<unsigned char> &compressed) const
+{
+  // Split the records into columns: how many each block has, the zeroes before each (left by deallocation), the
+  // first byte of each, and the tconst and votes of those that aren't stored raw. Raw records are kept as they are.
+  std::vector<long long> counts, gaps, firstBytes, firstTconst, tconsts, votes;
+  std::vector<unsigned char> rawRecords;
+  long long previousTconst = 0;
+
+  for (int b = 0; b < numBlocks; b++)
+  {
+    const unsigned char *block = (const unsigned char *)blocks + b * blockSize;
+    std::size_t offset = 0;
+    std::size_t gap = 0;
+    long long count = 0;
+
+    while (offset < blockSize)
+    {
+      if (block[offset] == 0)
+      {
+        offset++;
+        gap++;
+        continue;
+      }
+
+      std::size_t size = encodedSize(block + offset);
+      gaps.push_back(gap);
+      firstBytes.push_back(block[offset]);
+      if (block[offset] == rawRecord)
+      {
+        rawRecords.insert(rawRecords.end(), block + offset + 1, block + offset + size);
+      }
+      else
+      {
+        std::uint32_t packedTconst;
+        std::memcpy(&packedTconst, block + offset + 1, sizeof(packedTconst));
+        if (firstTconst.empty())
+        {
+          // The first tconst is stored on its own, so it doesn't widen the differences.
+          firstTconst.push_back(packedTconst);
+          previousTconst = packedTconst;
+        }
+        tconsts.push_back((long long)packedTconst - previousTconst);
+        previousTconst = packedTconst;
+
+        unsigned int numVotes;
+        getVarint(block + offset + 1 + sizeof(packedTconst), numVotes);
+        votes.push_back(numVotes);
+      }
+
+      offset += size;
+      gap = 0;
+      count++;
+    }
+    counts.push_back(count);
+  }
+
+  packColumn(counts, compressed);
+  packColumn(gaps, compressed);
+  packColumn(firstBytes, compressed);
+  packColumn(firstTconst, compressed);
+  packColumn(tconsts, compressed);
+  packColumn(votes, compressed);
+  compressed.insert(compressed.end(), rawRecords.begin(), rawRecords.end());
+}
+
+void RecordCodec::decompressBlocks(const unsigned char *compressed, int numBlocks, std::size_t blockSize, void *blocks) const
+{
+  std::vector<long long> counts, gaps, firstBytes, firstTconst, tconsts, votes;
+  compressed = unpackColumn(compressed, numBlocks, counts);
+
+  int numRecords = 0;
+  for (long long count : counts)
+  {
+    numRecords += count;
+  }
+  compressed = unpackColumn(compressed, numRecords, gaps);
+  compressed = unpackColumn(compressed, numRecords, firstBytes);
+
+  int numPacked = numRecords - std::count(firstBytes.begin(), firstBytes.end(), (long long)rawRecord);
+  compressed = unpackColumn(compressed, numPacked > 0 ? 1 : 0, firstTconst);
+  compressed = unpackColumn(compressed, numPacked, tconsts);
+  compressed = unpackColumn(compressed, numPacked, votes);
+  const unsigned char *rawRecords = compressed;
+
+  // Write each record back where it was, with zeroes everywhere else.
+  std::memset(blocks, '\0', numBlocks * blockSize);
+  int record = 0;
+  int packed = 0;
+  long long previousTconst = firstTconst.empty() ? 0 : firstTconst[0];
+  for (int b = 0; b < numBlocks; b++)
+  {
+    unsigned char *block = (unsigned char *)blocks + b * blockSize;
+    std::size_t offset = 0;
+
+    for (int i = 0; i < counts[b]; i++, record++)
+    {
+      offset += gaps[record];
+      block[offset] = firstBytes[record];
+      if (firstBytes[record] == rawRecord)
+      {
+        std::memcpy(block + offset + 1, rawRecords, sizeof(Record));
+        rawRecords += sizeof(Record);
+        offset += 1 + sizeof(Record);
+        continue;
+      }
+
+      previousTconst += tconsts[packed];
+      std::uint32_t packedTconst = previousTconst;
+      std::memcpy(block + offset + 1, &packedTconst, sizeof(packedTconst));
+      offset += 1 + sizeof(packedTconst);
+      offset += putVarint(votes[packed], block + offset);
+      packed++;
+    }
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef RECORD_CODEC_H
+#define RECORD_CODEC_H
+
+#include "types.h"
+
+#include <cstddef>
+#include <vector>
+
+// Packs a record into far fewer bytes than sizeof(Record), so more of them fit in a block. An encoded record is:
+// one byte of averageRating * 10 + 1, the tconst as a 4-byte number (its digits, plus how many there were, after
+// the "tt"), and numVotes as a varint (7 bits a byte, low bits first). That is 6 to 10 bytes, usually 7 or 8.
+// A record that can't be packed this way (a rating that isn't a whole tenth up to 25.3, a tconst that isn't "tt"
+// and digits, or negative votes) is stored as a 255 byte followed by the record as it is.
+// The first byte of an encoded record is never 0, so the zeroes left behind by deallocation can be told apart
+// from the start of the next record, and a block can be decoded from start to end without knowing where each
+// record is.
+class RecordCodec
+{
+public:
+  // Most bytes a record can be encoded to.
+  static const std::size_t maxEncodedSize = 1 + sizeof(Record);
+
+  // Encodes a record into encoded, which must have room for maxEncodedSize bytes. Returns the number of bytes used.
+  std::size_t encode(const Record &record, unsigned char *encoded) const;
+
+  // Decodes the record starting at encoded. Returns the number of bytes it took.
+  std::size_t decode(const unsigned char *encoded, Record &record) const;
+
+  // Returns the number of bytes taken by the record starting at encoded, without decoding it.
+  std::size_t encodedSize(const unsigned char *encoded) const;
+
+  // Decodes every record in the first size bytes of a block, skipping the gaps left by deallocation, and adds them
+  // (and their offsets in the block, if offsets isn't null) to the end of records. Returns the number decoded.
+  int decodeBlock(const void *block, std::size_t size, std::vector<Record> &records, std::vector<short int> *offsets = nullptr) const;
+
+  // Compresses numBlocks consecutive blocks of blockSize bytes, holding records encoded by this codec, and adds them
+  // to the end of compressed. Each field becomes a column, stored as its smallest value (frame of reference) and
+  // every value's difference from it packed into as few bits as the largest difference needs. A tconst is stored as
+  // its difference from the previous record's, so records saved in tconst order take a bit or two for it.
+  void compressBlocks(const void *blocks, int numBlocks, std::size_t blockSize, std::vector<unsigned char> &compressed) const;
+
+  // Restores blocks compressed by compressBlocks, byte for byte, into blocks.
+  void decompressBlocks(const unsigned char *compressed, int numBlocks, std::size_t blockSize, void *blocks) const;
+};
+
+#endif
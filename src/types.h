@@ -16,4 +16,34 @@ struct Record
   int numVotes;        // Number of votes of this movie.
 };
 
-#endif
\ No newline at end of file
+// Defines which field of a record a query ranks its results by.
+enum RecordField
+{
+  AVERAGE_RATING, // Rank by averageRating.
+  NUM_VOTES       // Rank by numVotes.
+};
+
+// Defines how a range search reads its records.
+enum ScanPlan
+{
+  INDEX_SCAN,     // Walk the leaves and load each record through its own pointer, in key order.
+  BITMAP_SCAN,    // Collect the record pointers from the leaves, then load each data block they point into once.
+  SEQUENTIAL_SCAN // Skip the index and read every data block, keeping the records in range.
+};
+
+// Defines how a full node is split when a key is inserted into it.
+enum SplitPolicy
+{
+  EVEN_SPLIT,        // Always split roughly in half.
+  RIGHT_BIASED_SPLIT // Split in half, except when appending past the last key of the tree, where the left node is kept at the fill factor.
+};
+
+// Defines the pages the memory of a pool is mapped with.
+enum PoolPages
+{
+  NORMAL_PAGES,  // The system's usual pages.
+  HUGE_PAGES,    // Usual pages the system is asked to back with transparent huge pages (madvise) where it can.
+  HUGETLB_PAGES  // Huge pages reserved with the system (MAP_HUGETLB), or huge pages as above if none are reserved.
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include "work_stealing_pool.h"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A queue of task indices owned by one worker.
+struct TaskQueue
+{
+  std::deque<int> tasks;
+  std::mutex lock;
+};
+
+// Constructors
+
+WorkStealingPool::WorkStealingPool(int numThreads)
+{
+  this->numThreads = numThreads > 0 ? numThreads : 1;
+}
+
+// Methods
+
+void WorkStealingPool::run(int numTasks, const std::function<void(int)> &task)
+{
+  // Deal the tasks out round robin, so neighbouring tasks start on different workers.
+  std::vector<TaskQueue> queues(numThreads);
+  for (int i = 0; i < numTasks; i++)
+  {
+    queues[i % numThreads].tasks.push_back(i);
+  }
+
+  auto worker = [&](int self)
+  {
+    while (true)
+    {
+      int next = -1;
+
+      // Take the most recently queued task from our own queue first.
+      {
+        std::lock_guard<std::mutex> guard(queues[self].lock);
+        if (!queues[self].tasks.empty())
+        {
+          next = queues[self].tasks.back();
+          queues[self].tasks.pop_back();
+        }
+      }
+
+      // Else steal the oldest task from another worker's queue.
+      for (int i = 1; next == -1 && i < numThreads; i++)
+      {
+        TaskQueue &victim = queues[(self + i) % numThreads];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+          next = victim.tasks.front();
+          victim.tasks.pop_front();
+        }
+      }
+
+      // Every queue is empty, so we're done.
+      if (next == -1)
+      {
+        return;
+      }
+
+      task(next);
+    }
+  };
+
+  // The calling thread works as worker 0.
+  std::vector<std::thread> threads;
+  for (int i = 1; i < numThreads; i++)
+  {
+    threads.push_back(std::thread(worker, i));
+  }
+  worker(0);
+
+  for (std::thread &thread : threads)
+  {
+    thread.join();
+  }
+}
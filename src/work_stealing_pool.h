@@ -0,0 +1,31 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <functional>
+
+// A pool of worker threads that run a batch of independent tasks.
+// Each worker has its own queue of tasks, and steals from the other queues once its own runs dry.
+class WorkStealingPool
+{
+public:
+  // =============== Methods ================ //
+
+  // Creates a pool that runs tasks on numThreads threads.
+  WorkStealingPool(int numThreads);
+
+  // Runs task(i) for every i in [0, numTasks) and waits for all of them to finish.
+  void run(int numTasks, const std::function<void(int)> &task);
+
+  // Returns the number of worker threads.
+  int getNumThreads() const
+  {
+    return numThreads;
+  }
+
+private:
+  // =============== Data ================ //
+
+  int numThreads; // Number of worker threads.
+};
+
+#endif